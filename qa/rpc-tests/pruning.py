@@ -0,0 +1,107 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Redux developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test -prune: block files are deleted once they no longer fit in the
+# target, and RPCs on pruned blocks behave.
+#
+# This mines about 600MB of blocks, so it takes a while. Pruning needs
+# -litemode.
+#
+from test_framework import BitcoinTestFramework
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+import os.path
+
+def calc_usage(blockdir):
+    return sum(os.path.getsize(blockdir+f) for f in os.listdir(blockdir) if os.path.isfile(blockdir+f)) / (1024.0 * 1024.0)
+
+def gen_return_txouts():
+    # 128 outputs of a 512 byte OP_RETURN script each, spliced into a
+    # transaction in place of its output count: about 66kB per transaction
+    script_pubkey = "6a4d0200" # OP_RETURN OP_PUSHDATA2 512
+    for i in xrange(512):
+        script_pubkey = script_pubkey + "01"
+    txouts = "81"
+    for k in xrange(128):
+        txouts = txouts + "0000000000000000" + "fd0402" + script_pubkey
+    return txouts
+
+class PruneTest(BitcoinTestFramework):
+
+    def __init__(self):
+        self.utxo = []
+        self.txouts = gen_return_txouts()
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir,
+                                     ["-debug=prune", "-prune=550", "-litemode", "-blockmaxsize=999000", "-minrelaytxfee=0.00001"]))
+        self.prunedir = self.options.tmpdir+"/node0/regtest/blocks/"
+
+    def mine_full_block(self, node, address):
+        # Fill a block with 14 big transactions; each pays its change back
+        # to be spent again once it has confirmed
+        if len(self.utxo) < 14:
+            self.utxo = node.listunspent()
+        for i in xrange(14):
+            t = self.utxo.pop()
+            inputs = [{ "txid" : t["txid"], "vout" : t["vout"]}]
+            outputs = { address : t["amount"] - Decimal("0.01") }
+            rawtx = node.createrawtransaction(inputs, outputs)
+            newtx = rawtx[0:92] + self.txouts + rawtx[94:]
+            signresult = node.signrawtransaction(newtx, None, None, "NONE")
+            node.sendrawtransaction(signresult["hex"], True)
+        node.setgenerate(True, 1)
+
+    def run_test(self):
+        node = self.nodes[0]
+        address = node.getnewaddress()
+        assert_equal(node.getblockchaininfo()["pruned"], True)
+
+        print "Mining full blocks until the first block file is pruned"
+        blocks = 0
+        while os.path.isfile(self.prunedir+"blk00000.dat"):
+            assert blocks < 1000, "blk00000.dat was never pruned"
+            self.mine_full_block(node, address)
+            blocks += 1
+        print "blk00000.dat pruned after %d blocks, usage: %.1f MiB" % (blocks, calc_usage(self.prunedir))
+
+        # Block and undo files stay within the target, with room for one more allocation
+        assert calc_usage(self.prunedir) < 550 + 17
+
+        info = node.getblockchaininfo()
+        assert_equal(info["pruned"], True)
+        pruneheight = info["pruneheight"]
+        assert pruneheight > 1
+        # The last GetPruneKeepDepth() blocks are kept
+        assert node.getblockcount() - pruneheight >= 288
+
+        # A pruned block is gone, but its header is still in the block index
+        pruned = node.getblockhash(1)
+        try:
+            node.getblock(pruned)
+            raise AssertionError("getblock returned a pruned block")
+        except JSONRPCException as e:
+            assert "pruned" in e.error["message"]
+        header = node.getblockheader(pruned)
+        assert_equal(header["hash"], pruned)
+        assert_equal(header["height"], 1)
+        assert_equal(len(node.getblockheader(pruned, False)), 160)
+
+        # Blocks from the prune height up are all there
+        node.getblock(node.getblockhash(pruneheight))
+        node.getblock(node.getbestblockhash())
+
+        # Pruning is remembered across restarts
+        stop_node(node, 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-prune=550", "-litemode"])
+        assert_equal(self.nodes[0].getblockchaininfo()["pruneheight"], pruneheight)
+        assert_equal(self.nodes[0].getblockheader(pruned)["height"], 1)
+        print "Success"
+
+if __name__ == '__main__':
+    PruneTest().main()
@@ -0,0 +1,159 @@
+// Copyright (c) 2016 The Redux developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+#include <map>
+
+#include <boost/foreach.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    fShortIDKey(false), header(block.GetBlockHeader()), nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+    shorttxids(block.vtx.empty() ? 0 : block.vtx.size() - 1), prefilledtxn(1)
+{
+    assert(!block.vtx.empty());
+    prefilledtxn[0].index = 0;
+    prefilledtxn[0].tx = block.vtx[0];
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        shorttxids[i - 1] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    uint256 hashKey;
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize((unsigned char*)&hashKey);
+    nShortIDKey0 = hashKey.Get64(0);
+    nShortIDKey1 = hashKey.Get64(1);
+    fShortIDKey = true;
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    if (!fShortIDKey)
+        FillShortTxIDSelector();
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+CBlockTransactions::CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req) :
+    blockhash(req.blockhash), txn(req.indexes.size())
+{
+    for (size_t i = 0; i < req.indexes.size(); i++) {
+        assert(req.indexes[i] < block.vtx.size());
+        txn[i] = block.vtx[req.indexes[i]];
+    }
+}
+
+ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    SetNull();
+
+    // The smallest transaction still takes up this much of a block, and
+    // transactions are indexed by uint16_t here and in getblocktxn
+    static const size_t nMinTxSize = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+    if (cmpctblock.header.IsNull() || cmpctblock.BlockTxCount() == 0 ||
+        cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / nMinTxSize ||
+        cmpctblock.BlockTxCount() > std::numeric_limits<uint16_t>::max())
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.resize(cmpctblock.BlockTxCount());
+    vAvailable.resize(cmpctblock.BlockTxCount(), false);
+
+    // Prefilled transactions go where they say; the short IDs fill the gaps in order
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn) {
+        if (prefilled.index >= vtx.size() || vAvailable[prefilled.index] || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.index] = prefilled.tx;
+        vAvailable[prefilled.index] = true;
+    }
+
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    size_t nShortID = 0;
+    for (size_t i = 0; i < vtx.size() && nShortID < cmpctblock.shorttxids.size(); i++) {
+        if (vAvailable[i])
+            continue;
+        // Two transactions of the block with one short ID: the sender
+        // could only rebuild it by chance, so don't try
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[nShortID++], (uint16_t)i)).second)
+            return READ_STATUS_FAILED;
+    }
+    if (nShortID != cmpctblock.shorttxids.size())
+        return READ_STATUS_INVALID;
+
+    // A place two mempool transactions match is left for getblocktxn
+    std::vector<bool> vCollided(vtx.size(), false);
+    size_t nFound = 0;
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = pool.mapTx.begin();
+             it != pool.mapTx.end() && nFound < mapShortIDs.size(); it++) {
+            const CTransaction& tx = it->GetTx();
+            std::map<uint64_t, uint16_t>::const_iterator itID = mapShortIDs.find(cmpctblock.GetShortID(tx.GetHash()));
+            if (itID == mapShortIDs.end() || vCollided[itID->second])
+                continue;
+            if (vAvailable[itID->second]) {
+                vAvailable[itID->second] = false;
+                vCollided[itID->second] = true;
+                nFound--;
+                continue;
+            }
+            vtx[itID->second] = tx;
+            vAvailable[itID->second] = true;
+            nFound++;
+        }
+    }
+    nFromMempool = nFound;
+
+    LogPrint("cmpctblock", "Initialized compact block %s: %u transactions, %u prefilled, %u from mempool\n",
+        header.GetHash().ToString(), vtx.size(), cmpctblock.prefilledtxn.size(), nFromMempool);
+    return READ_STATUS_OK;
+}
+
+CBlockTransactionsRequest CPartiallyDownloadedBlock::GetMissing() const
+{
+    CBlockTransactionsRequest req;
+    req.blockhash = header.GetHash();
+    for (size_t i = 0; i < vAvailable.size(); i++)
+        if (!vAvailable[i])
+            req.indexes.push_back(i);
+    return req;
+}
+
+ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    assert(!vtx.empty());
+
+    block = CBlock(header);
+    block.vtx = vtx;
+    size_t nMissing = 0;
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        if (vAvailable[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A short ID that matched the wrong mempool transaction shows up here;
+    // everything else about the block is left to CheckBlock
+    bool fMutated;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated) {
+        block.SetNull();
+        return READ_STATUS_FAILED;
+    }
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,259 @@
+// Copyright (c) 2016 The Redux developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay (see COMPACT_BLOCKS_VERSION): a block is sent as its
+ * header and a short ID for every transaction, from which the receiver
+ * rebuilds it out of its own mempool, asking with "getblocktxn" only for the
+ * transactions it doesn't have.
+ */
+
+//! Bytes of a short transaction ID on the wire
+static const unsigned int SHORTTXID_BYTES = 6;
+//! Only blocks this close to the tip are served as compact blocks, older ones in full
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+/** Outcome of rebuilding a block from a compact block */
+enum ReadStatus {
+    READ_STATUS_OK,
+    //! the peer sent something malformed
+    READ_STATUS_INVALID,
+    //! couldn't rebuild the block (e.g. a short ID collision); ask for it in full
+    READ_STATUS_FAILED
+};
+
+/**
+ * Reads or writes a list of uint16_t indexes in ascending order, each as a
+ * compact size holding its distance from the one before, so that the usual
+ * runs of neighbouring transactions take a byte per index.
+ */
+template<typename Stream>
+void WriteDifferentialIndex(Stream& s, uint16_t nIndex, int& nPrev)
+{
+    WriteCompactSize(s, nIndex - (nPrev + 1));
+    nPrev = nIndex;
+}
+
+template<typename Stream>
+uint16_t ReadDifferentialIndex(Stream& s, int& nPrev)
+{
+    uint64_t nIndex = ReadCompactSize(s) + (nPrev + 1);
+    if (nIndex > std::numeric_limits<uint16_t>::max())
+        throw std::ios_base::failure("differential index overflow");
+    nPrev = nIndex;
+    return nIndex;
+}
+
+/** A transaction sent in full in a compact block, such as the coinbase */
+struct CPrefilledTransaction
+{
+    //! index in the block, differentially encoded on the wire
+    uint16_t index;
+    CTransaction tx;
+};
+
+/** The "cmpctblock" message */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+    mutable bool fShortIDKey;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    CBlockHeader header;
+    uint64_t nonce;
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : fShortIDKey(false), nonce(0) {}
+    //! Encodes block, sending its coinbase in full
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    /**
+     * The short ID of a transaction in this block: SipHash-2-4 of its txid,
+     * keyed by a SHA256 of the header and nonce, truncated to SHORTTXID_BYTES.
+     * The per-message nonce keeps anyone from lining up collisions in advance.
+     */
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    //! Transactions in the block, short IDs and prefilled together
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t nLow = shorttxids[i];
+            uint16_t nHigh = shorttxids[i] >> 32;
+            ::Serialize(s, nLow, nType, nVersion);
+            ::Serialize(s, nHigh, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        int nPrev = -1;
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteDifferentialIndex(s, prefilledtxn[i].index, nPrev);
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        fShortIDKey = false;
+
+        // Indexes are 16 bits, so larger counts can only be garbage;
+        // checked before anything is allocated for them
+        uint64_t nShortIDs = ReadCompactSize(s);
+        if (nShortIDs > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("too many short txids");
+        shorttxids.resize(nShortIDs);
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t nLow;
+            uint16_t nHigh;
+            ::Unserialize(s, nLow, nType, nVersion);
+            ::Unserialize(s, nHigh, nType, nVersion);
+            shorttxids[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        uint64_t nPrefilled = ReadCompactSize(s);
+        if (nPrefilled > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("too many prefilled transactions");
+        prefilledtxn.resize(nPrefilled);
+        int nPrev = -1;
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            prefilledtxn[i].index = ReadDifferentialIndex(s, nPrev);
+            ::Unserialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+    }
+};
+
+/** The "getblocktxn" message: the transactions of a compact block we couldn't find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! ascending
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, indexes.size());
+        int nPrev = -1;
+        for (size_t i = 0; i < indexes.size(); i++)
+            WriteDifferentialIndex(s, indexes[i], nPrev);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nIndexes = ReadCompactSize(s);
+        if (nIndexes > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("too many requested indexes");
+        indexes.resize(nIndexes);
+        int nPrev = -1;
+        for (size_t i = 0; i < indexes.size(); i++)
+            indexes[i] = ReadDifferentialIndex(s, nPrev);
+    }
+};
+
+/** The "blocktxn" message: the transactions asked for by a "getblocktxn", in its order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    CBlockTransactions() {}
+    //! The transactions of block that req asks for; req must be within the block
+    CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/**
+ * A block being rebuilt from a compact block: the transactions found in the
+ * prefilled list or the mempool, and the places still missing.
+ */
+class CPartiallyDownloadedBlock
+{
+private:
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vAvailable;
+
+public:
+    //! Number of transactions that came from the mempool
+    size_t nFromMempool;
+
+    CPartiallyDownloadedBlock() : nFromMempool(0) {}
+
+    //! Hash of the block being rebuilt, or 0 if none
+    uint256 GetHash() const { return vtx.empty() ? uint256(0) : header.GetHash(); }
+
+    /** Fills in what cmpctblock and pool provide. Locks pool.cs. */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+
+    //! The transactions still missing, as a request for them
+    CBlockTransactionsRequest GetMissing() const;
+
+    /**
+     * Completes the block with vtxMissing, the transactions GetMissing()
+     * asked for, and checks it against the header's merkle root.
+     */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+
+    void SetNull()
+    {
+        header.SetNull();
+        vtx.clear();
+        vAvailable.clear();
+        nFromMempool = 0;
+    }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,7 +18,7 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -25,11 +27,24 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Pending verifications are spread over a number of deques, each with its
+  * own lock. Every worker has a home deque it takes work from at the back;
+  * when that runs dry it steals from the front of the others. The shared
+  * lock is only taken by the master when adding work and by a worker when
+  * it runs out of work altogether, so workers that are busy do not contend
+  * with each other or with the master.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    //! One deque of pending verifications, with the lock protecting it
+    struct WorkQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -39,9 +54,23 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The deques of elements to be processed
+    boost::scoped_array<WorkQueue> queues;
+
+    //! The number of deques in queues
+    unsigned int nQueues;
+
+    //! The number of worker threads (excluding the master) that ever joined
+    unsigned int nWorkers;
+
+    //! The deque the next call to Add starts filling
+    unsigned int nNextQueue;
+
+    /**
+     * Bumped every time work is added. An idle worker sleeps until this
+     * changes, so work added after it last looked is never missed.
+     */
+    unsigned int nGeneration;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
@@ -54,8 +83,8 @@ private:
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
-     * worker's own batches.
+     * This includes elements that are not anymore in the deques, but
+     * were taken by a worker that has not reported back yet.
      */
     unsigned int nTodo;
 
@@ -65,70 +94,110 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Take a batch of work, from the back of our own deque or else from the
+     * front of another one. Batches are at most half of what is left in the
+     * deque, so they shrink as the deque empties and the remainder stays
+     * available to other workers.
+     */
+    bool Take(unsigned int nHome, std::vector<T>& vChecks)
+    {
+        for (unsigned int i = 0; i < nQueues; i++) {
+            WorkQueue& work = queues[(nHome + i) % nQueues];
+            boost::unique_lock<boost::mutex> lock(work.mutex);
+            if (work.queue.empty())
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(work.queue.size() / 2)));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // swap jobs out rather than copying them, to keep the lock short
+                if (i == 0) {
+                    vChecks[j].swap(work.queue.back());
+                    work.queue.pop_back();
+                } else {
+                    vChecks[j].swap(work.queue.front());
+                    work.queue.pop_front();
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    //! Drop all pending work after a failure, returning how many elements were dropped
+    unsigned int Discard()
+    {
+        unsigned int nDropped = 0;
+        for (unsigned int i = 0; i < nQueues; i++) {
+            boost::unique_lock<boost::mutex> lock(queues[i].mutex);
+            nDropped += queues[i].queue.size();
+            queues[i].queue.clear();
+        }
+        return nDropped;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
+        unsigned int nHome = 0;
+        unsigned int nSeen;
+        unsigned int nDone = 0;
         bool fOk = true;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTotal++;
+            if (!fMaster)
+                nHome = nWorkers++ % nQueues;
+            nSeen = nGeneration;
+        }
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+            if (Take(nHome, vChecks)) {
+                // execute work
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                nDone += vChecks.size();
+                vChecks.clear();
+                if (fOk)
+                    continue;
+                // no point in finishing the rest; drop it and report right away
+                nDone += Discard();
+            }
+
+            // Out of work (or failed): report what we did, then wait for more
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAllOk &= fOk;
+            fOk = true;
+            nTodo -= nDone;
+            nDone = 0;
+            if (nTodo == 0 && !fMaster)
+                // We processed the last element; inform the master he can exit and return the result
+                condMaster.notify_one();
+            // Nothing is left to take when all work is accounted for, even if some was added since we last looked
+            while (nGeneration == nSeen || nTodo == 0) {
+                if ((fMaster || fQuit) && nTodo == 0) {
+                    nTotal--;
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    if (fMaster)
+                        fAllOk = true;
+                    // return the current status
+                    return fRet;
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                nIdle++;
+                cond.wait(lock); // wait
+                nIdle--;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nSeen = nGeneration;
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, spreading work over nQueuesIn deques
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nQueuesIn = 1) : queues(new WorkQueue[std::max(1U, nQueuesIn)]), nQueues(std::max(1U, nQueuesIn)), nWorkers(0), nNextQueue(0), nGeneration(0), nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
@@ -145,15 +214,39 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+
+        unsigned int nFirst, nSpread;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // a check already failed; the result will not change
+            if (!fAllOk)
+                return;
+            nTodo += vChecks.size();
+            nFirst = nNextQueue;
+            nSpread = std::max(1U, std::min(nQueues, nWorkers));
+            nNextQueue = (nNextQueue + 1) % nQueues;
+        }
+
+        // Hand out contiguous runs, one per worker deque
+        unsigned int nPer = (vChecks.size() + nSpread - 1) / nSpread;
+        unsigned int nPos = 0;
+        for (unsigned int i = 0; nPos < vChecks.size(); i++) {
+            WorkQueue& work = queues[(nFirst + i) % nQueues];
+            unsigned int nEnd = std::min((unsigned int)vChecks.size(), nPos + nPer);
+            boost::unique_lock<boost::mutex> lock(work.mutex);
+            for (; nPos < nEnd; nPos++) {
+                work.queue.push_back(T());
+                vChecks[nPos].swap(work.queue.back());
+            }
         }
-        nTodo += vChecks.size();
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGeneration++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -161,15 +254,20 @@ public:
     {
     }
 
+    /**
+     * Whether no work is outstanding. A worker may still be on its way to
+     * sleep after looking through the (empty) deques, so this does not
+     * require every worker to be idle.
+     */
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -0,0 +1,121 @@
+// Copyright (c) 2016 The Redux developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashx11.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace {
+
+/** Initialized X11 contexts, copied into the working contexts for every message. */
+class CX11Templates
+{
+public:
+    sph_blake512_context     blake;
+    sph_bmw512_context       bmw;
+    sph_groestl512_context   groestl;
+    sph_skein512_context     skein;
+    sph_jh512_context        jh;
+    sph_keccak512_context    keccak;
+    sph_luffa512_context     luffa;
+    sph_cubehash512_context  cubehash;
+    sph_shavite512_context   shavite;
+    sph_simd512_context      simd;
+    sph_echo512_context      echo;
+
+    CX11Templates()
+    {
+        sph_blake512_init(&blake);
+        sph_bmw512_init(&bmw);
+        sph_groestl512_init(&groestl);
+        sph_skein512_init(&skein);
+        sph_jh512_init(&jh);
+        sph_keccak512_init(&keccak);
+        sph_luffa512_init(&luffa);
+        sph_cubehash512_init(&cubehash);
+        sph_shavite512_init(&shavite);
+        sph_simd512_init(&simd);
+        sph_echo512_init(&echo);
+    }
+};
+
+const CX11Templates x11templates;
+
+/** Run one 64-byte X11 round over every lane, in place. */
+#define X11_ROUND(name, lanes, nLanes) do { \
+    sph_##name##512_context ctx; \
+    for (size_t i = 0; i < (nLanes); i++) { \
+        memcpy(&ctx, &x11templates.name, sizeof(ctx)); \
+        sph_##name##512(&ctx, static_cast<const void*>(&(lanes)[i]), 64); \
+        sph_##name##512_close(&ctx, static_cast<void*>(&(lanes)[i])); \
+    } \
+} while (0)
+
+/** The ten rounds after blake512, over every lane, and the final truncation. */
+void X11Rounds(uint512 lanes[], size_t nLanes, uint256 pout[])
+{
+    X11_ROUND(bmw, lanes, nLanes);
+    X11_ROUND(groestl, lanes, nLanes);
+    X11_ROUND(skein, lanes, nLanes);
+    X11_ROUND(jh, lanes, nLanes);
+    X11_ROUND(keccak, lanes, nLanes);
+    X11_ROUND(luffa, lanes, nLanes);
+    X11_ROUND(cubehash, lanes, nLanes);
+    X11_ROUND(shavite, lanes, nLanes);
+    X11_ROUND(simd, lanes, nLanes);
+    X11_ROUND(echo, lanes, nLanes);
+
+    for (size_t i = 0; i < nLanes; i++)
+        pout[i] = lanes[i].trim256();
+}
+
+}
+
+void HashX11Batch(const unsigned char* const pinputs[], size_t nLen, size_t nCount, uint256 pout[])
+{
+    static const unsigned char pblank[1] = {};
+    uint512 lanes[X11_BATCH_LANES];
+
+    for (size_t nDone = 0; nDone < nCount; nDone += X11_BATCH_LANES) {
+        const size_t nLanes = std::min(X11_BATCH_LANES, nCount - nDone);
+
+        sph_blake512_context ctx_blake;
+        for (size_t i = 0; i < nLanes; i++) {
+            memcpy(&ctx_blake, &x11templates.blake, sizeof(ctx_blake));
+            sph_blake512(&ctx_blake, nLen ? static_cast<const void*>(pinputs[nDone + i]) : pblank, nLen);
+            sph_blake512_close(&ctx_blake, static_cast<void*>(&lanes[i]));
+        }
+
+        X11Rounds(lanes, nLanes, pout + nDone);
+    }
+}
+
+CX11HeaderHasher::CX11HeaderHasher(const unsigned char* pprefix)
+{
+    memcpy(&ctxPrefix, &x11templates.blake, sizeof(ctxPrefix));
+    sph_blake512(&ctxPrefix, pprefix, 76);
+}
+
+void CX11HeaderHasher::Hash(uint32_t nNonceBegin, size_t nCount, uint256 pout[]) const
+{
+    uint512 lanes[X11_BATCH_LANES];
+
+    for (size_t nDone = 0; nDone < nCount; nDone += X11_BATCH_LANES) {
+        const size_t nLanes = std::min(X11_BATCH_LANES, nCount - nDone);
+
+        sph_blake512_context ctx_blake;
+        for (size_t i = 0; i < nLanes; i++) {
+            // the nonce as it sits in CBlockHeader, which GetHash() hashes in place
+            uint32_t nNonce = nNonceBegin + nDone + i;
+            memcpy(&ctx_blake, &ctxPrefix, sizeof(ctx_blake));
+            sph_blake512(&ctx_blake, &nNonce, sizeof(nNonce));
+            sph_blake512_close(&ctx_blake, static_cast<void*>(&lanes[i]));
+        }
+
+        X11Rounds(lanes, nLanes, pout + nDone);
+    }
+}
+
+#undef X11_ROUND
@@ -0,0 +1,53 @@
+// Copyright (c) 2016 The Redux developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HASHX11_H
+#define BITCOIN_HASHX11_H
+
+#include "hash.h"
+#include "uint256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Batched X11 hashing for the miner and block header checks. Kept out of
+ * hash.cpp, which is also built into libbitcoinconsensus, where the sph_*
+ * primitives aren't linked.
+ */
+
+/** Maximum number of messages HashX11Batch keeps in flight per round. */
+static const size_t X11_BATCH_LANES = 8;
+
+/**
+ * Compute HashX11 over nCount messages of nLen bytes each (typically serialized
+ * block headers) and store the results in pout[0..nCount). The messages are
+ * processed in groups of up to X11_BATCH_LANES, running each of the eleven
+ * rounds across the whole group before moving to the next one, so the tables
+ * and code of a single primitive stay hot in cache. Contexts are copied from
+ * pre-initialized templates instead of being set up for every message.
+ * Results are bit-identical to calling HashX11 on each message.
+ */
+void HashX11Batch(const unsigned char* const pinputs[], size_t nLen, size_t nCount, uint256 pout[]);
+
+/**
+ * HashX11 over 80-byte block headers that share their first 76 bytes and
+ * differ only in the nonce, as when searching for proof of work. The
+ * blake512 state after the shared prefix is set up once; each nonce then
+ * only adds its own four bytes before the batched rounds.
+ */
+class CX11HeaderHasher
+{
+private:
+    sph_blake512_context ctxPrefix;
+
+public:
+    //! pprefix points to the first 76 bytes of a serialized block header
+    explicit CX11HeaderHasher(const unsigned char* pprefix);
+
+    //! Hash the headers with nonces nNonceBegin .. nNonceBegin + nCount - 1 into pout[0..nCount)
+    void Hash(uint32_t nNonceBegin, size_t nCount, uint256 pout[]) const;
+};
+
+#endif // BITCOIN_HASHX11_H
@@ -24,6 +24,7 @@ std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
+CCriticalSection cs_instantx;
 
 //txlock - Locks transaction
 //
@@ -38,6 +39,8 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
     if(!IsSporkActive(SPORK_2_INSTANTX)) return;
     if(!masterxSync.IsBlockchainSynced()) return;
 
+    LOCK(cs_instantx);
+
     if (strCommand == "ix")
     {
         //LogPrintf("ProcessMessageInstantX::ix\n");
@@ -161,7 +164,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                     mapUnknownVotes[ctx.vinMasterX.prevout.hash] = GetTime()+(60*10);
                 }
             }
-            RelayInv(inv);
+            RelayInv(inv, GetSignedMessageProtoVersion(ctx.nMessageVersion));
         }
 
         return;
@@ -180,12 +183,9 @@ bool IsIXTXValid(const CTransaction& txCollateral){
         nValueOut += o.nValue;
 
     BOOST_FOREACH(const CTxIn i, txCollateral.vin){
-        CTransaction tx2;
-        uint256 hash;
-        if(GetTransaction(i.prevout.hash, tx2, hash, true)){
-            if(tx2.vout.size() > i.prevout.n) {
-                nValueIn += tx2.vout[i.prevout.n].nValue;
-            }
+        CTxOut txout;
+        if(GetUnspentOutput(i.prevout, txout)){
+            nValueIn += txout.nValue;
         } else{
             missingTx = true;
         }
@@ -293,13 +293,23 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
     mapTxLockVote[ctx.GetHash()] = ctx;
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
-    RelayInv(inv);
+    RelayInv(inv, GetSignedMessageProtoVersion(ctx.nMessageVersion));
 }
 
 //received a consensus vote
 bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 {
-    int n = gmineman.GetMasterXRank(ctx.vinMasterX, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    int n;
+    {
+        // txlvote is handled concurrently with other messages, don't hold its thread up on cs_main
+        TRY_LOCK(cs_main, lockMain);
+        if(!lockMain) {
+            // not the voter's fault, let it to be checked again later
+            mapTxLockVote.erase(ctx.GetHash());
+            return false;
+        }
+        n = gmineman.GetMasterXRank(ctx.vinMasterX, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    }
 
     CMasterX* pgm = gmineman.Find(ctx.vinMasterX);
     if(pgm != NULL)
@@ -345,6 +355,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
 #ifdef ENABLE_WALLET
         if(pwalletMain){
+            LOCK(pwalletMain->cs_wallet);
             //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
             if(pwalletMain->mapRequestCount.count(ctx.txHash))
                 pwalletMain->mapRequestCount[ctx.txHash]++;
@@ -465,12 +476,20 @@ uint256 CConsensusVote::GetHash() const
     return vinMasterX.prevout.hash + vinMasterX.prevout.n + txHash;
 }
 
+uint256 CConsensusVote::GetSignatureHash() const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << (int)MSG_TXLOCK_VOTE; // keeps signatures of different message types apart
+    ss << vinMasterX.prevout;
+    ss << txHash;
+    ss << nBlockHeight;
+    return ss.GetHash();
+}
+
 
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
-    //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasterX* pgm = gmineman.Find(vinMasterX);
 
@@ -480,7 +499,16 @@ bool CConsensusVote::SignatureValid()
         return false;
     }
 
-    if(!spySendSigner.VerifyMessage(pgm->pubkey2, vchMasterXSignature, strMessage, errorMessage)) {
+    bool fValid;
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        fValid = spySendSigner.VerifyHash(pgm->pubkey2, vchMasterXSignature, GetSignatureHash(), errorMessage);
+    } else {
+        std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+        //LogPrintf("verify strMessage %s \n", strMessage.c_str());
+        fValid = spySendSigner.VerifyMessage(pgm->pubkey2, vchMasterXSignature, strMessage, errorMessage);
+    }
+
+    if(!fValid) {
         LogPrintf("InstantX::CConsensusVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -494,8 +522,6 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
-    //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterXPrivKey.c_str());
 
     if(!spySendSigner.SetKey(strMasterXPrivKey, errorMessage, key2, pubkey2))
@@ -504,6 +530,27 @@ bool CConsensusVote::Sign()
         return false;
     }
 
+    nMessageVersion = GetSignedMessageVersion();
+
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        uint256 hash = GetSignatureHash();
+
+        if(!spySendSigner.SignHash(hash, errorMessage, vchMasterXSignature, key2)) {
+            LogPrintf("CConsensusVote::Sign() - Sign message failed");
+            return false;
+        }
+
+        if(!spySendSigner.VerifyHash(pubkey2, vchMasterXSignature, hash, errorMessage)) {
+            LogPrintf("CConsensusVote::Sign() - Verify message failed");
+            return false;
+        }
+
+        return true;
+    }
+
+    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    //LogPrintf("signing strMessage %s \n", strMessage.c_str());
+
     if(!spySendSigner.SignMessage(strMessage, errorMessage, vchMasterXSignature, key2)) {
         LogPrintf("CConsensusVote::Sign() - Sign message failed");
         return false;
@@ -40,6 +40,8 @@ extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
+// held while handling InstantX messages
+extern CCriticalSection cs_instantx;
 
 
 int64_t CreateNewLock(CTransaction tx);
@@ -69,8 +71,17 @@ public:
     uint256 txHash;
     int nBlockHeight;
     std::vector<unsigned char> vchMasterXSignature;
+    int nMessageVersion;
+
+    CConsensusVote()
+    {
+        nBlockHeight = 0;
+        nMessageVersion = MESSAGE_VERSION_STRING;
+    }
 
     uint256 GetHash() const;
+    /// Hash signed by MESSAGE_VERSION_BINARY votes
+    uint256 GetSignatureHash() const;
 
     bool SignatureValid();
     bool Sign();
@@ -83,6 +94,10 @@ public:
         READWRITE(vinMasterX);
         READWRITE(vchMasterXSignature);
         READWRITE(nBlockHeight);
+        if (nVersion >= BINARY_SIGNED_MESSAGE_VERSION)
+            READWRITE(nMessageVersion);
+        else if (ser_action.ForRead())
+            nMessageVersion = MESSAGE_VERSION_STRING;
     }
 };
 
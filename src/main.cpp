@@ -8,6 +8,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -55,12 +56,16 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64_t nPruneTarget = 0;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 /** Fees smaller than this (in nREDUX) are considered zero fee (for relaying and mining)
@@ -164,6 +169,12 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Set when block or undo files grew, so the next flush checks whether to prune. */
+    bool fCheckForPruning = false;
+
+    /** Block and undo files mapped for reading. */
+    CMappedFileCache mappedBlockFiles(MAX_MAPPED_BLOCK_FILES);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -274,6 +285,8 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The compact block from this peer we're rebuilding, while its "blocktxn" is awaited.
+    CPartiallyDownloadedBlock partialBlock;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -292,6 +305,10 @@ struct CNodeState {
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Misbehavior recorded while cs_main was busy, added to the nodes' scores by SendMessages */
+static map<NodeId, int> mapMisbehaviorPending;
+static CCriticalSection cs_misbehaviorPending;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -343,6 +360,11 @@ void FinalizeNode(NodeId nodeid) {
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
+
+    {
+        LOCK(cs_misbehaviorPending);
+        mapMisbehaviorPending.erase(nodeid);
+    }
 }
 
 // Requires cs_main.
@@ -354,6 +376,8 @@ void MarkBlockAsReceived(const uint256& hash) {
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        if (state->partialBlock.GetHash() == hash)
+            state->partialBlock.SetNull();
         mapBlocksInFlight.erase(itInFlight);
     }
 }
@@ -874,6 +898,17 @@ int GetInputAge(CTxIn& vin)
     }
 }
 
+bool GetUnspentOutput(const COutPoint& prevout, CTxOut& txout)
+{
+    LOCK2(cs_main, mempool.cs);
+    CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
+    CCoins coins;
+    if (!viewMempool.GetCoins(prevout.hash, coins) || !coins.IsAvailable(prevout.n))
+        return false;
+    txout = coins.vout[prevout.n];
+    return true;
+}
+
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 {    
     int sigs = 0;
@@ -996,8 +1031,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1124,6 +1168,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                           hash.ToString(), nFees, txMinFee),
                                  REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // Once the mempool has had to evict, it takes at least the fee rate of what it evicted,
+            // from wallet and RPC transactions too; only those returned from disconnected blocks skip it
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (!fOverrideMempoolLimit && mempoolRejectFee > 0 && nFees + nFeeDelta < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                          hash.ToString(), nFees + nFeeDelta, mempoolRejectFee),
+                                 REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1159,6 +1214,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit.
+        // The iterators stay valid until the transaction is added, as the
+        // pool only loses transactions while cs_main is held.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+                                 REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
@@ -1181,7 +1252,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s evicted", hash.ToString()),
+                                 REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1385,6 +1464,42 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransact
     return true;
 }
 
+/**
+ * Locate a record written by WriteBlockToDisk or CBlockUndo::WriteToDisk in a mapped file:
+ * [pbegin, pend) covers the record and the nTrailer bytes after it. Returns false if the file
+ * cannot be mapped or the index header in front of pos does not match, in which case the
+ * caller reads the file instead.
+ */
+static bool MapDiskRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CMappedFileRef& file, const char*& pbegin, const char*& pend)
+{
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return false;
+
+    // Check the index header written in front of the record
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    file = mappedBlockFiles.Get(path, pos.nPos);
+    if (!file)
+        return false;
+    const char* pheader = file->begin() + pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int);
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return false;
+    unsigned int nSize;
+    memcpy(&nSize, pheader + MESSAGE_START_SIZE, sizeof(nSize));
+
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize + nTrailer;
+    if (nEnd > file->size()) {
+        // the record was written after the file was mapped
+        if (nEnd > std::numeric_limits<size_t>::max())
+            return false;
+        file = mappedBlockFiles.Get(path, nEnd);
+        if (!file)
+            return false;
+    }
+    pbegin = file->begin() + pos.nPos;
+    pend = file->begin() + nEnd;
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1401,16 +1516,29 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception &e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                CMappedFileRef mapped;
+                const char *pbegin, *pend;
+                if (MapDiskRecord(postx, "blk", 0, mapped, pbegin, pend)) {
+                    try {
+                        CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                        reader >> header;
+                        reader.ignore(postx.nTxOffset);
+                        reader >> txOut;
+                    } catch (std::exception &e) {
+                        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                    }
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    try {
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    } catch (std::exception &e) {
+                        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                    }
                 }
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
@@ -1483,17 +1611,29 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
+    CMappedFileRef file;
+    const char *pbegin, *pend;
+    if (MapDiskRecord(pos, "blk", 0, file, pbegin, pend)) {
+        // Read block straight from the mapped file
+        try {
+            CMemoryReader(pbegin, pend, SER_DISK, CLIENT_VERSION) >> block;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk : OpenBlockFile failed");
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (std::exception &e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Check the header
@@ -1512,6 +1652,24 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CMappedFileRef& file, const char*& pbegin, const char*& pend, const CBlockIndex* pindex)
+{
+    if (!MapDiskRecord(pindex->GetBlockPos(), "blk", 0, file, pbegin, pend))
+        return false;
+
+    // Only the header is read, to check it is the block we expect
+    CBlockHeader header;
+    try {
+        CMemoryReader(pbegin, pend, SER_DISK, CLIENT_VERSION) >> header;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk : GetHash() doesn't match index");
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -1676,6 +1834,15 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Handlers of concurrent commands mustn't wait for cs_main while holding
+    // their own locks; SendMessages adds what they report later
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) {
+        LOCK(cs_misbehaviorPending);
+        mapMisbehaviorPending[pnode] += howmuch;
+        return;
+    }
+
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1748,6 +1915,18 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+unsigned int GetBlockScriptFlags(const CBlockHeader& block, const CBlockIndex* pindexPrev)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks, when 75% of the network has upgraded:
+    if (block.nVersion >= 3 && CBlockIndex::IsSuperMajority(3, pindexPrev, Params().EnforceBlockUpgradeMajority())) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    return flags;
+}
+
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
@@ -1811,6 +1990,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Already checked under these flags, e.g. for the mempool or a block template
+            if (GetScriptExecutionCache(tx, flags))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
@@ -1844,6 +2027,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Checks handed to pvChecks have not run yet
+            if (cacheStore && !pvChecks)
+                SetScriptExecutionCache(tx, flags);
         }
     }
 
@@ -1943,6 +2130,12 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    if (fFinalize) {
+        // readers holding on to the old mappings only ever touch data below the new size
+        mappedBlockFiles.Invalidate(GetBlockPosFilename(posOld, "blk"));
+        mappedBlockFiles.Invalidate(GetBlockPosFilename(posOld, "rev"));
+    }
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -1962,13 +2155,112 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("redux-scriptch");
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Closure reading the coins of one transaction from the chain state, so the
+ * database reads for a block can be spread over the prefetch threads.
+ */
+class CCoinsPrefetch
+{
+private:
+    const CCoinsView *pview;
+    uint256 txid;
+    CCoins *pcoins;
+    char *pfFound;
+
+public:
+    CCoinsPrefetch() : pview(NULL), pcoins(NULL), pfFound(NULL) {}
+    CCoinsPrefetch(const CCoinsView *pviewIn, const uint256 &txidIn, CCoins *pcoinsIn, char *pfFoundIn) :
+        pview(pviewIn), txid(txidIn), pcoins(pcoinsIn), pfFound(pfFoundIn) {}
+
+    bool operator()() {
+        *pfFound = pview->GetCoins(txid, *pcoins);
+        // a miss is not a failure; connecting the block finds out
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(txid, check.txid);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(4, MAX_SCRIPTCHECK_THREADS);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("redux-prefetch");
+    prefetchqueue.Thread();
+}
+
+static uint64_t nPrefetchInputs = 0;
+static uint64_t nPrefetchHits = 0;
+
+/**
+ * Warm pcoinsTip with the coins spent by a block before it is connected.
+ * Inputs whose coins are not cached yet are read from the database in
+ * parallel, so ConnectBlock does not wait for one read at a time.
+ */
+void static PrefetchInputs(const CBlock& block)
+{
+    if (!nPrefetchThreads)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nInputs = 0;
+    unsigned int nHits = 0;
+    std::set<uint256> setTxids;
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                nInputs++;
+                // spends of earlier transactions in this block need no read either
+                const uint256& txid = txin.prevout.hash;
+                if (setTxids.count(txid) || pcoinsTip->HaveCoinsInCache(txid)) {
+                    nHits++;
+                    continue;
+                }
+                setTxids.insert(txid);
+                vMissing.push_back(txid);
+            }
+        }
+        setTxids.insert(tx.GetHash());
+    }
+
+    std::vector<CCoins> vCoins(vMissing.size());
+    std::vector<char> vFound(vMissing.size(), 0);
+    if (!vMissing.empty()) {
+        CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+        std::vector<CCoinsPrefetch> vChecks;
+        vChecks.reserve(vMissing.size());
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            vChecks.push_back(CCoinsPrefetch(pcoinsTip->GetBackend(), vMissing[i], &vCoins[i], &vFound[i]));
+        control.Add(vChecks);
+        control.Wait();
+    }
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        if (vFound[i]) {
+            pcoinsTip->WarmCoins(vMissing[i], vCoins[i]);
+            nFound++;
+        }
+    }
+
+    nPrefetchInputs += nInputs;
+    nPrefetchHits += nHits;
+    LogPrint("bench", "  - Prefetch %u inputs: %u cached (%.1f%%), %u txs read (%u found): %.2fms [hit rate %.1f%%]\n",
+        nInputs, nHits, nInputs ? 100.0 * nHits / nInputs : 0.0, (unsigned int)vMissing.size(), nFound,
+        (GetTimeMicros() - nTimeStart) * 0.001, nPrefetchInputs ? 100.0 * nPrefetchHits / nPrefetchInputs : 0.0);
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2017,12 +2309,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    unsigned int flags = SCRIPT_VERIFY_P2SH;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && CBlockIndex::IsSuperMajority(3, pindex->pprev, Params().EnforceBlockUpgradeMajority())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
+    unsigned int flags = GetBlockScriptFlags(block, pindex->pprev);
 
     CBlockUndo blockundo;
 
@@ -2143,17 +2430,36 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+void static FindFilesToPrune(std::set<int>& setFilesToPrune);
+void static UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
+ * fast is not set and it's been a while since the last write. In prune mode, block files
+ * that are due for pruning are marked as such in the block index, which is then flushed
+ * before the files are deleted.
  */
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-    if ((mode == FLUSH_STATE_ALWAYS) ||
-        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+    if (fPruneMode && fCheckForPruning && !fReindex) {
+        FindFilesToPrune(setFilesToPrune);
+        fCheckForPruning = false;
+        if (!setFilesToPrune.empty()) {
+            fFlushForPrune = true;
+            if (!fHavePruned) {
+                pblocktree->WriteFlag("prunedblockfiles", true);
+                fHavePruned = true;
+            }
+        }
+    }
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
+        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && cacheSize > nCoinCacheUsage) ||
         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
@@ -2186,6 +2492,9 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Finally flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return state.Abort("Failed to write to coin database");
+        // Only now that nothing on disk refers to them any more, delete the pruned files.
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         // Update best block in wallet (so we can detect restored wallets).
         if (mode != FLUSH_STATE_IF_NEEDED) {
             g_signals.SetBestChain(chainActive.GetLocator());
@@ -2203,6 +2512,15 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush() {
+    CValidationState state;
+    {
+        LOCK(cs_LastBlockFile);
+        fCheckForPruning = true;
+    }
+    FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -2211,10 +2529,10 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+      Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2264,14 +2582,24 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
@@ -2304,10 +2632,11 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
             return state.Abort("Failed to read block");
         pblock = &block;
     }
-    // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    PrefetchInputs(*pblock);
+    // Apply the block atomically to the chain state.
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
@@ -2808,6 +3137,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE *file = OpenBlockFile(pos);
                 if (file) {
@@ -2839,6 +3170,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE *file = OpenUndoFile(pos);
             if (file) {
@@ -2854,6 +3187,139 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
+int GetPruneKeepDepth()
+{
+    // Evolution proposals are checked against their collateral transaction for as long as
+    // they are relayed, which is about one payment cycle, so keep at least that many blocks.
+    return std::max((int)MIN_BLOCKS_TO_KEEP, GetEvolutionPaymentCycleBlocks());
+}
+
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+
+    uint64_t retval = 0;
+    BOOST_FOREACH(const CBlockFileInfo &file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+int GetPruneHeight()
+{
+    LOCK(cs_main);
+
+    CBlockIndex* pindex = chainActive.Tip();
+    if (pindex == NULL || !fHavePruned)
+        return 0;
+    while (pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+        pindex = pindex->pprev;
+    return pindex->nHeight;
+}
+
+/** Mark one block file as pruned: forget where its blocks are and reset its file info. */
+void static PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber && (pindex->nStatus & BLOCK_HAVE_MASK)) {
+            pindex->nStatus &= ~BLOCK_HAVE_MASK;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+/** Delete the block and undo files of pruned block files from disk. */
+void static UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        mappedBlockFiles.Invalidate(GetBlockPosFilename(pos, "blk"));
+        mappedBlockFiles.Invalidate(GetBlockPosFilename(pos, "rev"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrint("prune", "Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+std::set<int> SelectBlockFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastFile, unsigned int nLastBlockWeCanPrune, uint64_t nTarget)
+{
+    std::set<int> setFilesToPrune;
+    uint64_t nCurrentUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo &file, vinfo) {
+        nCurrentUsage += file.nSize + file.nUndoSize;
+    }
+    // We don't check to prune until after we've allocated new space for files,
+    // so leave a buffer under the target for another allocation before the next check.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+
+    if (nCurrentUsage + nBuffer >= nTarget) {
+        for (int fileNumber = 0; fileNumber < nLastFile && fileNumber < (int)vinfo.size(); fileNumber++) {
+            uint64_t nBytesToPrune = vinfo[fileNumber].nSize + vinfo[fileNumber].nUndoSize;
+
+            if (vinfo[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nTarget) // are we below our target?
+                break;
+
+            // don't prune files that could have a block within the kept depth of the tip, but keep scanning
+            if (vinfo[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+        }
+    }
+    return setFilesToPrune;
+}
+
+/**
+ * Pick the oldest block files to prune until the block and undo files fit in nPruneTarget
+ * again, and forget their blocks. Files holding any block within GetPruneKeepDepth() of the
+ * tip are never pruned, and neither is the file currently being written to, so usage may
+ * stay above the target.
+ */
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    if (chainActive.Tip()->nHeight <= GetPruneKeepDepth())
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - GetPruneKeepDepth();
+    std::set<int> setPruned = SelectBlockFilesToPrune(vinfoBlockFile, nLastBlockFile, nLastBlockWeCanPrune, nPruneTarget);
+    for (std::set<int>::const_iterator it = setPruned.begin(); it != setPruned.end(); ++it) {
+        PruneOneBlockFile(*it);
+        setFilesToPrune.insert(*it);
+    }
+
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+           nPruneTarget/1024/1024, nCurrentUsage/1024/1024,
+           ((int64_t)nPruneTarget - (int64_t)nCurrentUsage)/1024/1024,
+           nLastBlockWeCanPrune, setPruned.size());
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
@@ -3386,7 +3852,9 @@ bool static LoadBlockIndexDB()
     {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3425,6 +3893,11 @@ bool static LoadBlockIndexDB()
         }
     }
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
@@ -3502,6 +3975,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // If pruning, only go back as far as we have data.
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruned, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3519,7 +3997,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3751,6 +4229,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL; // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL; // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL; // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -3758,6 +4237,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -3768,12 +4248,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis()); // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 (we stored the number of transactions in the block).
+        // HAVE_DATA is only equivalent to it as long as no block files have been pruned.
+        if (!fHavePruned) {
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);  // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0)); // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight); // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork); // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); // The pskip pointer must point back for all but the first 2 blocks.
@@ -3785,11 +4272,16 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                 assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and is valid and we have all data
+                // for its parents, it must be in setBlockIndexCandidates. The tip must be there even if some
+                // of its data has been pruned. If some parent is missing, the block may have been removed
+                // from setBlockIndexCandidates, in which case it must be in mapBlocksUnlinked (checked below).
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip())
+                    assert(setBlockIndexCandidates.count(pindex));
             }
-        } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
+        } else { // If this block sorts worse than the current tip or some ancestor was never received, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
         }
         // Check whether this block is in mapBlocksUnlinked.
@@ -3803,12 +4295,21 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked); // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We have data for this block and received all parents at some point, but some parent's data is gone now.
+            assert(fHavePruned);
+            // Such a block ends up in mapBlocksUnlinked when we tried switching to a better descendant
+            // and found the data missing, so if it is better than the tip and not a candidate, it must be there.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL)
+                    assert(foundInUnlinked);
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -3828,6 +4329,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4012,13 +4514,16 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    if (chainActive.Contains(mi->second)) {
+                    if (!(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                        // Pruned nodes may have deleted the block
+                        LogPrint("net", "ProcessGetData(): ignoring request from peer=%i for pruned block %s\n", pfrom->GetId(), inv.hash.ToString());
+                    } else if (chainActive.Contains(mi->second)) {
                         send = true;
                     } else {
                         // To prevent fingerprinting attacks, only send blocks outside of the active
@@ -4033,12 +4538,25 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send)
                 {
+                    // Older blocks won't be in the peer's mempool, so they go in full
+                    int nType = inv.type;
+                    if (nType == MSG_CMPCT_BLOCK && (!chainActive.Contains(mi->second) ||
+                                                     mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH))
+                        nType = MSG_BLOCK;
+
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    CMappedFileRef file;
+                    const char *pbegin, *pend;
+                    if (nType == MSG_BLOCK && ReadRawBlockFromDisk(file, pbegin, pend, (*mi).second))
+                        // as stored, without deserializing and reserializing it
+                        pfrom->PushMessageRaw("block", pbegin, pend);
+                    else if (!ReadBlockFromDisk(block, (*mi).second))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    else if (nType == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (nType == MSG_CMPCT_BLOCK)
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4098,9 +4616,11 @@ void static ProcessGetData(CNode* pfrom)
                         pushed = true;
                     }
                 }
+                // signed messages are only served to peers able to verify them
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if(mapTxLockVote.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    if(mapTxLockVote.count(inv.hash) &&
+                            pfrom->nVersion >= GetSignedMessageProtoVersion(mapTxLockVote[inv.hash].nMessageVersion)){
+                        CDataStream ss(SER_NETWORK, min(pfrom->nVersion, PROTOCOL_VERSION));
                         ss.reserve(1000);
                         ss << mapTxLockVote[inv.hash];
                         pfrom->PushMessage("txlvote", ss);
@@ -4135,8 +4655,9 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_EVOLUTION_VOTE) {
-                    if(evolution.mapSeenMasterXEvolutionVotes.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    if(evolution.mapSeenMasterXEvolutionVotes.count(inv.hash) &&
+                            pfrom->nVersion >= GetSignedMessageProtoVersion(evolution.mapSeenMasterXEvolutionVotes[inv.hash].nMessageVersion)){
+                        CDataStream ss(SER_NETWORK, min(pfrom->nVersion, PROTOCOL_VERSION));
                         ss.reserve(1000);
                         ss << evolution.mapSeenMasterXEvolutionVotes[inv.hash];
                         pfrom->PushMessage("mvote", ss);
@@ -4155,8 +4676,9 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_EVOLUTION_FINALIZED_VOTE) {
-                    if(evolution.mapSeenFinalizedEvolutionVotes.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    if(evolution.mapSeenFinalizedEvolutionVotes.count(inv.hash) &&
+                            pfrom->nVersion >= GetSignedMessageProtoVersion(evolution.mapSeenFinalizedEvolutionVotes[inv.hash].nMessageVersion)){
+                        CDataStream ss(SER_NETWORK, min(pfrom->nVersion, PROTOCOL_VERSION));
                         ss.reserve(1000);
                         ss << evolution.mapSeenFinalizedEvolutionVotes[inv.hash];
                         pfrom->PushMessage("fbvote", ss);
@@ -4175,8 +4697,9 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERX_ANNOUNCE) {
-                    if(gmineman.mapSeenMasterXBroadcast.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    if(gmineman.mapSeenMasterXBroadcast.count(inv.hash) &&
+                            pfrom->nVersion >= GetSignedMessageProtoVersion(gmineman.mapSeenMasterXBroadcast[inv.hash].lastPing.nMessageVersion)){
+                        CDataStream ss(SER_NETWORK, min(pfrom->nVersion, PROTOCOL_VERSION));
                         ss.reserve(1000);
                         ss << gmineman.mapSeenMasterXBroadcast[inv.hash];
                         pfrom->PushMessage("gmb", ss);
@@ -4185,8 +4708,9 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERX_PING) {
-                    if(gmineman.mapSeenMasterXPing.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    if(gmineman.mapSeenMasterXPing.count(inv.hash) &&
+                            pfrom->nVersion >= GetSignedMessageProtoVersion(gmineman.mapSeenMasterXPing[inv.hash].nMessageVersion)){
+                        CDataStream ss(SER_NETWORK, min(pfrom->nVersion, PROTOCOL_VERSION));
                         ss.reserve(1000);
                         ss << gmineman.mapSeenMasterXPing[inv.hash];
                         pfrom->PushMessage("mnp", ss);
@@ -4218,7 +4742,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4237,862 +4761,1360 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessVersionMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
-    RandAddSeedPerfmon();
-    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0)
     {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
+        pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
     }
 
-    if (strCommand == "version")
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+    if (pfrom->nVersion < MIN_PEER_PROTO_VERSION)
     {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0)
-        {
-            pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
-            Misbehaving(pfrom->GetId(), 1);
-            return false;
-        }
-
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
-        if (pfrom->nVersion < MIN_PEER_PROTO_VERSION)
-        {
-            // disconnect from peers older than this proto version
-            LogPrintf("peer=%d using obsolete version %i; disconnecting\n", pfrom->id, pfrom->nVersion);
-            pfrom->PushMessage("reject", strCommand, REJECT_OBSOLETE,
-                               strprintf("Version must be %d or greater", MIN_PEER_PROTO_VERSION));
-            pfrom->fDisconnect = true;
-            return false;
-        }
+        // disconnect from peers older than this proto version
+        LogPrintf("peer=%d using obsolete version %i; disconnecting\n", pfrom->id, pfrom->nVersion);
+        pfrom->PushMessage("reject", strCommand, REJECT_OBSOLETE,
+                           strprintf("Version must be %d or greater", MIN_PEER_PROTO_VERSION));
+        pfrom->fDisconnect = true;
+        return false;
+    }
 
-        if (pfrom->nVersion == 10300)
-            pfrom->nVersion = 300;
-        if (!vRecv.empty())
-            vRecv >> addrFrom >> nNonce;
-        if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
-            pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
-        }
-        if (!vRecv.empty())
-            vRecv >> pfrom->nStartingHeight;
-        if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+    if (pfrom->nVersion == 10300)
+        pfrom->nVersion = 300;
+    if (!vRecv.empty())
+        vRecv >> addrFrom >> nNonce;
+    if (!vRecv.empty()) {
+        vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
+        pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
+    }
+    if (!vRecv.empty())
+        vRecv >> pfrom->nStartingHeight;
+    if (!vRecv.empty())
+        vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+    else
+        pfrom->fRelayTxes = true;
 
-        // Disconnect if we connected to ourself
-        if (nNonce == nLocalHostNonce && nNonce > 1)
-        {
-            LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+    // Disconnect if we connected to ourself
+    if (nNonce == nLocalHostNonce && nNonce > 1)
+    {
+        LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
 
-        pfrom->addrLocal = addrMe;
-        if (pfrom->fInbound && addrMe.IsRoutable())
-        {
-            SeenLocal(addrMe);
-        }
+    pfrom->addrLocal = addrMe;
+    if (pfrom->fInbound && addrMe.IsRoutable())
+    {
+        SeenLocal(addrMe);
+    }
 
-        // Be shy and don't send version until we hear
-        if (pfrom->fInbound)
-            pfrom->PushVersion();
+    // Be shy and don't send version until we hear
+    if (pfrom->fInbound)
+        pfrom->PushVersion();
 
-        pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+    pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
-        // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+    // Potentially mark this peer as a preferred download peer.
+    UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
 
-        // Change version
-        pfrom->PushMessage("verack");
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+    // Change version
+    pfrom->PushMessage("verack");
+    pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
-        if (!pfrom->fInbound)
+    if (!pfrom->fInbound)
+    {
+        // Advertise our address
+        if (fListen && !IsInitialBlockDownload())
         {
-            // Advertise our address
-            if (fListen && !IsInitialBlockDownload())
-            {
-                CAddress addr = GetLocalAddress(&pfrom->addr);
-                if (addr.IsRoutable())
-                {
-                    pfrom->PushAddress(addr);
-                } else if (IsPeerAddrLocalGood(pfrom)) {
-                    addr.SetIP(pfrom->addrLocal);
-                    pfrom->PushAddress(addr);
-                }
-            }
-
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000)
-            {
-                pfrom->PushMessage("getaddr");
-                pfrom->fGetAddr = true;
-            }
-            addrman.Good(pfrom->addr);
-        } else {
-            if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
+            CAddress addr = GetLocalAddress(&pfrom->addr);
+            if (addr.IsRoutable())
             {
-                addrman.Add(addrFrom, addrFrom);
-                addrman.Good(addrFrom);
+                pfrom->PushAddress(addr);
+            } else if (IsPeerAddrLocalGood(pfrom)) {
+                addr.SetIP(pfrom->addrLocal);
+                pfrom->PushAddress(addr);
             }
         }
 
-        // Relay alerts
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000)
         {
-            LOCK(cs_mapAlerts);
-            BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
-                item.second.RelayTo(pfrom);
+            pfrom->PushMessage("getaddr");
+            pfrom->fGetAddr = true;
+        }
+        addrman.Good(pfrom->addr);
+    } else {
+        if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
+        {
+            addrman.Add(addrFrom, addrFrom);
+            addrman.Good(addrFrom);
         }
-
-        pfrom->fSuccessfullyConnected = true;
-
-        string remoteAddr;
-        if (fLogIPs)
-            remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
-
-        LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
-                  pfrom->cleanSubVer, pfrom->nVersion,
-                  pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
-                  remoteAddr);
-
-        AddTimeData(pfrom->addr, nTime);
     }
 
-
-    else if (pfrom->nVersion == 0)
+    // Relay alerts
     {
-        // Must have a version message before anything else
-        Misbehaving(pfrom->GetId(), 1);
-        return false;
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+            item.second.RelayTo(pfrom);
     }
 
+    pfrom->fSuccessfullyConnected = true;
 
-    else if (strCommand == "verack")
-    {
-        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+    string remoteAddr;
+    if (fLogIPs)
+        remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
 
-        // Mark this node as currently connected, so we update its timestamp later.
-        if (pfrom->fNetworkNode) {
-            LOCK(cs_main);
-            State(pfrom->GetId())->fCurrentlyConnected = true;
-        }
+    LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
+              pfrom->cleanSubVer, pfrom->nVersion,
+              pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
+              remoteAddr);
+
+    AddTimeData(pfrom->addr, nTime);
+    return true;
+}
+
+
+bool static ProcessVerackMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+    // Mark this node as currently connected, so we update its timestamp later.
+    if (pfrom->fNetworkNode) {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fCurrentlyConnected = true;
     }
+    return true;
+}
 
 
-    else if (strCommand == "addr")
+bool static ProcessAddrMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CAddress> vAddr;
+    vRecv >> vAddr;
+
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
+        return true;
+    if (vAddr.size() > 1000)
     {
-        vector<CAddress> vAddr;
-        vRecv >> vAddr;
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message addr size() = %u", vAddr.size());
+    }
 
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
-            return true;
-        if (vAddr.size() > 1000)
-        {
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message addr size() = %u", vAddr.size());
-        }
+    // Store the new addresses
+    vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    BOOST_FOREACH(CAddress& addr, vAddr)
+    {
+        boost::this_thread::interruption_point();
 
-        // Store the new addresses
-        vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        BOOST_FOREACH(CAddress& addr, vAddr)
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
         {
-            boost::this_thread::interruption_point();
-
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
+            // Relay to a limited number of other nodes
             {
-                // Relay to a limited number of other nodes
+                LOCK(cs_vNodes);
+                // Use deterministic randomness to send to the same nodes for 24 hours
+                // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                static uint256 hashSalt;
+                if (hashSalt == 0)
+                    hashSalt = GetRandHash();
+                uint64_t hashAddr = addr.GetHash();
+                uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                multimap<uint256, CNode*> mapMix;
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    LOCK(cs_vNodes);
-                    // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    multimap<uint256, CNode*> mapMix;
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                    {
-                        if (pnode->nVersion < CADDR_TIME_VERSION)
-                            continue;
-                        unsigned int nPointer;
-                        memcpy(&nPointer, &pnode, sizeof(nPointer));
-                        uint256 hashKey = hashRand ^ nPointer;
-                        hashKey = Hash(BEGIN(hashKey), END(hashKey));
-                        mapMix.insert(make_pair(hashKey, pnode));
-                    }
-                    int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
+                    if (pnode->nVersion < CADDR_TIME_VERSION)
+                        continue;
+                    unsigned int nPointer;
+                    memcpy(&nPointer, &pnode, sizeof(nPointer));
+                    uint256 hashKey = hashRand ^ nPointer;
+                    hashKey = Hash(BEGIN(hashKey), END(hashKey));
+                    mapMix.insert(make_pair(hashKey, pnode));
                 }
+                int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
+                for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
+                    ((*mi).second)->PushAddress(addr);
             }
-            // Do not store addresses outside our network
-            if (fReachable)
-                vAddrOk.push_back(addr);
         }
-        addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
-            pfrom->fGetAddr = false;
-        if (pfrom->fOneShot)
-            pfrom->fDisconnect = true;
+        // Do not store addresses outside our network
+        if (fReachable)
+            vAddrOk.push_back(addr);
     }
+    addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000)
+        pfrom->fGetAddr = false;
+    if (pfrom->fOneShot)
+        pfrom->fDisconnect = true;
+    return true;
+}
 
 
-    else if (strCommand == "inv")
+bool static ProcessInvMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ)
     {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ)
-        {
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message inv size() = %u", vInv.size());
-        }
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message inv size() = %u", vInv.size());
+    }
 
-        LOCK(cs_main);
+    LOCK(cs_main);
 
-        std::vector<CInv> vToFetch;
+    std::vector<CInv> vToFetch;
 
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
-        {
-            const CInv &inv = vInv[nInv];
+    for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
+    {
+        const CInv &inv = vInv[nInv];
 
-            boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
-
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
-
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
-                pfrom->AskFor(inv);
-
-
-            if (inv.type == MSG_BLOCK) {
-                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // First request the headers preceeding the announced block. In the normal fully-synced
-                    // case where a new block is announced that succeeds the current tip (no reorganization),
-                    // there are no such headers.
-                    // Secondly, and only when we are close to being synced, we request the announced block directly,
-                    // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
-                    // time the block arrives, the header chain leading up to it is already validated. Not
-                    // doing this will result in the received block being rejected as an orphan in case it is
-                    // not a direct successor.
-                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
-                    CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        boost::this_thread::interruption_point();
+        pfrom->AddInventoryKnown(inv);
+
+        bool fAlreadyHave = AlreadyHave(inv);
+        LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+
+        if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
+            pfrom->AskFor(inv);
+
+
+        if (inv.type == MSG_BLOCK) {
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+            if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                // First request the headers preceeding the announced block. In the normal fully-synced
+                // case where a new block is announced that succeeds the current tip (no reorganization),
+                // there are no such headers.
+                // Secondly, and only when we are close to being synced, we request the announced block directly,
+                // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
+                // time the block arrives, the header chain leading up to it is already validated. Not
+                // doing this will result in the received block being rejected as an orphan in case it is
+                // not a direct successor.
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                CNodeState *nodestate = State(pfrom->GetId());
+                if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
+                    nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    // A new block is mostly transactions we already have: ask for
+                    // it compact from peers that can send it that way
+                    if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+                        vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                    else
                         vToFetch.push_back(inv);
-                        // Mark block as in flight already, even though the actual "getdata" message only goes out
-                        // later (within the same cs_main lock, though).
-                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
-                    }
-                    LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    // Mark block as in flight already, even though the actual "getdata" message only goes out
+                    // later (within the same cs_main lock, though).
+                    MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
                 }
+                LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
             }
+        }
 
-            // Track requests for our stuff
-            g_signals.Inventory(inv.hash);
+        // Track requests for our stuff
+        g_signals.Inventory(inv.hash);
 
-            if (pfrom->nSendSize > (SendBufferSize() * 2)) {
-                Misbehaving(pfrom->GetId(), 50);
-                return error("send buffer size() = %u", pfrom->nSendSize);
-            }
+        if (pfrom->nSendSize > (SendBufferSize() * 2)) {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("send buffer size() = %u", pfrom->nSendSize);
         }
+    }
 
-        if (!vToFetch.empty())
-            pfrom->PushMessage("getdata", vToFetch);
+    if (!vToFetch.empty())
+        pfrom->PushMessage("getdata", vToFetch);
+    return true;
+}
+
+
+bool static ProcessGetDataMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ)
+    {
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message getdata size() = %u", vInv.size());
     }
 
+    if (fDebug || (vInv.size() != 1))
+        LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
+
+    if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
+        LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+    ProcessGetData(pfrom);
+    return true;
+}
 
-    else if (strCommand == "getdata")
+
+bool static ProcessGetBlocksMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    LOCK(cs_main);
+
+    // Find the last block the caller has in the main chain
+    CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+
+    // Send the rest of the chain
+    if (pindex)
+        pindex = chainActive.Next(pindex);
+    int nLimit = 500;
+    // If pruning, don't inv blocks unless we have them on disk and are likely to still have them
+    // by the time they are requested (allow an hour of blocks to pass).
+    const int nPrunedBlocksLikelyToHave = GetPruneKeepDepth() - 3600 / Params().TargetSpacing();
+    LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop==uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex))
     {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ)
+        if (pindex->GetBlockHash() == hashStop)
         {
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message getdata size() = %u", vInv.size());
+            LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
+        }
+        if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave))
+        {
+            LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
         }
+        pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0)
+        {
+            // When this block is requested, we'll send an inv that'll make them
+            // getblocks the next batch of inventory.
+            LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
+            break;
+        }
+    }
+    return true;
+}
 
-        if (fDebug || (vInv.size() != 1))
-            LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
 
-        if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
-            LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+bool static ProcessGetHeadersMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
 
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
-    }
+    LOCK(cs_main);
 
+    if (IsInitialBlockDownload())
+        return true;
 
-    else if (strCommand == "getblocks")
+    CBlockIndex* pindex = NULL;
+    if (locator.IsNull())
+    {
+        // If locator is null, return the hashStop block
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end())
+            return true;
+        pindex = (*mi).second;
+    }
+    else
     {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
-
-        LOCK(cs_main);
-
         // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
-
-        // Send the rest of the chain
+        pindex = FindForkInGlobalIndex(chainActive, locator);
         if (pindex)
             pindex = chainActive.Next(pindex);
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop==uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
+    }
+
+    // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+    vector<CBlock> vHeaders;
+    int nLimit = MAX_HEADERS_RESULTS;
+    LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex))
+    {
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+            break;
+    }
+    pfrom->PushMessage("headers", vHeaders);
+    return true;
+}
+
+
+bool static ProcessTxMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CTransaction tx;
+
+    //masterx signed transaction
+    bool ignoreFees = false;
+    CTxIn vin;
+    vector<unsigned char> vchSig;
+    int64_t sigTime;
+
+    if(strCommand == "tx") {
+        vRecv >> tx;
+    } else if (strCommand == "dstx") {
+        //these allow masterxs to publish a limited amount of free transactions
+        vRecv >> tx >> vin >> vchSig >> sigTime;
+
+        CMasterX* pgm = gmineman.Find(vin);
+        if(pgm != NULL)
         {
-            if (pindex->GetBlockHash() == hashStop)
-            {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
+            if(!pgm->allowFreeTx){
+                //multiple peers can send us a valid masterx transaction
+                if(fDebug) LogPrintf("dstx: MasterX sending too many transactions %s\n", tx.GetHash().ToString());
+                return true;
+            }
+
+            std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+
+            std::string errorMessage = "";
+            if(!spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage)){
+                LogPrintf("dstx: Got bad masterx address signature %s \n", vin.ToString());
+                //pfrom->Misbehaving(20);
+                return false;
+            }
+
+            LogPrintf("dstx: Got MasterX transaction %s\n", tx.GetHash().ToString());
+
+            ignoreFees = true;
+            pgm->allowFreeTx = false;
+
+            if(!mapStealthXBroadcastTxes.count(tx.GetHash())){
+                CStealthXBroadcastTx dstx;
+                dstx.tx = tx;
+                dstx.vin = vin;
+                dstx.vchSig = vchSig;
+                dstx.sigTime = sigTime;
+
+                mapStealthXBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
             }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0)
+        }
+    }
+
+    CInv inv(MSG_TX, tx.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    CValidationState state;
+
+    mapAlreadyAskedFor.erase(inv);
+
+    if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
             {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                }
+                mempool.check(pcoinsTip);
             }
         }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else if (pfrom->fWhitelisted) {
+        // Always relay transactions received from whitelisted peers, even
+        // if they are already in the mempool (allowing the node to function
+        // as a gateway for nodes hidden behind it).
+
+        RelayTransaction(tx);
     }
 
+    if(strCommand == "dstx"){
+        CInv inv(MSG_DSTX, tx.GetHash());
+        RelayInv(inv);
+    }
 
-    else if (strCommand == "getheaders")
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
     {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+    return true;
+}
+
+
+bool static ProcessHeadersMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore headers received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    std::vector<CBlockHeader> headers;
+
+    // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
+    unsigned int nCount = ReadCompactSize(vRecv);
+    if (nCount > MAX_HEADERS_RESULTS) {
+        Misbehaving(pfrom->GetId(), 20);
+        return error("headers message size = %u", nCount);
+    }
+    headers.resize(nCount);
+    for (unsigned int n = 0; n < nCount; n++) {
+        vRecv >> headers[n];
+        ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+    }
+
+    LOCK(cs_main);
+
+    if (nCount == 0) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
+
+    CBlockIndex *pindexLast = NULL;
+    BOOST_FOREACH(const CBlockHeader& header, headers) {
+        CValidationState state;
+        if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("non-continuous headers sequence");
+        }
+        if (!AcceptBlockHeader(header, state, &pindexLast)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                std::string strError = "invalid header received " + header.GetHash().ToString();
+                return error(strError.c_str());
+            }
+        }
+    }
+
+    if (pindexLast)
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+    if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        // Headers message had its maximum size; the peer may have more headers.
+        // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
+        // from there instead.
+        LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+    }
+
+    CheckBlockIndex();
+    return true;
+}
+
+
+/** Hands a block from pfrom, received in full or rebuilt from a compact block, to ProcessNewBlock. */
+void static ProcessReceivedBlock(CNode* pfrom, const string& strCommand, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+
+bool static ProcessBlockMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    CBlock block;
+    vRecv >> block;
+
+    LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+    ProcessReceivedBlock(pfrom, strCommand, block);
+    return true;
+}
+
+
+/** Asks pfrom for a block in full when its compact form couldn't be used; it stays in flight from pfrom. */
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    LogPrint("net", "requesting full block %s from peer=%d\n", hash.ToString(), pfrom->id);
+    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vInv);
+}
+
+
+bool static ProcessCmpctBlockMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    vRecv >> cmpctblock;
+
+    const uint256 hash = cmpctblock.header.GetHash();
+    LogPrint("net", "received cmpctblock %s (%u transactions) peer=%d\n", hash.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+
+    CBlock block;
+    {
         LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
+        // Only blocks we asked this peer for: otherwise anyone could have us
+        // scan the mempool as often as they like
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId()) {
+            LogPrint("net", "ignoring unrequested cmpctblock %s from peer=%d\n", hash.ToString(), pfrom->id);
             return true;
+        }
 
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
-        {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
+        // The header is checked (proof of work included) before any work goes into the block
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                Misbehaving(pfrom->GetId(), nDoS);
+                return error("cmpctblock %s from peer=%d has an invalid header", hash.ToString(), pfrom->id);
+            }
+            RequestFullBlock(pfrom, hash);
+            return true;
         }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
+
+        CPartiallyDownloadedBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID) {
+            partialBlock.SetNull();
+            MarkBlockAsReceived(hash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("malformed cmpctblock %s from peer=%d", hash.ToString(), pfrom->id);
+        }
+        if (status == READ_STATUS_FAILED) {
+            partialBlock.SetNull();
+            RequestFullBlock(pfrom, hash);
+            return true;
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
-        {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+        CBlockTransactionsRequest req = partialBlock.GetMissing();
+        if (!req.indexes.empty()) {
+            LogPrint("net", "requesting %u of %u transactions of cmpctblock %s from peer=%d\n",
+                req.indexes.size(), cmpctblock.BlockTxCount(), hash.ToString(), pfrom->id);
+            pfrom->PushMessage("getblocktxn", req);
+            return true;
+        }
+
+        status = partialBlock.FillBlock(block, vector<CTransaction>());
+        partialBlock.SetNull();
+        if (status != READ_STATUS_OK) {
+            RequestFullBlock(pfrom, hash);
+            return true;
         }
-        pfrom->PushMessage("headers", vHeaders);
     }
 
+    ProcessReceivedBlock(pfrom, strCommand, block);
+    return true;
+}
 
-    else if (strCommand == "tx"|| strCommand == "dstx")
-    {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
 
-        //masterx signed transaction
-        bool ignoreFees = false;
-        CTxIn vin;
-        vector<unsigned char> vchSig;
-        int64_t sigTime;
+bool static ProcessGetBlockTxnMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockTransactionsRequest req;
+    vRecv >> req;
 
-        if(strCommand == "tx") {
-            vRecv >> tx;
-        } else if (strCommand == "dstx") {
-            //these allow masterxs to publish a limited amount of free transactions
-            vRecv >> tx >> vin >> vchSig >> sigTime;
+    LOCK(cs_main);
 
-            CMasterX* pgm = gmineman.Find(vin);
-            if(pgm != NULL)
-            {
-                if(!pgm->allowFreeTx){
-                    //multiple peers can send us a valid masterx transaction
-                    if(fDebug) LogPrintf("dstx: MasterX sending too many transactions %s\n", tx.GetHash().ToString());
-                    return true;
-                }
+    BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+    if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+        LogPrint("net", "ignoring getblocktxn for unknown block %s from peer=%d\n", req.blockhash.ToString(), pfrom->id);
+        return true;
+    }
 
-                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+    // We only send recent blocks compact; for anything else the peer gets
+    // the full block, under the usual getdata rules, ahead of its next message
+    if (!chainActive.Contains(mi->second) || mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+        pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+        return true;
+    }
 
-                std::string errorMessage = "";
-                if(!spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage)){
-                    LogPrintf("dstx: Got bad masterx address signature %s \n", vin.ToString());
-                    //pfrom->Misbehaving(20);
-                    return false;
-                }
+    CBlock block;
+    if (!ReadBlockFromDisk(block, mi->second))
+        assert(!"cannot load block from disk");
 
-                LogPrintf("dstx: Got MasterX transaction %s\n", tx.GetHash().ToString());
+    BOOST_FOREACH(uint16_t nIndex, req.indexes) {
+        if (nIndex >= block.vtx.size()) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("getblocktxn for %s from peer=%d asks for transaction %u of %u",
+                req.blockhash.ToString(), pfrom->id, nIndex, block.vtx.size());
+        }
+    }
 
-                ignoreFees = true;
-                pgm->allowFreeTx = false;
+    pfrom->PushMessage("blocktxn", CBlockTransactions(block, req));
+    return true;
+}
 
-                if(!mapStealthXBroadcastTxes.count(tx.GetHash())){
-                    CStealthXBroadcastTx dstx;
-                    dstx.tx = tx;
-                    dstx.vin = vin;
-                    dstx.vchSig = vchSig;
-                    dstx.sigTime = sigTime;
 
-                    mapStealthXBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
-                }
-            }
-        }
+bool static ProcessBlockTxnMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+    CBlockTransactions resp;
+    vRecv >> resp;
 
+    CBlock block;
+    {
         LOCK(cs_main);
 
-        bool fMissingInputs = false;
-        CValidationState state;
+        CPartiallyDownloadedBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+        const uint256 hashPartial = partialBlock.GetHash();
+        if (hashPartial == 0 || hashPartial != resp.blockhash) {
+            LogPrint("net", "ignoring unrequested blocktxn %s from peer=%d\n", resp.blockhash.ToString(), pfrom->id);
+            return true;
+        }
 
-        mapAlreadyAskedFor.erase(inv);
+        ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+        partialBlock.SetNull();
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("blocktxn %s from peer=%d doesn't match the request", resp.blockhash.ToString(), pfrom->id);
+        }
+        if (status == READ_STATUS_FAILED) {
+            RequestFullBlock(pfrom, resp.blockhash);
+            return true;
+        }
+    }
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
+    ProcessReceivedBlock(pfrom, strCommand, block);
+    return true;
+}
 
 
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
+bool static ProcessGetAddrMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // This asymmetric behavior for inbound and outbound connections was introduced
+    // to prevent a fingerprinting attack: an attacker can send specific fake addresses
+    // to users' AddrMan and later request them by sending getaddr messages.
+    // Making users (which are behind NAT and can only make outgoing connections) ignore
+    // getaddr message mitigates the attack.
+    if (!pfrom->fInbound)
+        return true;
+
+    {
+        LOCK(pfrom->cs_addrKnown);
+        pfrom->vAddrToSend.clear();
+    }
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_FOREACH(const CAddress &addr, vAddr)
+        pfrom->PushAddress(addr);
+    return true;
+}
+
+
+bool static ProcessMempoolMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK2(cs_main, pfrom->cs_filter);
+
+    std::vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+    vector<CInv> vInv;
+    BOOST_FOREACH(uint256& hash, vtxid) {
+        CInv inv(MSG_TX, hash);
+        CTransaction tx;
+        bool fInMemPool = mempool.lookup(hash, tx);
+        if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
+        if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
+           (!pfrom->pfilter))
+            vInv.push_back(inv);
+        if (vInv.size() == MAX_INV_SZ) {
+            pfrom->PushMessage("inv", vInv);
+            vInv.clear();
+        }
+    }
+    if (vInv.size() > 0)
+        pfrom->PushMessage("inv", vInv);
+    return true;
+}
+
+
+bool static ProcessPingMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (pfrom->nVersion > BIP0031_VERSION)
+    {
+        uint64_t nonce = 0;
+        vRecv >> nonce;
+        // Echo the message back with the nonce. This allows for two useful features:
+        //
+        // 1) A remote node can quickly check if the connection is operational
+        // 2) Remote nodes can measure the latency of the network thread. If this node
+        //    is overloaded it won't respond to pings quickly and the remote node can
+        //    avoid sending us more work, like chain download requests.
+        //
+        // The nonce stops the remote getting confused between different pings: without
+        // it, if the remote node sends a ping once per second and this node takes 5
+        // seconds to respond to each, the 5th ping the remote sends would appear to
+        // return very quickly.
+        pfrom->PushMessage("pong", nonce);
+    }
+    return true;
+}
+
+
+bool static ProcessPongMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
+
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
+
+        // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
+                } else {
+                    // This should never happen
+                    sProblem = "Timing mishap";
+                }
+            } else {
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation somewhere, cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
                 }
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+        } else {
+            sProblem = "Unsolicited pong without ping";
         }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
+    } else {
+        // This is most likely a bug in another implementation somewhere, cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
+
+    if (!(sProblem.empty())) {
+        LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
+            pfrom->id,
+            pfrom->cleanSubVer,
+            sProblem,
+            pfrom->nPingNonceSent,
+            nonce,
+            nAvail);
+    }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
+    }
+    return true;
+}
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
 
-            RelayTransaction(tx);
-        }
+bool static ProcessAlertMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!fAlerts)
+        return true;
 
-        if(strCommand == "dstx"){
-            CInv inv(MSG_DSTX, tx.GetHash());
-            RelayInv(inv);
-        }
+    CAlert alert;
+    vRecv >> alert;
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
+    uint256 alertHash = alert.GetHash();
+    if (pfrom->setKnown.count(alertHash) == 0)
+    {
+        if (alert.ProcessAlert())
         {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            // Relay
+            pfrom->setKnown.insert(alertHash);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    alert.RelayTo(pnode);
+            }
+        }
+        else {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
+            Misbehaving(pfrom->GetId(), 10);
         }
     }
+    return true;
+}
+
 
+bool static ProcessFilterLoadMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBloomFilter filter;
+    vRecv >> filter;
 
-    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
+    if (!filter.IsWithinSizeConstraints())
+        // There is no excuse for sending a too-large filter
+        Misbehaving(pfrom->GetId(), 100);
+    else
     {
-        std::vector<CBlockHeader> headers;
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter(filter);
+        pfrom->pfilter->UpdateEmptyFull();
+    }
+    pfrom->fRelayTxes = true;
+    return true;
+}
 
-        // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
-            Misbehaving(pfrom->GetId(), 20);
-            return error("headers message size = %u", nCount);
-        }
-        headers.resize(nCount);
-        for (unsigned int n = 0; n < nCount; n++) {
-            vRecv >> headers[n];
-            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
-        }
 
-        LOCK(cs_main);
+bool static ProcessFilterAddMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<unsigned char> vData;
+    vRecv >> vData;
 
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
-            return true;
-        }
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+    // and thus, the maximum size any matched object can have) in a filteradd message
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
+    {
+        Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter)
+            pfrom->pfilter->insert(vData);
+        else
+            Misbehaving(pfrom->GetId(), 100);
+    }
+    return true;
+}
 
-        CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-            if (!AcceptBlockHeader(header, state, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
+
+bool static ProcessFilterClearMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK(pfrom->cs_filter);
+    delete pfrom->pfilter;
+    pfrom->pfilter = new CBloomFilter();
+    pfrom->fRelayTxes = true;
+    return true;
+}
+
+
+bool static ProcessRejectMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (fDebug) {
+        try {
+            string strMsg; unsigned char ccode; string strReason;
+            vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+
+            ostringstream ss;
+            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+
+            if (strMsg == "block" || strMsg == "tx")
+            {
+                uint256 hash;
+                vRecv >> hash;
+                ss << ": hash " << hash.ToString();
             }
+            LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
+        } catch (std::ios_base::failure& e) {
+            // Avoid feedback loops by preventing reject messages from triggering a new reject message.
+            LogPrint("net", "Unparseable reject message received\n");
         }
+    }
+    return true;
+}
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
-        }
+bool static ProcessStealthXMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    spySendPool.ProcessMessageStealthX(pfrom, strCommand, vRecv);
+    return true;
+}
 
-        CheckBlockIndex();
-    }
+bool static ProcessMasterXMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    gmineman.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
-    {
-        CBlock block;
-        vRecv >> block;
+bool static ProcessEvolutionMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    evolution.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+bool static ProcessMasterXPaymentsMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    masterxPayments.ProcessMessageMasterXPayments(pfrom, strCommand, vRecv);
+    return true;
+}
 
-        pfrom->AddInventoryKnown(inv);
+bool static ProcessInstantXMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    ProcessMessageInstantX(pfrom, strCommand, vRecv);
+    return true;
+}
 
-        CValidationState state;
-        ProcessNewBlock(state, pfrom, &block);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                TRY_LOCK(cs_main, lockMain);
-                if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-            }
-        }
+bool static ProcessSporkMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    ProcessSpork(pfrom, strCommand, vRecv);
+    return true;
+}
 
-    }
+bool static ProcessMasterXSyncMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    masterxSync.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
 
 
-    // This asymmetric behavior for inbound and outbound connections was introduced
-    // to prevent a fingerprinting attack: an attacker can send specific fake addresses
-    // to users' AddrMan and later request them by sending getaddr messages.
-    // Making users (which are behind NAT and can only make outgoing connections) ignore
-    // getaddr message mitigates the attack.
-    else if ((strCommand == "getaddr") && (pfrom->fInbound))
+/**
+ * P2P commands and their handlers. A command may be made concurrent only
+ * once everything its handler (and everything ProcessMessage does before
+ * dispatching it) reads or writes is guarded by a lock of its own or
+ * belongs to pfrom. A concurrent command is handled under its lock, if it
+ * has one, instead of cs_serialMessages; serial commands take all these
+ * locks as well, so the lock need only keep its commands apart from each
+ * other. See ProcessMessages.
+ */
+static const CMessageHandler vMessageHandlers[] =
+{ //  category      command        actor (function)                  concurrent  lock
+  //  ------------  -------------  --------------------------------  ----------  ----------------------------
+    { "core",       "version",     &ProcessVersionMessage,           false,      NULL                         },
+    { "core",       "verack",      &ProcessVerackMessage,            false,      NULL                         },
+    { "core",       "addr",        &ProcessAddrMessage,              true,       NULL                         },
+    { "core",       "inv",         &ProcessInvMessage,               false,      NULL                         },
+    { "core",       "getdata",     &ProcessGetDataMessage,           false,      NULL                         },
+    { "core",       "getblocks",   &ProcessGetBlocksMessage,         false,      NULL                         },
+    { "core",       "getheaders",  &ProcessGetHeadersMessage,        false,      NULL                         },
+    { "core",       "tx",          &ProcessTxMessage,                false,      NULL                         },
+    { "core",       "dstx",        &ProcessTxMessage,                false,      NULL                         },
+    { "core",       "headers",     &ProcessHeadersMessage,           false,      NULL                         },
+    { "core",       "block",       &ProcessBlockMessage,             false,      NULL                         },
+    { "core",       "cmpctblock",  &ProcessCmpctBlockMessage,        false,      NULL                         },
+    { "core",       "getblocktxn", &ProcessGetBlockTxnMessage,       false,      NULL                         },
+    { "core",       "blocktxn",    &ProcessBlockTxnMessage,          false,      NULL                         },
+    { "core",       "getaddr",     &ProcessGetAddrMessage,           false,      NULL                         },
+    { "core",       "mempool",     &ProcessMempoolMessage,           false,      NULL                         },
+    { "core",       "ping",        &ProcessPingMessage,              true,       NULL                         },
+    { "core",       "pong",        &ProcessPongMessage,              true,       NULL                         },
+    { "core",       "alert",       &ProcessAlertMessage,             false,      NULL                         },
+    { "core",       "filterload",  &ProcessFilterLoadMessage,        false,      NULL                         },
+    { "core",       "filteradd",   &ProcessFilterAddMessage,         false,      NULL                         },
+    { "core",       "filterclear", &ProcessFilterClearMessage,       false,      NULL                         },
+    { "core",       "reject",      &ProcessRejectMessage,            false,      NULL                         },
+
+    /* StealthX mixing */
+    { "stealthx",   "dsa",         &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dsq",         &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dsi",         &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dssu",        &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dss",         &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dsf",         &ProcessStealthXMessage,          false,      NULL                         },
+    { "stealthx",   "dsc",         &ProcessStealthXMessage,          false,      NULL                         },
+
+    /* MasterX list, payments and sync */
+    { "masterx",    "gmb",         &ProcessMasterXMessage,           false,      NULL                         },
+    { "masterx",    "mnp",         &ProcessMasterXMessage,           true,       &gmineman.cs_process_message },
+    { "masterx",    "dseg",        &ProcessMasterXMessage,           false,      NULL                         },
+    { "masterx",    "gmget",       &ProcessMasterXPaymentsMessage,   false,      NULL                         },
+    { "masterx",    "mnw",         &ProcessMasterXPaymentsMessage,   false,      NULL                         },
+    { "masterx",    "ssc",         &ProcessMasterXSyncMessage,       false,      NULL                         },
+
+    /* Evolution proposals and votes */
+    { "evolution",  "gmvs",        &ProcessEvolutionMessage,         false,      NULL                         },
+    { "evolution",  "mprop",       &ProcessEvolutionMessage,         false,      NULL                         },
+    { "evolution",  "mvote",       &ProcessEvolutionMessage,         true,       &cs_evolution                },
+    { "evolution",  "fbs",         &ProcessEvolutionMessage,         false,      NULL                         },
+    { "evolution",  "fbvote",      &ProcessEvolutionMessage,         true,       &cs_evolution                },
+
+    /* InstantX locks */
+    { "instantx",   "ix",          &ProcessInstantXMessage,          false,      NULL                         },
+    { "instantx",   "txlvote",     &ProcessInstantXMessage,          true,       &cs_instantx                 },
+
+    /* Sporks */
+    { "spork",      "spork",       &ProcessSporkMessage,             false,      NULL                         },
+    { "spork",      "getsporks",   &ProcessSporkMessage,             false,      NULL                         },
+};
+
+CMessageTable::CMessageTable()
+{
+    unsigned int vcidx;
+    for (vcidx = 0; vcidx < (sizeof(vMessageHandlers) / sizeof(vMessageHandlers[0])); vcidx++)
     {
-        pfrom->vAddrToSend.clear();
-        vector<CAddress> vAddr = addrman.GetAddr();
-        BOOST_FOREACH(const CAddress &addr, vAddr)
-            pfrom->PushAddress(addr);
+        const CMessageHandler *pcmd;
+
+        pcmd = &vMessageHandlers[vcidx];
+        mapCommands[pcmd->name] = pcmd;
+        mapStats[pcmd->name] = CMessageStats();
+        if (pcmd->fConcurrent && pcmd->pcsConcurrent &&
+            find(vConcurrentLocks.begin(), vConcurrentLocks.end(), pcmd->pcsConcurrent) == vConcurrentLocks.end())
+            vConcurrentLocks.push_back(pcmd->pcsConcurrent);
     }
+    mapStats["unknown"] = CMessageStats();
+}
 
+const CMessageHandler *CMessageTable::operator[](const std::string& name) const
+{
+    map<string, const CMessageHandler*>::const_iterator it = mapCommands.find(name);
+    if (it == mapCommands.end())
+        return NULL;
+    return (*it).second;
+}
 
-    else if (strCommand == "mempool")
-    {
-        LOCK2(cs_main, pfrom->cs_filter);
+void CMessageTable::AddStats(const std::string& name, uint64_t nBytes, int64_t nCPUMicros)
+{
+    LOCK(cs_stats);
+    CMessageStats& stats = mapStats[name];
+    stats.nCount++;
+    stats.nBytes += nBytes;
+    stats.nCPUMicros += nCPUMicros;
+}
 
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-        vector<CInv> vInv;
-        BOOST_FOREACH(uint256& hash, vtxid) {
-            CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
-               (!pfrom->pfilter))
-                vInv.push_back(inv);
-            if (vInv.size() == MAX_INV_SZ) {
-                pfrom->PushMessage("inv", vInv);
-                vInv.clear();
-            }
-        }
-        if (vInv.size() > 0)
-            pfrom->PushMessage("inv", vInv);
-    }
+bool CMessageTable::execute(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    const CMessageHandler *pcmd = (*this)[strCommand];
+    // The peer chooses the command, so only registered ones get an entry of their own
+    string strStats = pcmd ? pcmd->name : "unknown";
+    uint64_t nBytes = vRecv.size();
+    int64_t nCPUStart = GetThreadCPUTimeMicros();
+    bool fRet = true;
+    try {
+        if (pcmd)
+            fRet = pcmd->actor(pfrom, strCommand, vRecv, nTimeReceived);
+    } catch (...) {
+        AddStats(strStats, nBytes, GetThreadCPUTimeMicros() - nCPUStart);
+        throw;
+    }
+    AddStats(strStats, nBytes, GetThreadCPUTimeMicros() - nCPUStart);
+    return fRet;
+}
+
+std::map<std::string, CMessageStats> CMessageTable::GetStats()
+{
+    LOCK(cs_stats);
+    return mapStats;
+}
 
+CMessageTable tableP2P;
 
-    else if (strCommand == "ping")
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    RandAddSeedPerfmon();
+    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
-        if (pfrom->nVersion > BIP0031_VERSION)
-        {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful features:
-            //
-            // 1) A remote node can quickly check if the connection is operational
-            // 2) Remote nodes can measure the latency of the network thread. If this node
-            //    is overloaded it won't respond to pings quickly and the remote node can
-            //    avoid sending us more work, like chain download requests.
-            //
-            // The nonce stops the remote getting confused between different pings: without
-            // it, if the remote node sends a ping once per second and this node takes 5
-            // seconds to respond to each, the 5th ping the remote sends would appear to
-            // return very quickly.
-            pfrom->PushMessage("pong", nonce);
-        }
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
     }
 
-
-    else if (strCommand == "pong")
+    if (pfrom->nVersion == 0 && strCommand != "version")
     {
-        int64_t pingUsecEnd = nTimeReceived;
-        uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
-
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
+        // Must have a version message before anything else
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
+    }
 
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
-                } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere, cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
-                }
-            } else {
-                sProblem = "Unsolicited pong without ping";
-            }
-        } else {
-            // This is most likely a bug in another implementation somewhere, cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
-        }
+    return tableP2P.execute(pfrom, strCommand, vRecv, nTimeReceived);
+}
 
-        if (!(sProblem.empty())) {
-            LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
-                pfrom->id,
-                pfrom->cleanSubVer,
-                sProblem,
-                pfrom->nPingNonceSent,
-                nonce,
-                nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
-    }
+/**
+ * The handler of strCommand if it may run without cs_serialMessages,
+ * alongside other peers' messages, NULL if not; vMessageHandlers says which
+ * commands may.
+ */
+static const CMessageHandler* GetConcurrentCommand(const CNode* pfrom, const string& strCommand)
+{
+    // Before the version message any command gets the peer punished
+    if (pfrom->nVersion == 0)
+        return NULL;
+    const CMessageHandler *pcmd = tableP2P[strCommand];
+    return pcmd && pcmd->fConcurrent ? pcmd : NULL;
+}
 
+/**
+ * The locks a message is handled under: for a concurrent command its own
+ * lock, if it has one, and for anything else cs_serialMessages followed by
+ * the locks of all concurrent commands. They are only tried, all or none,
+ * so that a message handler thread never waits for another.
+ */
+class CMessageLock
+{
+private:
+    std::vector<CCriticalBlock*> vLocks;
+    bool fLocked;
 
-    else if (fAlerts && strCommand == "alert")
+    bool TryLock(CCriticalSection& cs)
     {
-        CAlert alert;
-        vRecv >> alert;
-
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
-        {
-            if (alert.ProcessAlert())
-            {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
-                }
-            }
-            else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                Misbehaving(pfrom->GetId(), 10);
-            }
-        }
+        CCriticalBlock* plock = new CCriticalBlock(cs, "message lock", __FILE__, __LINE__, true);
+        vLocks.push_back(plock);
+        return *plock;
     }
 
-
-    else if (strCommand == "filterload")
+    void Unlock()
     {
-        CBloomFilter filter;
-        vRecv >> filter;
-
-        if (!filter.IsWithinSizeConstraints())
-            // There is no excuse for sending a too-large filter
-            Misbehaving(pfrom->GetId(), 100);
-        else
-        {
-            LOCK(pfrom->cs_filter);
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter(filter);
-            pfrom->pfilter->UpdateEmptyFull();
+        while (!vLocks.empty()) {
+            delete vLocks.back();
+            vLocks.pop_back();
         }
-        pfrom->fRelayTxes = true;
     }
 
-
-    else if (strCommand == "filteradd")
+public:
+    CMessageLock(const CMessageHandler* pcmdConcurrent)
     {
-        vector<unsigned char> vData;
-        vRecv >> vData;
-
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
-        // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
-        {
-            Misbehaving(pfrom->GetId(), 100);
+        if (pcmdConcurrent) {
+            fLocked = !pcmdConcurrent->pcsConcurrent || TryLock(*pcmdConcurrent->pcsConcurrent);
         } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else
-                Misbehaving(pfrom->GetId(), 100);
+            fLocked = TryLock(cs_serialMessages);
+            BOOST_FOREACH(CCriticalSection* pcs, tableP2P.GetConcurrentLocks())
+                fLocked = fLocked && TryLock(*pcs);
         }
+        if (!fLocked)
+            Unlock();
     }
 
+    ~CMessageLock()
+    {
+        Unlock();
+    }
 
-    else if (strCommand == "filterclear")
+    operator bool() const
     {
-        LOCK(pfrom->cs_filter);
-        delete pfrom->pfilter;
-        pfrom->pfilter = new CBloomFilter();
-        pfrom->fRelayTxes = true;
+        return fLocked;
     }
+};
 
+/** Check a complete message's checksum and handle it; false if the checksum is wrong */
+static bool ProcessNetMessage(CNode* pfrom, const string& strCommand, CNetMessage& msg)
+{
+    CMessageHeader& hdr = msg.hdr;
 
-    else if (strCommand == "reject")
-    {
-        if (fDebug) {
-            try {
-                string strMsg; unsigned char ccode; string strReason;
-                vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+    // Message size
+    unsigned int nMessageSize = hdr.nMessageSize;
 
-                ostringstream ss;
-                ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+    // Checksum
+    CDataStream& vRecv = msg.vRecv;
+    uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (nChecksum != hdr.nChecksum)
+    {
+        LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+           SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
+        return false;
+    }
 
-                if (strMsg == "block" || strMsg == "tx")
-                {
-                    uint256 hash;
-                    vRecv >> hash;
-                    ss << ": hash " << hash.ToString();
-                }
-                LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
-            } catch (std::ios_base::failure& e) {
-                // Avoid feedback loops by preventing reject messages from triggering a new reject message.
-                LogPrint("net", "Unparseable reject message received\n");
-            }
-        }
+    // Process message
+    bool fRet = false;
+    int64_t nTimeStart = GetTimeMicros();
+    try
+    {
+        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+        boost::this_thread::interruption_point();
     }
-    else
+    catch (std::ios_base::failure& e)
     {
-        //probably one the extensions
-        spySendPool.ProcessMessageStealthX(pfrom, strCommand, vRecv);
-        gmineman.ProcessMessage(pfrom, strCommand, vRecv);
-        evolution.ProcessMessage(pfrom, strCommand, vRecv);
-        masterxPayments.ProcessMessageMasterXPayments(pfrom, strCommand, vRecv);
-        ProcessMessageInstantX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masterxSync.ProcessMessage(pfrom, strCommand, vRecv);
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data"))
+        {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        }
+        else if (strstr(e.what(), "size too large"))
+        {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        }
+        else
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
     }
+    catch (boost::thread_interrupted) {
+        throw;
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+    pfrom->RecordCommandLatency(strCommand, GetTimeMicros() - nTimeStart);
 
-
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
     return true;
 }
@@ -5112,9 +6134,19 @@ bool ProcessMessages(CNode* pfrom)
     //  (x) data
     //
     bool fOk = true;
+    pfrom->fSerialWait = false;
 
-    if (!pfrom->vRecvGetData.empty())
-        ProcessGetData(pfrom);
+    if (!pfrom->vRecvGetData.empty()) {
+        {
+            CMessageLock lockMessage(NULL);
+            if (!lockMessage) {
+                pfrom->fSerialWait = true;
+                return fOk;
+            }
+            ProcessGetData(pfrom);
+        }
+        WakeMessageHandlers();
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -5137,13 +6169,11 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
-        // at this point, any failure means we can delete the current message
-        it++;
-
         // Scan for message start
         if (memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
             LogPrintf("PROCESSMESSAGE: INVALID MESSAGESTART %s peer=%d\n", SanitizeString(msg.hdr.GetCommand()), pfrom->id);
             fOk = false;
+            it++;
             break;
         }
 
@@ -5152,68 +6182,30 @@ bool ProcessMessages(CNode* pfrom)
         if (!hdr.IsValid())
         {
             LogPrintf("PROCESSMESSAGE: ERRORS IN HEADER %s peer=%d\n", SanitizeString(hdr.GetCommand()), pfrom->id);
+            it++;
             continue;
         }
         string strCommand = hdr.GetCommand();
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-
-        // Checksum
-        CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        bool fProcessed;
         {
-            LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
-
-        // Process message
-        bool fRet = false;
-        try
-        {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            boost::this_thread::interruption_point();
-        }
-        catch (std::ios_base::failure& e)
-        {
-            pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data"))
-            {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            }
-            else if (strstr(e.what(), "size too large"))
-            {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            }
-            else
-            {
-                PrintExceptionContinue(&e, "ProcessMessages()");
+            // Leave the message queued while another thread holds a lock it needs
+            CMessageLock lockMessage(GetConcurrentCommand(pfrom, strCommand));
+            if (!lockMessage) {
+                pfrom->fSerialWait = true;
+                break;
             }
+            it++;
+            fProcessed = ProcessNetMessage(pfrom, strCommand, msg);
         }
-        catch (boost::thread_interrupted) {
-            throw;
-        }
-        catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
-        }
-
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
-
-        break;
+        WakeMessageHandlers();
+        if (fProcessed)
+            break;
     }
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->PopRecvMsgs(it);
 
     return fOk;
 }
@@ -5267,8 +6259,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrKnown);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5283,6 +6277,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
+            LOCK(pto->cs_addrKnown);
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
@@ -5303,6 +6298,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
 
+        int nMisbehaviorPending = 0;
+        {
+            LOCK(cs_misbehaviorPending);
+            map<NodeId, int>::iterator it = mapMisbehaviorPending.find(pto->GetId());
+            if (it != mapMisbehaviorPending.end()) {
+                nMisbehaviorPending = it->second;
+                mapMisbehaviorPending.erase(it);
+            }
+        }
+        Misbehaving(pto->GetId(), nMisbehaviorPending);
+
         CNodeState &state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -5491,19 +6497,33 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> *this;
-        filein >> hashChecksum;
-    }
-    catch (std::exception &e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    CMappedFileRef file;
+    const char *pbegin, *pend;
+    if (MapDiskRecord(pos, "rev", sizeof(hashChecksum), file, pbegin, pend)) {
+        // Read undo data straight from the mapped file
+        try {
+            CMemoryReader filein(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            filein >> *this;
+            filein >> hashChecksum;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+
+        // Read block
+        try {
+            filein >> *this;
+            filein >> hashChecksum;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -13,6 +13,7 @@
 
 #include "amount.h"
 #include "chain.h"
+#include "mappedfile.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "primitives/block.h"
@@ -67,12 +68,26 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** The number of blk?????.dat and rev?????.dat files kept memory-mapped for reading (less where address space is scarce) */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 32 : 2;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
@@ -81,6 +96,8 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -prefetchthreads default (number of threads reading block inputs from the chain state ahead of connection) */
+static const int DEFAULT_PREFETCH_THREADS = 4;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -93,6 +110,10 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of blocks below the tip whose block and undo files are never pruned, to allow for reorgs. */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target: the blocks kept for reorgs plus a full block file, its undo data and the allocation slack. */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -127,10 +148,18 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** Number of bytes -prune keeps block and undo files under. */
+extern uint64_t nPruneTarget;
+//! Maximum memory (in bytes) the coins cache on top of the database may use before it is flushed
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
@@ -198,6 +227,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the input prefetch thread */
+void ThreadCoinsPrefetch();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -227,20 +258,34 @@ CBlockIndex * InsertBlockIndex(uint256 hash);
 bool AbortNode(const std::string &msg, const std::string &userMessage="");
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
-/** Increase a node's misbehavior score. */
+/** Increase a node's misbehavior score, or have SendMessages do it if cs_main is busy. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files and flush state to disk. */
+void PruneAndFlush();
+/** Number of blocks below the tip that are never pruned (reorgs, and the masterx/evolution collateral lookups). */
+int GetPruneKeepDepth();
+/** Calculate the amount of disk space the block and undo files currently use. */
+uint64_t CalculateCurrentUsage();
+/** Height of the lowest block on the active chain that is still on disk. */
+int GetPruneHeight();
 
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false,
+                        bool fOverrideMempoolLimit=false);
+
+/** Expire old transactions from the memory pool and trim it to limit bytes, evicting the lowest fee rate packages */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isDSTX=false);
 
 int GetInputAge(CTxIn& vin);
+/** Find an unspent output in the chain state or the mempool; unlike GetTransaction, this doesn't need its block */
+bool GetUnspentOutput(const COutPoint& prevout, CTxOut& txout);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 int GetIXConfirmations(uint256 nTXHash);
 
@@ -251,6 +296,59 @@ struct CNodeStateStats {
     std::vector<int> vHeightInFlight;
 };
 
+/** Handles one P2P message; false if it was bad, which is logged as a failure */
+typedef bool (*msghandler_type)(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
+
+class CMessageHandler
+{
+public:
+    std::string category;
+    std::string name;
+    msghandler_type actor;
+    //! May run without cs_serialMessages, alongside other peers' messages
+    bool fConcurrent;
+    //! Held instead of cs_serialMessages by a concurrent command, unless NULL;
+    //! serial commands hold the locks of all of them
+    CCriticalSection* pcsConcurrent;
+};
+
+/** Messages received for one P2P command, their payload bytes and the handler CPU time spent on them */
+struct CMessageStats
+{
+    uint64_t nCount;
+    uint64_t nBytes;
+    int64_t nCPUMicros;
+
+    CMessageStats() : nCount(0), nBytes(0), nCPUMicros(0) {}
+};
+
+/**
+ * P2P message dispatcher, keeping per-command totals of what it handled.
+ * Commands nobody handles are ignored, and counted as "unknown".
+ */
+class CMessageTable
+{
+private:
+    std::map<std::string, const CMessageHandler*> mapCommands;
+    CCriticalSection cs_stats;
+    std::map<std::string, CMessageStats> mapStats;
+    std::vector<CCriticalSection*> vConcurrentLocks;
+
+    void AddStats(const std::string& name, uint64_t nBytes, int64_t nCPUMicros);
+public:
+    CMessageTable();
+    const CMessageHandler* operator[](const std::string& name) const;
+    /** The locks concurrent commands are handled under, in the order serial ones take them */
+    const std::vector<CCriticalSection*>& GetConcurrentLocks() const { return vConcurrentLocks; }
+
+    /** Handle a message with the handler registered for strCommand */
+    bool execute(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
+    /** Totals of the commands received so far */
+    std::map<std::string, CMessageStats> GetStats();
+};
+
+extern CMessageTable tableP2P;
+
 struct CDiskTxPos : public CDiskBlockPos
 {
     unsigned int nTxOffset; // after header
@@ -323,6 +421,9 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
                  unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
 
+/** Script verification flags the scripts in a block on top of pindexPrev are checked with */
+unsigned int GetBlockScriptFlags(const CBlockHeader& block, const CBlockIndex* pindexPrev);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight);
 
@@ -393,6 +494,12 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/**
+ * Find the serialized bytes of a stored block, [pbegin, pend), in its mapped block file, for
+ * sending it on without deserializing it. file keeps the mapping alive while they are used.
+ * Returns false if the block file can't be mapped or doesn't hold the block.
+ */
+bool ReadRawBlockFromDisk(CMappedFileRef& file, const char*& pbegin, const char*& pend, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -480,6 +587,13 @@ public:
      }
 };
 
+/**
+ * The block files FindFilesToPrune would prune: the oldest ones before nLastFile, skipping any
+ * with a block above nLastBlockWeCanPrune, until vinfo's usage plus room for one more
+ * allocation fits in nTarget.
+ */
+std::set<int> SelectBlockFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastFile, unsigned int nLastBlockWeCanPrune, uint64_t nTarget);
+
 /** Capture information about block/transaction validation */
 class CValidationState {
 private:
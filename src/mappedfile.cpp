@@ -0,0 +1,93 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(const boost::filesystem::path& path) : pbegin(NULL), nSize(0)
+{
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            pbegin = (const char*)p;
+            nSize = st.st_size;
+        }
+    }
+    // the mapping keeps its own reference to the file
+    close(fd);
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (pbegin)
+        munmap((void*)pbegin, nSize);
+#endif
+}
+
+CMappedFileRef CMappedFileCache::Get(const boost::filesystem::path& path, size_t nEnd)
+{
+    const std::string strPath = path.string();
+    boost::mutex::scoped_lock lock(cs);
+
+    std::map<std::string, MappedList::iterator>::iterator it = mapMapped.find(strPath);
+    if (it != mapMapped.end()) {
+        // move to the front
+        listMapped.splice(listMapped.begin(), listMapped, it->second);
+        if (it->second->second->size() >= nEnd)
+            return it->second->second;
+        // the file has grown since it was mapped
+        listMapped.erase(it->second);
+        mapMapped.erase(it);
+    }
+
+    if (nMaxFiles == 0)
+        return CMappedFileRef();
+    CMappedFileRef file(new CMappedFile(path));
+    if (file->IsNull() || file->size() < nEnd)
+        return CMappedFileRef();
+
+    listMapped.push_front(std::make_pair(strPath, file));
+    mapMapped[strPath] = listMapped.begin();
+    while (listMapped.size() > nMaxFiles) {
+        mapMapped.erase(listMapped.back().first);
+        listMapped.pop_back();
+    }
+    return file;
+}
+
+void CMappedFileCache::Invalidate(const boost::filesystem::path& path)
+{
+    boost::mutex::scoped_lock lock(cs);
+    std::map<std::string, MappedList::iterator>::iterator it = mapMapped.find(path.string());
+    if (it != mapMapped.end()) {
+        listMapped.erase(it->second);
+        mapMapped.erase(it);
+    }
+}
+
+void CMappedFileCache::Clear()
+{
+    boost::mutex::scoped_lock lock(cs);
+    listMapped.clear();
+    mapMapped.clear();
+}
+
+size_t CMappedFileCache::GetCount()
+{
+    boost::mutex::scoped_lock lock(cs);
+    return listMapped.size();
+}
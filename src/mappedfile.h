@@ -0,0 +1,81 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * A read-only memory mapping of a whole file, as large as the file was when it
+ * was mapped. The mapping stays valid when the file grows, but does not cover
+ * the new data. IsNull() if the file could not be mapped (or on platforms
+ * without mmap), in which case callers read the file the usual way.
+ */
+class CMappedFile : private boost::noncopyable
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+
+public:
+    explicit CMappedFile(const boost::filesystem::path& path);
+    ~CMappedFile();
+
+    bool IsNull() const { return pbegin == NULL; }
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
+/** A mapped file is unmapped when the last reference to it goes away. */
+typedef boost::shared_ptr<const CMappedFile> CMappedFileRef;
+
+/**
+ * Keeps the most recently used files mapped, so repeated reads from them are a
+ * lookup and a memcpy rather than an open, seek and read.
+ *
+ * Files dropped from the cache stay mapped until readers holding a reference
+ * are done with them.
+ */
+class CMappedFileCache : private boost::noncopyable
+{
+private:
+    typedef std::list<std::pair<std::string, CMappedFileRef> > MappedList;
+
+    boost::mutex cs;
+    //! Most recently used first
+    MappedList listMapped;
+    std::map<std::string, MappedList::iterator> mapMapped;
+    size_t nMaxFiles;
+
+public:
+    explicit CMappedFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Return a mapping of path covering at least its first nEnd bytes, remapping
+     * the file if it has grown past what is mapped. Returns an empty reference if
+     * the file cannot be mapped or is shorter than nEnd.
+     */
+    CMappedFileRef Get(const boost::filesystem::path& path, size_t nEnd);
+
+    //! Drop the mapping of a file that is being truncated or deleted
+    void Invalidate(const boost::filesystem::path& path);
+
+    //! Drop all mappings
+    void Clear();
+
+    //! Number of files currently in the cache
+    size_t GetCount();
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
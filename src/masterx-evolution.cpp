@@ -1561,6 +1561,7 @@ CEvolutionVote::CEvolutionVote()
     nProposalHash = 0;
     nVote = VOTE_ABSTAIN;
     nTime = 0;
+    nMessageVersion = MESSAGE_VERSION_STRING;
     fValid = true;
     fSynced = false;
 }
@@ -1571,6 +1572,7 @@ CEvolutionVote::CEvolutionVote(CTxIn vinIn, uint256 nProposalHashIn, int nVoteIn
     nProposalHash = nProposalHashIn;
     nVote = nVoteIn;
     nTime = GetAdjustedTime();
+    nMessageVersion = MESSAGE_VERSION_STRING;
     fValid = true;
     fSynced = false;
 }
@@ -1578,7 +1580,7 @@ CEvolutionVote::CEvolutionVote(CTxIn vinIn, uint256 nProposalHashIn, int nVoteIn
 void CEvolutionVote::Relay()
 {
     CInv inv(MSG_EVOLUTION_VOTE, GetHash());
-    RelayInv(inv, MIN_EVOLUTION_PEER_PROTO_VERSION);
+    RelayInv(inv, std::max(MIN_EVOLUTION_PEER_PROTO_VERSION, GetSignedMessageProtoVersion(nMessageVersion)));
 }
 
 bool CEvolutionVote::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
@@ -1588,6 +1590,25 @@ bool CEvolutionVote::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
+
+    nMessageVersion = GetSignedMessageVersion();
+
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        uint256 hash = GetSignatureHash();
+
+        if(!spySendSigner.SignHash(hash, errorMessage, vchSig, keyMasterX)) {
+            LogPrintf("CEvolutionVote::Sign - Error upon calling SignHash");
+            return false;
+        }
+
+        if(!spySendSigner.VerifyHash(pubKeyMasterX, vchSig, hash, errorMessage)) {
+            LogPrintf("CEvolutionVote::Sign - Error upon calling VerifyHash");
+            return false;
+        }
+
+        return true;
+    }
+
     std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
 
     if(!spySendSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasterX)) {
@@ -1606,7 +1627,6 @@ bool CEvolutionVote::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
 bool CEvolutionVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
 
     CMasterX* pgm = gmineman.Find(vin);
 
@@ -1618,7 +1638,15 @@ bool CEvolutionVote::SignatureValid(bool fSignatureCheck)
 
     if(!fSignatureCheck) return true;
 
-    if(!spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage)) {
+    bool fValid;
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        fValid = spySendSigner.VerifyHash(pgm->pubkey2, vchSig, GetSignatureHash(), errorMessage);
+    } else {
+        std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+        fValid = spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage);
+    }
+
+    if(!fValid) {
         LogPrintf("CEvolutionVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -1962,6 +1990,7 @@ CFinalizedEvolutionVote::CFinalizedEvolutionVote()
     nEvolutionHash = 0;
     nTime = 0;
     vchSig.clear();
+    nMessageVersion = MESSAGE_VERSION_STRING;
     fValid = true;
     fSynced = false;
 }
@@ -1972,6 +2001,7 @@ CFinalizedEvolutionVote::CFinalizedEvolutionVote(CTxIn vinIn, uint256 nEvolution
     nEvolutionHash = nEvolutionHashIn;
     nTime = GetAdjustedTime();
     vchSig.clear();
+    nMessageVersion = MESSAGE_VERSION_STRING;
     fValid = true;
     fSynced = false;
 }
@@ -1979,7 +2009,7 @@ CFinalizedEvolutionVote::CFinalizedEvolutionVote(CTxIn vinIn, uint256 nEvolution
 void CFinalizedEvolutionVote::Relay()
 {
     CInv inv(MSG_EVOLUTION_FINALIZED_VOTE, GetHash());
-    RelayInv(inv, MIN_EVOLUTION_PEER_PROTO_VERSION);
+    RelayInv(inv, std::max(MIN_EVOLUTION_PEER_PROTO_VERSION, GetSignedMessageProtoVersion(nMessageVersion)));
 }
 
 bool CFinalizedEvolutionVote::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
@@ -1989,6 +2019,25 @@ bool CFinalizedEvolutionVote::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
+
+    nMessageVersion = GetSignedMessageVersion();
+
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        uint256 hash = GetSignatureHash();
+
+        if(!spySendSigner.SignHash(hash, errorMessage, vchSig, keyMasterX)) {
+            LogPrintf("CFinalizedEvolutionVote::Sign - Error upon calling SignHash");
+            return false;
+        }
+
+        if(!spySendSigner.VerifyHash(pubKeyMasterX, vchSig, hash, errorMessage)) {
+            LogPrintf("CFinalizedEvolutionVote::Sign - Error upon calling VerifyHash");
+            return false;
+        }
+
+        return true;
+    }
+
     std::string strMessage = vin.prevout.ToStringShort() + nEvolutionHash.ToString() + boost::lexical_cast<std::string>(nTime);
 
     if(!spySendSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasterX)) {
@@ -2008,8 +2057,6 @@ bool CFinalizedEvolutionVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nEvolutionHash.ToString() + boost::lexical_cast<std::string>(nTime);
-
     CMasterX* pgm = gmineman.Find(vin);
 
     if(pgm == NULL)
@@ -2020,7 +2067,15 @@ bool CFinalizedEvolutionVote::SignatureValid(bool fSignatureCheck)
 
     if(!fSignatureCheck) return true;
 
-    if(!spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage)) {
+    bool fValid;
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        fValid = spySendSigner.VerifyHash(pgm->pubkey2, vchSig, GetSignatureHash(), errorMessage);
+    } else {
+        std::string strMessage = vin.prevout.ToStringShort() + nEvolutionHash.ToString() + boost::lexical_cast<std::string>(nTime);
+        fValid = spySendSigner.VerifyMessage(pgm->pubkey2, vchSig, strMessage, errorMessage);
+    }
+
+    if(!fValid) {
         LogPrintf("CFinalizedEvolutionVote::SignatureValid() - Verify message failed\n");
         return false;
     }
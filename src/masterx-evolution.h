@@ -355,6 +355,7 @@ public:
     uint256 nEvolutionHash;
     int64_t nTime;
     std::vector<unsigned char> vchSig;
+    int nMessageVersion;
 
     CFinalizedEvolutionVote();
     CFinalizedEvolutionVote(CTxIn vinIn, uint256 nEvolutionHashIn);
@@ -371,6 +372,17 @@ public:
         return ss.GetHash();
     }
 
+    /// Hash signed by MESSAGE_VERSION_BINARY votes
+    uint256 GetSignatureHash() const
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << (int)MSG_EVOLUTION_FINALIZED_VOTE; // keeps signatures of different message types apart
+        ss << vin.prevout;
+        ss << nEvolutionHash;
+        ss << nTime;
+        return ss.GetHash();
+    }
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -379,6 +391,10 @@ public:
         READWRITE(nEvolutionHash);
         READWRITE(nTime);
         READWRITE(vchSig);
+        if (nVersion >= BINARY_SIGNED_MESSAGE_VERSION)
+            READWRITE(nMessageVersion);
+        else if (ser_action.ForRead())
+            nMessageVersion = MESSAGE_VERSION_STRING;
     }
 
 };
@@ -551,6 +567,7 @@ public:
     int nVote;
     int64_t nTime;
     std::vector<unsigned char> vchSig;
+    int nMessageVersion;
 
     CEvolutionVote();
     CEvolutionVote(CTxIn vin, uint256 nProposalHash, int nVoteIn);
@@ -575,6 +592,18 @@ public:
         return ss.GetHash();
     }
 
+    /// Hash signed by MESSAGE_VERSION_BINARY votes
+    uint256 GetSignatureHash() const
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << (int)MSG_EVOLUTION_VOTE; // keeps signatures of different message types apart
+        ss << vin.prevout;
+        ss << nProposalHash;
+        ss << nVote;
+        ss << nTime;
+        return ss.GetHash();
+    }
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -584,6 +613,10 @@ public:
         READWRITE(nVote);
         READWRITE(nTime);
         READWRITE(vchSig);
+        if (nVersion >= BINARY_SIGNED_MESSAGE_VERSION)
+            READWRITE(nMessageVersion);
+        else if (ser_action.ForRead())
+            nMessageVersion = MESSAGE_VERSION_STRING;
     }
 
 
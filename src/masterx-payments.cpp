@@ -504,8 +504,73 @@ bool CMasterXPayments::AddWinningMasterX(CMasterXPaymentWinner& winnerIn)
 
     int n = 1;
     if(IsReferenceNode(winnerIn.vinMasterX)) n = 100;
-    mapMasterXBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, n);
 
+    {
+        LOCK(cs_mapMasterXBlocks);
+        CMasterXBlockPayees& blockPayees = mapMasterXBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, n);
+        if(blockPayees.HasPayeeWithVotes(winnerIn.payee, GMPAYMENTS_LAST_PAID_VOTES_REQUIRED))
+            AddLastPaidHeight(winnerIn.payee, winnerIn.nBlockHeight);
+    }
+
+    return true;
+}
+
+void CMasterXPayments::AddLastPaidHeight(const CScript& payee, int nBlockHeight)
+{
+    AssertLockHeld(cs_mapMasterXBlocks);
+
+    mapPayeeVotedHeights[payee].insert(nBlockHeight);
+}
+
+void CMasterXPayments::EraseBlockFromLastPaidIndex(int nBlockHeight)
+{
+    AssertLockHeld(cs_mapMasterXBlocks);
+
+    std::map<int, CMasterXBlockPayees>::iterator it = mapMasterXBlocks.find(nBlockHeight);
+    if(it == mapMasterXBlocks.end()) return;
+
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH(CMasterXPayee& payee, it->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator itPayee = mapPayeeVotedHeights.find(payee.scriptPubKey);
+        if(itPayee == mapPayeeVotedHeights.end()) continue;
+
+        itPayee->second.erase(nBlockHeight);
+        if(itPayee->second.empty()) mapPayeeVotedHeights.erase(itPayee);
+    }
+}
+
+void CMasterXPayments::RebuildLastPaidIndex()
+{
+    LOCK2(cs_mapMasterXBlocks, cs_vecPayments);
+
+    mapPayeeVotedHeights.clear();
+
+    std::map<int, CMasterXBlockPayees>::iterator it = mapMasterXBlocks.begin();
+    for(; it != mapMasterXBlocks.end(); ++it) {
+        BOOST_FOREACH(CMasterXPayee& payee, it->second.vecPayments) {
+            if(payee.nVotes >= GMPAYMENTS_LAST_PAID_VOTES_REQUIRED)
+                AddLastPaidHeight(payee.scriptPubKey, it->first);
+        }
+    }
+}
+
+bool CMasterXPayments::GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight, int& nHeightRet)
+{
+    LOCK(cs_mapMasterXBlocks);
+
+    if(nMinHeight > nMaxHeight) return false;
+
+    std::map<CScript, std::set<int> >::iterator itPayee = mapPayeeVotedHeights.find(payee);
+    if(itPayee == mapPayeeVotedHeights.end()) return false;
+
+    // first height above the range, then step back to the highest one inside it
+    std::set<int>::iterator it = itPayee->second.upper_bound(nMaxHeight);
+    if(it == itPayee->second.begin()) return false;
+    --it;
+    if(*it < nMinHeight) return false;
+
+    nHeightRet = *it;
     return true;
 }
 
@@ -622,6 +687,7 @@ void CMasterXPayments::CleanPaymentList()
             LogPrint("gmpayments", "CMasterXPayments::CleanPaymentList - Removing old MasterX payment - block %d\n", winner.nBlockHeight);
             masterxSync.mapSeenSyncGMW.erase((*it).first);
             mapMasterXPayeeVotes.erase(it++);
+            EraseBlockFromLastPaidIndex(winner.nBlockHeight);
             mapMasterXBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
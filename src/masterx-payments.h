@@ -25,6 +25,7 @@ extern CMasterXPayments masterxPayments;
 
 #define GMPAYMENTS_SIGNATURES_REQUIRED           6
 #define GMPAYMENTS_SIGNATURES_TOTAL              10
+#define GMPAYMENTS_LAST_PAID_VOTES_REQUIRED      2
 
 void ProcessMessageMasterXPayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsReferenceNode(CTxIn& vin);
@@ -223,6 +224,11 @@ class CMasterXPayments
 private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
+    // heights at which each payee has at least GMPAYMENTS_LAST_PAID_VOTES_REQUIRED votes
+    std::map<CScript, std::set<int> > mapPayeeVotedHeights;
+
+    void AddLastPaidHeight(const CScript& payee, int nBlockHeight);
+    void EraseBlockFromLastPaidIndex(int nBlockHeight);
 
 public:
     std::map<uint256, CMasterXPaymentWinner> mapMasterXPayeeVotes;
@@ -238,6 +244,7 @@ public:
         LOCK2(cs_mapMasterXBlocks, cs_mapMasterXPayeeVotes);
         mapMasterXBlocks.clear();
         mapMasterXPayeeVotes.clear();
+        mapPayeeVotedHeights.clear();
     }
 
     bool AddWinningMasterX(CMasterXPaymentWinner& winner);
@@ -247,6 +254,11 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasterX& gm);
 
+    /// Rebuild the payee -> voted heights index from mapMasterXBlocks
+    void RebuildLastPaidIndex();
+    /// Find the highest height in [nMinHeight, nMaxHeight] at which payee was voted in
+    bool GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight, int& nHeightRet);
+
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasterX& gm, int nNotBlockHeight);
@@ -279,6 +291,8 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(mapMasterXPayeeVotes);
         READWRITE(mapMasterXBlocks);
+        if (ser_action.ForRead())
+            RebuildLastPaidIndex();
     }
 };
 
@@ -28,6 +28,8 @@ bool CMasterXSync::IsSynced()
 
 bool CMasterXSync::IsBlockchainSynced()
 {
+    LOCK(cs);
+
     static bool fBlockchainSynced = false;
     static int64_t lastProcess = GetTime();
 
@@ -57,6 +59,7 @@ bool CMasterXSync::IsBlockchainSynced()
     return true;
 }
 
+// requires cs, except in the constructor
 void CMasterXSync::Reset()
 {   
     lastMasterXList = 0;
@@ -82,6 +85,8 @@ void CMasterXSync::Reset()
 
 void CMasterXSync::AddedMasterXList(uint256 hash)
 {
+    LOCK(cs);
+
     if(gmineman.mapSeenMasterXBroadcast.count(hash)) {
         if(mapSeenSyncMNB[hash] < MASTERX_SYNC_THRESHOLD) {
             lastMasterXList = GetTime();
@@ -95,6 +100,8 @@ void CMasterXSync::AddedMasterXList(uint256 hash)
 
 void CMasterXSync::AddedMasterXWinner(uint256 hash)
 {
+    LOCK(cs);
+
     if(masterxPayments.mapMasterXPayeeVotes.count(hash)) {
         if(mapSeenSyncGMW[hash] < MASTERX_SYNC_THRESHOLD) {
             lastMasterXWinner = GetTime();
@@ -108,6 +115,8 @@ void CMasterXSync::AddedMasterXWinner(uint256 hash)
 
 void CMasterXSync::AddedEvolutionItem(uint256 hash)
 {
+    LOCK(cs);
+
     if(evolution.mapSeenMasterXEvolutionProposals.count(hash) || evolution.mapSeenMasterXEvolutionVotes.count(hash) ||
             evolution.mapSeenFinalizedEvolutions.count(hash) || evolution.mapSeenFinalizedEvolutionVotes.count(hash)) {
         if(mapSeenSyncEvolution[hash] < MASTERX_SYNC_THRESHOLD) {
@@ -234,6 +243,7 @@ void CMasterXSync::Process()
             Resync if we lose all masterxs from sleep/wake or failure to sync originally
         */
         if(gmineman.CountEnabled() == 0) {
+            LOCK(cs);
             Reset();
         } else
             return;
@@ -241,6 +251,7 @@ void CMasterXSync::Process()
 
     //try syncing again
     if(RequestedMasterXAssets == MASTERX_SYNC_FAILED && lastFailure + (1*60) < GetTime()) {
+        LOCK(cs);
         Reset();
     } else if (RequestedMasterXAssets == MASTERX_SYNC_FAILED) {
         return;
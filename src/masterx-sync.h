@@ -28,6 +28,10 @@ extern CMasterXSync masterxSync;
 class CMasterXSync
 {
 public:
+    // guards the seen maps and the sync state reset by Reset(), which
+    // concurrent message handlers get to through IsBlockchainSynced()
+    CCriticalSection cs;
+
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncGMW;
     std::map<uint256, int> mapSeenSyncEvolution;
@@ -12,45 +12,58 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasterXScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
+// memoized score preimages by height: (block hash, hash of block hash)
+std::map<int, std::pair<uint256, uint256> > mapCacheScoreHashes;
+CCriticalSection cs_mapCacheScoreHashes;
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block preceding nBlockHeight on the active chain (the tip for 0 or negative heights)
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex *pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0) return false;
 
     if(nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight)){
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
+    if (pindexTip->nHeight+1 < nBlockHeight) return false;
 
-    const CBlockIndex *BlockLastSolved = chainActive.Tip();
-    const CBlockIndex *BlockReading = chainActive.Tip();
+    int nTargetHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nTargetHeight <= 0) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight+1 < nBlockHeight) return false;
+    const CBlockIndex *pindex = chainActive[nTargetHeight];
+    if (pindex == NULL) return false;
 
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    hash = pindex->GetBlockHash();
+    return true;
+}
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+//Get the block hash for nBlockHeight and the hash of it used as the masterx score preimage
+bool GetScoreHashes(uint256& hashBlock, uint256& hashScore, int nBlockHeight)
+{
+    if(!GetBlockHash(hashBlock, nBlockHeight)) return false;
 
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
+    LOCK(cs_mapCacheScoreHashes);
+
+    // entries are checked against the current block hash, so a reorg simply replaces them
+    std::map<int, std::pair<uint256, uint256> >::iterator it = mapCacheScoreHashes.find(nBlockHeight);
+    if (it != mapCacheScoreHashes.end() && it->second.first == hashBlock) {
+        hashScore = it->second.second;
+        return true;
     }
 
-    return false;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    hashScore = ss.GetHash();
+
+    // heights 0 and below follow the tip, don't pin them
+    if (nBlockHeight > 0) {
+        mapCacheScoreHashes[nBlockHeight] = std::make_pair(hashBlock, hashScore);
+        // drop the lowest heights first, they are the least likely to be asked for again
+        while (mapCacheScoreHashes.size() > MASTERX_SCORE_CACHE_SIZE)
+            mapCacheScoreHashes.erase(mapCacheScoreHashes.begin());
+    }
+
+    return true;
 }
 
 CMasterX::CMasterX()
@@ -153,15 +166,13 @@ uint256 CMasterX::CalculateScore(int mod, int64_t nBlockHeight)
     uint256 hash = 0;
     uint256 aux = vin.prevout.hash + vin.prevout.n;
 
-    if(!GetBlockHash(hash, nBlockHeight)) {
+    uint256 hash2 = 0;
+
+    if(!GetScoreHashes(hash, hash2, nBlockHeight)) {
         LogPrintf("CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    ss << hash;
-    uint256 hash2 = ss.GetHash();
-
     CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
     ss2 << hash;
     ss2 << aux;
@@ -194,33 +205,15 @@ void CMasterX::Check(bool forceCheck)
         return;
     }
 
-    if(!unitTest){
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, spySendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if(!lockMain) return;
-
-            if(!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)){
-                activeState = MASTERX_VIN_SPENT;
-                return;
-
-            }
-        }
-    }
-
+    // the collateral is checked in batches by CMasterXMan::CheckCollaterals(), which marks spent inputs
     activeState = MASTERX_ENABLED; // OK
 }
 
-int64_t CMasterX::SecondsSincePayment() {
+int64_t CMasterX::SecondsSincePayment(int nMnCount) {
     CScript pubkeyScript;
     pubkeyScript = GetScriptForDestination(pubkey.GetID());
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMnCount));
     int64_t month = 60*60*24*30;
     if(sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -233,7 +226,7 @@ int64_t CMasterX::SecondsSincePayment() {
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasterX::GetLastPaid() {
+int64_t CMasterX::GetLastPaid(int nMnCount) {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if(pindexPrev == NULL) return false;
 
@@ -248,33 +241,21 @@ int64_t CMasterX::GetLastPaid() {
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150; 
 
-    if (chainActive.Tip() == NULL) return false;
+    if(nMnCount == -1) nMnCount = gmineman.CountEnabled();
 
-    const CBlockIndex *BlockReading = chainActive.Tip();
-
-    int nMnCount = gmineman.CountEnabled()*1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nMnCount){
-            return 0;
-        }
-        n++;
-
-        if(masterxPayments.mapMasterXBlocks.count(BlockReading->nHeight)){
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if(masterxPayments.mapMasterXBlocks[BlockReading->nHeight].HasPayeeWithVotes(gmpayee, 2)){
-                return BlockReading->nTime + nOffset;
-            }
-        }
+    /*
+        Search the last CountEnabled()*1.25 blocks for this payee, with at least 2 votes. This will aid in
+        consensus allowing the network to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nLookBack = nMnCount*1.25;
+    int nHeight = 0;
+    if(!masterxPayments.GetLastPaidHeight(gmpayee, std::max(1, pindexPrev->nHeight - nLookBack + 1), pindexPrev->nHeight, nHeight))
+        return 0;
 
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex* pindex = chainActive[nHeight];
+    if(pindex == NULL) return 0;
 
-    return 0;
+    return pindex->nTime + nOffset;
 }
 
 CMasterXBroadcast::CMasterXBroadcast()
@@ -459,7 +440,7 @@ bool CMasterXBroadcast::CheckAndUpdate(int& nDos)
     if(pgm->pubkey == pubkey && !pgm->IsBroadcastedWithin(MASTERX_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrintf("gmb - Got updated entry for %s\n", addr.ToString());
-        if(pgm->UpdateFromNewBroadcast((*this))){
+        if(gmineman.UpdateFromNewBroadcast(pgm, *this)){
             pgm->Check();
             if(pgm->IsEnabled()) Relay();
         }
@@ -501,6 +482,7 @@ bool CMasterXBroadcast::CheckInputsAndAdd(int& nDoS)
         if(!lockMain) {
             // not gmb fault, let it to be checked again later
             gmineman.mapSeenMasterXBroadcast.erase(GetHash());
+            LOCK(masterxSync.cs);
             masterxSync.mapSeenSyncMNB.erase(GetHash());
             return false;
         }
@@ -514,25 +496,24 @@ bool CMasterXBroadcast::CheckInputsAndAdd(int& nDoS)
 
     LogPrint("masterx", "gmb - Accepted MasterX entry\n");
 
-    if(GetInputAge(vin) < MASTERX_MIN_CONFIRMATIONS){
+    int nInputAge = GetInputAge(vin);
+    if(nInputAge < MASTERX_MIN_CONFIRMATIONS){
         LogPrintf("gmb - Input must have at least %d confirmations\n", MASTERX_MIN_CONFIRMATIONS);
         // maybe we miss few blocks, let this gmb to be checked again later
         gmineman.mapSeenMasterXBroadcast.erase(GetHash());
+        LOCK(masterxSync.cs);
         masterxSync.mapSeenSyncMNB.erase(GetHash());
         return false;
     }
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 REDUX tx got MASTERX_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second)
+    // (the height comes from the coins, so this does not need the block itself, which may be pruned)
     {
-        CBlockIndex* pMNIndex = (*mi).second; // block for 1000 REDUX tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERX_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERX_MIN_CONFIRMATIONS
-        if(pConfIndex->GetBlockTime() > sigTime)
+        LOCK(cs_main);
+        int nMNHeight = chainActive.Height() + 1 - nInputAge; // block for 1000 REDUX tx -> 1 confirmation
+        CBlockIndex* pConfIndex = chainActive[nMNHeight + MASTERX_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERX_MIN_CONFIRMATIONS
+        if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
         {
             LogPrintf("gmb - Bad sigTime %d for MasterX %20s %105s (%i conf block is at %d)\n",
                       sigTime, addr.ToString(), vin.ToString(), MASTERX_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -560,7 +541,7 @@ bool CMasterXBroadcast::CheckInputsAndAdd(int& nDoS)
 void CMasterXBroadcast::Relay()
 {
     CInv inv(MSG_MASTERX_ANNOUNCE, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, GetSignedMessageProtoVersion(lastPing.nMessageVersion));
 }
 
 bool CMasterXBroadcast::Sign(CKey& keyCollateralAddress)
@@ -605,6 +586,7 @@ CMasterXPing::CMasterXPing()
     blockHash = uint256(0);
     sigTime = 0;
     vchSig = std::vector<unsigned char>();
+    nMessageVersion = MESSAGE_VERSION_STRING;
 }
 
 CMasterXPing::CMasterXPing(CTxIn& newVin)
@@ -613,6 +595,7 @@ CMasterXPing::CMasterXPing(CTxIn& newVin)
     blockHash = chainActive[chainActive.Height() - 12]->GetBlockHash();
     sigTime = GetAdjustedTime();
     vchSig = std::vector<unsigned char>();
+    nMessageVersion = MESSAGE_VERSION_STRING;
 }
 
 
@@ -622,6 +605,24 @@ bool CMasterXPing::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
     std::string strMasterXSignMessage;
 
     sigTime = GetAdjustedTime();
+    nMessageVersion = GetSignedMessageVersion();
+
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        uint256 hash = GetSignatureHash();
+
+        if(!spySendSigner.SignHash(hash, errorMessage, vchSig, keyMasterX)) {
+            LogPrintf("CMasterXPing::Sign() - Error: %s\n", errorMessage);
+            return false;
+        }
+
+        if(!spySendSigner.VerifyHash(pubKeyMasterX, vchSig, hash, errorMessage)) {
+            LogPrintf("CMasterXPing::Sign() - Error: %s\n", errorMessage);
+            return false;
+        }
+
+        return true;
+    }
+
     std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
 
     if(!spySendSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasterX)) {
@@ -638,10 +639,17 @@ bool CMasterXPing::Sign(CKey& keyMasterX, CPubKey& pubKeyMasterX)
 }
 
 bool CMasterXPing::VerifySignature(CPubKey& pubKeyMasterX, int &nDos) {
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
     std::string errorMessage = "";
+    bool fValid;
+
+    if(nMessageVersion == MESSAGE_VERSION_BINARY) {
+        fValid = spySendSigner.VerifyHash(pubKeyMasterX, vchSig, GetSignatureHash(), errorMessage);
+    } else {
+        std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+        fValid = spySendSigner.VerifyMessage(pubKeyMasterX, vchSig, strMessage, errorMessage);
+    }
 
-    if(!spySendSigner.VerifyMessage(pubKeyMasterX, vchSig, strMessage, errorMessage))
+    if(!fValid)
     {
         LogPrintf("CMasterXPing::VerifySignature - Got bad MasterX ping signature %s Error: %s\n", vin.ToString(), errorMessage);
         nDos = 33;
@@ -686,35 +694,36 @@ bool CMasterXPing::CheckAndUpdate(int& nDos, bool fRequireEnabled, bool fCheckSi
             if(!VerifySignature(pgm->pubkey2, nDos))
                 return false;
 
-            BlockMap::iterator mi = mapBlockIndex.find(blockHash);
-            if (mi != mapBlockIndex.end() && (*mi).second)
             {
-                if((*mi).second->nHeight < chainActive.Height() - 24)
-                {
-                    LogPrintf("CMasterXPing::CheckAndUpdate - MasterX %s block hash %s is too old\n", vin.ToString(), blockHash.ToString());
-                    // Do nothing here (no MasterX update, no mnping relay)
-                    // Let this node to be visible but fail to accept mnping
-
+                // mnp is handled concurrently with other messages, don't hold its thread up on cs_main
+                TRY_LOCK(cs_main, lockMain);
+                if(!lockMain) {
+                    // not mnp fault, let it to be checked again later
+                    gmineman.mapSeenMasterXPing.erase(GetHash());
                     return false;
                 }
-            } else {
-                if (fDebug) LogPrintf("CMasterXPing::CheckAndUpdate - MasterX %s block hash %s is unknown\n", vin.ToString(), blockHash.ToString());
-                // maybe we stuck so we shouldn't ban this node, just fail to accept it
-                // TODO: or should we also request this block?
 
-                return false;
-            }
-
-            pgm->lastPing = *this;
+                BlockMap::iterator mi = mapBlockIndex.find(blockHash);
+                if (mi != mapBlockIndex.end() && (*mi).second)
+                {
+                    if((*mi).second->nHeight < chainActive.Height() - 24)
+                    {
+                        LogPrintf("CMasterXPing::CheckAndUpdate - MasterX %s block hash %s is too old\n", vin.ToString(), blockHash.ToString());
+                        // Do nothing here (no MasterX update, no mnping relay)
+                        // Let this node to be visible but fail to accept mnping
+
+                        return false;
+                    }
+                } else {
+                    if (fDebug) LogPrintf("CMasterXPing::CheckAndUpdate - MasterX %s block hash %s is unknown\n", vin.ToString(), blockHash.ToString());
+                    // maybe we stuck so we shouldn't ban this node, just fail to accept it
+                    // TODO: or should we also request this block?
 
-            //gmineman.mapSeenMasterXBroadcast.lastPing is probably outdated, so we'll update it
-            CMasterXBroadcast gmb(*pgm);
-            uint256 hash = gmb.GetHash();
-            if(gmineman.mapSeenMasterXBroadcast.count(hash)) {
-                gmineman.mapSeenMasterXBroadcast[hash].lastPing = *this;
+                    return false;
+                }
             }
 
-            pgm->Check(true);
+            gmineman.UpdateLastPing(pgm, *this);
             if(!pgm->IsEnabled()) return false;
 
             LogPrint("masterx", "CMasterXPing::CheckAndUpdate - MasterX ping accepted, vin: %s\n", vin.ToString());
@@ -734,5 +743,5 @@ bool CMasterXPing::CheckAndUpdate(int& nDos, bool fRequireEnabled, bool fCheckSi
 void CMasterXPing::Relay()
 {
     CInv inv(MSG_MASTERX_PING, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, GetSignedMessageProtoVersion(nMessageVersion));
 }
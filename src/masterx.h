@@ -20,15 +20,16 @@
 #define MASTERX_EXPIRATION_SECONDS          (65*60)
 #define MASTERX_REMOVAL_SECONDS             (75*60)
 #define MASTERX_CHECK_SECONDS               5
+#define MASTERX_SCORE_CACHE_SIZE            1000
 
 using namespace std;
 
 class CMasterX;
 class CMasterXBroadcast;
 class CMasterXPing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
+bool GetScoreHashes(uint256& hashBlock, uint256& hashScore, int nBlockHeight);
 
 
 //
@@ -43,6 +44,7 @@ public:
     uint256 blockHash;
     int64_t sigTime; //gmb message times
     std::vector<unsigned char> vchSig;
+    int nMessageVersion;
     //removed stop
 
     CMasterXPing();
@@ -56,6 +58,10 @@ public:
         READWRITE(blockHash);
         READWRITE(sigTime);
         READWRITE(vchSig);
+        if (nVersion >= BINARY_SIGNED_MESSAGE_VERSION)
+            READWRITE(nMessageVersion);
+        else if (ser_action.ForRead())
+            nMessageVersion = MESSAGE_VERSION_STRING;
     }
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true, bool fCheckSigTimeOnly = false);
@@ -70,6 +76,17 @@ public:
         return ss.GetHash();
     }
 
+    /// Hash signed by MESSAGE_VERSION_BINARY pings
+    uint256 GetSignatureHash() const
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << (int)MSG_MASTERX_PING; // keeps signatures of different message types apart
+        ss << vin;
+        ss << blockHash;
+        ss << sigTime;
+        return ss.GetHash();
+    }
+
     void swap(CMasterXPing& first, CMasterXPing& second) // nothrow
     {
         // enable ADL (not necessary in our case, but good practice)
@@ -81,6 +98,7 @@ public:
         swap(first.blockHash, second.blockHash);
         swap(first.sigTime, second.sigTime);
         swap(first.vchSig, second.vchSig);
+        swap(first.nMessageVersion, second.nMessageVersion);
     }
 
     CMasterXPing& operator=(CMasterXPing from)
@@ -206,7 +224,7 @@ public:
             READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasterXBroadcast& gmb);
 
@@ -268,7 +286,8 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    /// Time of the last block this masterx was voted to be paid in, nMnCount defaults to CountEnabled()
+    int64_t GetLastPaid(int nMnCount = -1);
 
 };
 
@@ -6,6 +6,7 @@
 #include "masterx.h"
 #include "activemasterx.h"
 #include "stealthx.h"
+#include "instantx.h"
 #include "util.h"
 #include "addrman.h"
 #include "spork.h"
@@ -15,6 +16,8 @@
 /** MasterX manager */
 CMasterXMan gmineman;
 
+CMasterXKeyHasher::CMasterXKeyHasher() : salt(GetRandHash()) {}
+
 struct CompareLastPaid
 {
     bool operator()(const pair<int64_t, CTxIn>& t1,
@@ -204,6 +207,8 @@ void DumpMasterXs()
 
 CMasterXMan::CMasterXMan() {
     nDsqCount = 0;
+    nLastCollateralCheckCount = 0;
+    nLastCollateralCheckMicros = 0;
 }
 
 bool CMasterXMan::Add(CMasterX &gm)
@@ -218,6 +223,8 @@ bool CMasterXMan::Add(CMasterX &gm)
     {
         LogPrint("masterx", "CMasterXMan: Adding new MasterX %s - %i now\n", gm.addr.ToString(), size() + 1);
         vMasterXs.push_back(gm);
+        IndexMasterX(vMasterXs.size() - 1);
+        InvalidateRankCache();
         return true;
     }
 
@@ -226,23 +233,30 @@ bool CMasterXMan::Add(CMasterX &gm)
 
 void CMasterXMan::AskForGM(CNode* pnode, CTxIn &vin)
 {
-    std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasterXListEntry.find(vin.prevout);
-    if (i != mWeAskedForMasterXListEntry.end())
     {
-        int64_t t = (*i).second;
-        if (GetTime() < t) return; // we've asked recently
+        // called by the handlers of several concurrent commands
+        LOCK(cs);
+        std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasterXListEntry.find(vin.prevout);
+        if (i != mWeAskedForMasterXListEntry.end())
+        {
+            int64_t t = (*i).second;
+            if (GetTime() < t) return; // we've asked recently
+        }
+
+        int64_t askAgain = GetTime() + MASTERX_MIN_MNP_SECONDS;
+        mWeAskedForMasterXListEntry[vin.prevout] = askAgain;
     }
 
     // ask for the gmb info once from the node that sent mnp
 
     LogPrintf("CMasterXMan::AskForGM - Asking node for missing entry, vin: %s\n", vin.ToString());
     pnode->PushMessage("dseg", vin);
-    int64_t askAgain = GetTime() + MASTERX_MIN_MNP_SECONDS;
-    mWeAskedForMasterXListEntry[vin.prevout] = askAgain;
 }
 
 void CMasterXMan::Check()
 {
+    CheckCollaterals();
+
     LOCK(cs);
 
     BOOST_FOREACH(CMasterX& gm, vMasterXs) {
@@ -250,6 +264,80 @@ void CMasterXMan::Check()
     }
 }
 
+// Could the collateral still be spent by a 1000 REDUX masterx transaction? Mirrors what
+// AcceptableInputs() checks for a transaction spending it, minus scripts and fees.
+static bool IsCollateralUnspent(const COutPoint& outpoint, int nSpendHeight)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    // spent in the mempool or locked by InstantX
+    if(mempool.mapNextTx.count(outpoint) || mapLockedInputs.count(outpoint)) return false;
+
+    CAmount nValue = 0;
+    const CCoins* coins = pcoinsTip->AccessCoins(outpoint.hash);
+    if(coins != NULL) {
+        if(!coins->IsAvailable(outpoint.n)) return false;
+        if(coins->IsCoinBase() && nSpendHeight - coins->nHeight < COINBASE_MATURITY) return false;
+        nValue = coins->vout[outpoint.n].nValue;
+    } else {
+        // the collateral may still be unconfirmed
+        CTransaction tx;
+        if(!mempool.lookup(outpoint.hash, tx) || outpoint.n >= tx.vout.size()) return false;
+        nValue = tx.vout[outpoint.n].nValue;
+    }
+
+    return nValue >= 999.99*COIN;
+}
+
+void CMasterXMan::CheckCollaterals()
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    // snapshot the collaterals that still need checking
+    std::vector<COutPoint> vOutPoints;
+    {
+        LOCK(cs);
+        vOutPoints.reserve(vMasterXs.size());
+        BOOST_FOREACH(CMasterX& gm, vMasterXs) {
+            if(gm.unitTest || gm.activeState == CMasterX::MASTERX_VIN_SPENT) continue;
+            vOutPoints.push_back(gm.vin.prevout);
+        }
+    }
+
+    int64_t nTime1 = GetTimeMicros();
+
+    // resolve them all with one lock acquisition
+    std::vector<COutPoint> vSpent;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if(chainActive.Tip() == NULL) return;
+
+        int nSpendHeight = chainActive.Height() + 1;
+        BOOST_FOREACH(const COutPoint& outpoint, vOutPoints) {
+            if(!IsCollateralUnspent(outpoint, nSpendHeight)) vSpent.push_back(outpoint);
+        }
+    }
+
+    int64_t nTime2 = GetTimeMicros();
+
+    // publish the results in one go
+    {
+        LOCK(cs);
+        BOOST_FOREACH(const COutPoint& outpoint, vSpent) {
+            CMasterX* pgm = Find(CTxIn(outpoint));
+            if(pgm != NULL && !pgm->unitTest) pgm->activeState = CMasterX::MASTERX_VIN_SPENT;
+        }
+        if(!vSpent.empty()) InvalidateRankCache();
+
+        nLastCollateralCheckCount = vOutPoints.size();
+        nLastCollateralCheckMicros = GetTimeMicros() - nTimeStart;
+    }
+
+    LogPrint("masterx", "CMasterXMan::CheckCollaterals - %d collaterals, %d spent: snapshot %.2fms, lookup %.2fms, publish %.2fms\n",
+        vOutPoints.size(), vSpent.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime2 - nTime1), 0.001 * (GetTimeMicros() - nTime2));
+}
+
 void CMasterXMan::CheckAndRemove(bool forceExpiredRemoval)
 {
     Check();
@@ -257,6 +345,7 @@ void CMasterXMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
+    bool fRemoved = false;
     vector<CMasterX>::iterator it = vMasterXs.begin();
     while(it != vMasterXs.end()){
         if((*it).activeState == CMasterX::MASTERX_REMOVE ||
@@ -279,21 +368,20 @@ void CMasterXMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             // allow us to ask for this masterx again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasterXListEntry.begin();
-            while(it2 != mWeAskedForMasterXListEntry.end()){
-                if((*it2).first == (*it).vin.prevout){
-                    mWeAskedForMasterXListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasterXListEntry.erase((*it).vin.prevout);
 
             it = vMasterXs.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if(fRemoved) {
+        RebuildIndexes();
+        InvalidateRankCache();
+    }
+
     // check who's asked for the MasterX list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasterXList.begin();
     while(it1 != mAskedUsForMasterXList.end()){
@@ -352,11 +440,15 @@ void CMasterXMan::Clear()
 {
     LOCK(cs);
     vMasterXs.clear();
+    mapIndexByOutPoint.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
     mAskedUsForMasterXList.clear();
     mWeAskedForMasterXList.clear();
     mWeAskedForMasterXListEntry.clear();
     mapSeenMasterXBroadcast.clear();
     mapSeenMasterXPing.clear();
+    mapRankCache.clear();
     nDsqCount = 0;
 }
 
@@ -396,30 +488,44 @@ void CMasterXMan::DsegUpdate(CNode* pnode)
     mWeAskedForMasterXList[pnode->addr] = askAgain;
 }
 
+void CMasterXMan::IndexMasterX(size_t nIndex)
+{
+    AssertLockHeld(cs);
+
+    const CMasterX& gm = vMasterXs[nIndex];
+
+    // insert() keeps an existing position, so duplicates resolve to the first entry like a linear scan would
+    mapIndexByOutPoint.insert(make_pair(gm.vin.prevout, nIndex));
+    mapIndexByPayee.insert(make_pair(GetScriptForDestination(gm.pubkey.GetID()), nIndex));
+    mapIndexByPubKey.insert(make_pair(gm.pubkey2, nIndex));
+}
+
+void CMasterXMan::RebuildIndexes()
+{
+    AssertLockHeld(cs);
+
+    mapIndexByOutPoint.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
+
+    for(size_t i = 0; i < vMasterXs.size(); i++)
+        IndexMasterX(i);
+}
+
 CMasterX *CMasterXMan::Find(const CScript &payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH(CMasterX& gm, vMasterXs)
-    {
-        payee2 = GetScriptForDestination(gm.pubkey.GetID());
-        if(payee2 == payee)
-            return &gm;
-    }
-    return NULL;
+    boost::unordered_map<CScript, size_t, CMasterXKeyHasher>::iterator it = mapIndexByPayee.find(payee);
+    return it != mapIndexByPayee.end() ? &vMasterXs[it->second] : NULL;
 }
 
 CMasterX *CMasterXMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasterX& gm, vMasterXs)
-    {
-        if(gm.vin.prevout == vin.prevout)
-            return &gm;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, size_t, CMasterXKeyHasher>::iterator it = mapIndexByOutPoint.find(vin.prevout);
+    return it != mapIndexByOutPoint.end() ? &vMasterXs[it->second] : NULL;
 }
 
 
@@ -427,12 +533,8 @@ CMasterX *CMasterXMan::Find(const CPubKey &pubKeyMasterX)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasterX& gm, vMasterXs)
-    {
-        if(gm.pubkey2 == pubKeyMasterX)
-            return &gm;
-    }
-    return NULL;
+    boost::unordered_map<CPubKey, size_t, CMasterXKeyHasher>::iterator it = mapIndexByPubKey.find(pubKeyMasterX);
+    return it != mapIndexByPubKey.end() ? &vMasterXs[it->second] : NULL;
 }
 
 // 
@@ -467,7 +569,7 @@ CMasterX* CMasterXMan::GetNextMasterXInQueueForPayment(int nBlockHeight, bool fF
         //make sure it has as many confirmations as there are masterxs
         if(gm.GetMasterXInputAge() < nMnCount) continue;
 
-        vecMasterXLastPaid.push_back(make_pair(gm.SecondsSincePayment(), gm.vin));
+        vecMasterXLastPaid.push_back(make_pair(gm.SecondsSincePayment(nMnCount), gm.vin));
     }
 
     nCount = (int)vecMasterXLastPaid.size();
@@ -512,18 +614,14 @@ CMasterX *CMasterXMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude, int
 
     int rand = GetRandInt(nCountEnabled - vecToExclude.size());
     LogPrintf("CMasterXMan::FindRandomNotInVec - rand %d\n", rand);
-    bool found;
+
+    std::set<COutPoint> setToExclude;
+    BOOST_FOREACH(CTxIn &usedVin, vecToExclude)
+        setToExclude.insert(usedVin.prevout);
 
     BOOST_FOREACH(CMasterX &gm, vMasterXs) {
         if(gm.protocolVersion < protocolVersion || !gm.IsEnabled()) continue;
-        found = false;
-        BOOST_FOREACH(CTxIn &usedVin, vecToExclude) {
-            if(gm.vin.prevout == usedVin.prevout) {
-                found = true;
-                break;
-            }
-        }
-        if(found) continue;
+        if(setToExclude.count(gm.vin.prevout)) continue;
         if(--rand < 1) {
             return &gm;
         }
@@ -556,6 +654,56 @@ CMasterX* CMasterXMan::GetCurrentMasterX(int mod, int64_t nBlockHeight, int minP
     return winner;
 }
 
+const CMasterXRankTable* CMasterXMan::GetRankTable(int64_t nBlockHeight, int minProtocol)
+{
+    AssertLockHeld(cs);
+
+    if(chainActive.Tip() == NULL) return NULL;
+
+    // a new tip (or a reorg) can change which block every height is scored against
+    if(hashRankCacheTip != chainActive.Tip()->GetBlockHash()) {
+        mapRankCache.clear();
+        hashRankCacheTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    // states are refreshed by Check() at most every MASTERX_CHECK_SECONDS, rebuild at the same pace
+    std::pair<int64_t, int> key = make_pair(nBlockHeight, minProtocol);
+    std::map<std::pair<int64_t, int>, CMasterXRankTable>::iterator it = mapRankCache.find(key);
+    if(it != mapRankCache.end() && GetTime() - it->second.nTimeCreated < MASTERX_CHECK_SECONDS)
+        return &it->second;
+
+    std::vector<pair<int64_t, CTxIn> > vecMasterXScores;
+
+    BOOST_FOREACH(CMasterX& gm, vMasterXs) {
+        if(gm.protocolVersion < minProtocol) continue;
+        gm.Check();
+        if(!gm.IsEnabled()) continue;
+
+        uint256 n = gm.CalculateScore(1, nBlockHeight);
+        int64_t n2 = n.GetCompact(false);
+
+        vecMasterXScores.push_back(make_pair(n2, gm.vin));
+    }
+
+    sort(vecMasterXScores.rbegin(), vecMasterXScores.rend(), CompareScoreTxIn());
+
+    if(mapRankCache.size() >= MASTERXS_RANK_CACHE_SIZE) mapRankCache.clear();
+
+    CMasterXRankTable& table = mapRankCache[key];
+    table.nTimeCreated = GetTime();
+    table.vecRanked.clear();
+    table.mapRanks.clear();
+
+    int rank = 0;
+    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn)& s, vecMasterXScores){
+        rank++;
+        table.vecRanked.push_back(s.second);
+        table.mapRanks.insert(make_pair(s.second.prevout, rank));
+    }
+
+    return &table;
+}
+
 int CMasterXMan::GetMasterXRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
     std::vector<pair<int64_t, CTxIn> > vecMasterXScores;
@@ -564,13 +712,19 @@ int CMasterXMan::GetMasterXRank(const CTxIn& vin, int64_t nBlockHeight, int minP
     uint256 hash = 0;
     if(!GetBlockHash(hash, nBlockHeight)) return -1;
 
+    LOCK(cs);
+
+    if(fOnlyActive) {
+        const CMasterXRankTable* pTable = GetRankTable(nBlockHeight, minProtocol);
+        if(pTable == NULL) return -1;
+
+        boost::unordered_map<COutPoint, int, CMasterXKeyHasher>::const_iterator it = pTable->mapRanks.find(vin.prevout);
+        return it != pTable->mapRanks.end() ? it->second : -1;
+    }
+
     // scan for winner
     BOOST_FOREACH(CMasterX& gm, vMasterXs) {
         if(gm.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            gm.Check();
-            if(!gm.IsEnabled()) continue;
-        }
         uint256 n = gm.CalculateScore(1, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
@@ -630,14 +784,19 @@ CMasterX* CMasterXMan::GetMasterXByRank(int nRank, int64_t nBlockHeight, int min
 {
     std::vector<pair<int64_t, CTxIn> > vecMasterXScores;
 
+    LOCK(cs);
+
+    if(fOnlyActive) {
+        const CMasterXRankTable* pTable = GetRankTable(nBlockHeight, minProtocol);
+        if(pTable == NULL || nRank < 1 || nRank > (int)pTable->vecRanked.size()) return NULL;
+
+        return Find(pTable->vecRanked[nRank - 1]);
+    }
+
     // scan for winner
     BOOST_FOREACH(CMasterX& gm, vMasterXs) {
 
         if(gm.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            gm.Check();
-            if(!gm.IsEnabled()) continue;
-        }
 
         uint256 n = gm.CalculateScore(1, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
@@ -786,6 +945,8 @@ void CMasterXMan::Remove(CTxIn vin)
         if((*it).vin == vin){
             LogPrint("masterx", "CMasterXMan: Removing MasterX %s - %i now\n", (*it).addr.ToString(), size() - 1);
             vMasterXs.erase(it);
+            RebuildIndexes();
+            InvalidateRankCache();
             break;
         }
         ++it;
@@ -800,7 +961,8 @@ std::string CMasterXMan::ToString() const
             ", peers who asked us for MasterX list: " << (int)mAskedUsForMasterXList.size() <<
             ", peers we asked for MasterX list: " << (int)mWeAskedForMasterXList.size() <<
             ", entries in MasterX list we asked for: " << (int)mWeAskedForMasterXListEntry.size() <<
-            ", nDsqCount: " << (int)nDsqCount;
+            ", nDsqCount: " << (int)nDsqCount <<
+            ", last collateral check: " << nLastCollateralCheckCount << " in " << nLastCollateralCheckMicros << "us";
 
     return info.str();
 }
@@ -818,8 +980,36 @@ void CMasterXMan::UpdateMasterXList(CMasterXBroadcast gmb) {
         CMasterX gm(gmb);
         Add(gm);
     } else {
-        pgm->UpdateFromNewBroadcast(gmb);
+        UpdateFromNewBroadcast(pgm, gmb);
+    }
+}
+
+void CMasterXMan::UpdateLastPing(CMasterX* pgm, const CMasterXPing& mnp)
+{
+    LOCK(cs);
+    pgm->lastPing = mnp;
+
+    //mapSeenMasterXBroadcast.lastPing is probably outdated, so we'll update it
+    CMasterXBroadcast gmb(*pgm);
+    uint256 hash = gmb.GetHash();
+    if(mapSeenMasterXBroadcast.count(hash)) {
+        mapSeenMasterXBroadcast[hash].lastPing = mnp;
     }
+
+    pgm->Check(true);
+}
+
+bool CMasterXMan::UpdateFromNewBroadcast(CMasterX* pgm, CMasterXBroadcast& gmb)
+{
+    CPubKey pubkey2Old = pgm->pubkey2;
+    if(!pgm->UpdateFromNewBroadcast(gmb)) return false;
+
+    LOCK(cs);
+    // the masterx key can be rotated by a new broadcast
+    if(pgm->pubkey2 != pubkey2Old) RebuildIndexes();
+    // and its protocol version, which the ranks are filtered by, can change
+    InvalidateRankCache();
+    return true;
 }
 
 bool CMasterXMan::CheckMnbAndUpdateMasterXList(CMasterXBroadcast gmb, int& nDos) {
@@ -839,8 +1029,15 @@ bool CMasterXMan::CheckMnbAndUpdateMasterXList(CMasterXBroadcast gmb, int& nDos)
         return false;
     }
 
+    // a spent collateral is not the relaying peer's fault: CheckInputsAndAdd would reject it without nDos
+    CTxOut txoutCollateral;
+    if(!GetUnspentOutput(gmb.vin.prevout, txoutCollateral)) {
+        LogPrint("masterx", "CMasterXMan::CheckMnbAndUpdateMasterXList - MasterX collateral %s is spent or unknown\n", gmb.vin.prevout.ToString());
+        return false;
+    }
+
     // make sure the vout that was signed is related to the transaction that spawned the MasterX
-    //  - this is expensive, so it's only done once per MasterX
+    //  - this is only done once per MasterX
     if(!spySendSigner.IsVinAssociatedWithPubkey(gmb.vin, gmb.pubkey)) {
         LogPrintf("CMasterXMan::CheckMnbAndUpdateMasterXList - Got mismatched pubkey and vin\n");
         nDos = 33;
@@ -13,8 +13,11 @@
 #include "main.h"
 #include "masterx.h"
 
+#include <boost/unordered_map.hpp>
+
 #define MASTERXS_DUMP_SECONDS               (15*60)
 #define MASTERXS_DSEG_SECONDS               (3*60*60)
+#define MASTERXS_RANK_CACHE_SIZE            100
 
 using namespace std;
 
@@ -46,17 +49,52 @@ public:
     ReadResult Read(CMasterXMan& gminemanToLoad, bool fDryRun = false);
 };
 
+/** Salted hasher for the keys the masterx list is indexed by */
+class CMasterXKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CMasterXKeyHasher();
+
+    size_t operator()(const COutPoint& key) const {
+        return key.hash.GetHash(salt) ^ key.n;
+    }
+
+    size_t operator()(const CScript& key) const {
+        return Hash(key.begin(), key.end()).GetHash(salt);
+    }
+
+    size_t operator()(const CPubKey& key) const {
+        return key.GetHash().GetHash(salt);
+    }
+};
+
+/** Ranks of the enabled masterxs for one block height and minimum protocol version */
+class CMasterXRankTable
+{
+public:
+    int64_t nTimeCreated;
+    // vin ranked n is stored at n-1
+    std::vector<CTxIn> vecRanked;
+    boost::unordered_map<COutPoint, int, CMasterXKeyHasher> mapRanks;
+
+    CMasterXRankTable() : nTimeCreated(0) {}
+};
+
 class CMasterXMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // critical section to protect the inner data structures specifically on messaging
-    mutable CCriticalSection cs_process_message;
-
     // map to hold all MNs
     std::vector<CMasterX> vMasterXs;
+    // positions in vMasterXs by collateral outpoint, payee script and masterx pubkey (first entry wins)
+    boost::unordered_map<COutPoint, size_t, CMasterXKeyHasher> mapIndexByOutPoint;
+    boost::unordered_map<CScript, size_t, CMasterXKeyHasher> mapIndexByPayee;
+    boost::unordered_map<CPubKey, size_t, CMasterXKeyHasher> mapIndexByPubKey;
     // who's asked for the MasterX list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasterXList;
     // who we asked for the MasterX list and the last time
@@ -64,7 +102,24 @@ private:
     // which MasterXs we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasterXListEntry;
 
+    // rank tables by (block height, min protocol), only valid for hashRankCacheTip
+    std::map<std::pair<int64_t, int>, CMasterXRankTable> mapRankCache;
+    uint256 hashRankCacheTip;
+
+    /// Get the cached ranks of enabled MasterXs for this height, building them if needed
+    const CMasterXRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol);
+    /// Drop all cached rank tables, called whenever the list changes
+    void InvalidateRankCache() { mapRankCache.clear(); }
+
+    /// Add the entry at nIndex in vMasterXs to the lookup indexes
+    void IndexMasterX(size_t nIndex);
+    /// Rebuild the lookup indexes, needed whenever entries move or change keys
+    void RebuildIndexes();
+
 public:
+    // critical section to protect the inner data structures specifically on messaging
+    mutable CCriticalSection cs_process_message;
+
     // Keep track of all broadcasts I've seen
     map<uint256, CMasterXBroadcast> mapSeenMasterXBroadcast;
     // Keep track of all pings I've seen
@@ -73,12 +128,18 @@ public:
     // keep track of dsq count to prevent masterxs from gaming stealthx queue
     int64_t nDsqCount;
 
+    // stats of the last collateral check pass
+    int nLastCollateralCheckCount;
+    int64_t nLastCollateralCheckMicros;
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         LOCK(cs);
         READWRITE(vMasterXs);
+        if (ser_action.ForRead())
+            RebuildIndexes();
         READWRITE(mAskedUsForMasterXList);
         READWRITE(mWeAskedForMasterXList);
         READWRITE(mWeAskedForMasterXListEntry);
@@ -100,6 +161,9 @@ public:
     /// Check all MasterXs
     void Check();
 
+    /// Look up all collaterals under a single cs_main lock and mark spent ones
+    void CheckCollaterals();
+
     /// Check all MasterXs and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
@@ -141,6 +205,10 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Record a newer ping of an existing entry, in the entry and in its seen broadcast
+    void UpdateLastPing(CMasterX* pgm, const CMasterXPing& mnp);
+    /// Update an existing entry from a newer broadcast, keeping the lookup indexes and ranks current
+    bool UpdateFromNewBroadcast(CMasterX* pgm, CMasterXBroadcast& gmb);
     /// Update masterx list and maps using provided CMasterXBroadcast
     void UpdateMasterXList(CMasterXBroadcast gmb);
     /// Perform complete check and only then update list and maps
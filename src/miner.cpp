@@ -9,7 +9,7 @@
 #include "amount.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
-#include "hash.h"
+#include "hashx11.h"
 #include "main.h"
 #include "net.h"
 #include "pow.h"
@@ -21,8 +21,8 @@
 #endif
 #include "masterx-payments.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -31,53 +31,118 @@ using namespace std;
 // ReduxMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Priority order of transactions for the high-priority part of the block
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*(b.second), *(a.second)); // reverse, to make it less-than
+        return a.first < b.first;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Parents before children: a transaction has more in-mempool ancestors than any of them
+class CompareTxIterByAncestorCount
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b)
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+//
+// A block being put together by CreateNewBlock: what is in it so far, and
+// the coins view its transactions are checked against.
+//
+class CBlockAssembly
+{
+public:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    const int nHeight;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nScriptFlags;
+    const bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockAssembly(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, const CBlockIndex* pindexPrev, unsigned int nBlockMaxSizeIn) :
+        pblocktemplate(pblocktemplateIn), view(viewIn), nHeight(pindexPrev->nHeight + 1), nBlockMaxSize(nBlockMaxSizeIn),
+        nScriptFlags(GetBlockScriptFlags(pblocktemplateIn->block, pindexPrev)),
+        fPrintPriority(GetBoolArg("-printpriority", false)),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    //! Whether the block has room for nSize more bytes
+    bool HasRoom(uint64_t nSize) const { return nBlockSize + nSize < nBlockMaxSize; }
+
+    //! Check a mempool transaction against the block and the coins so far, and add it if it fits and is valid
+    bool AddTx(CTxMemPool::txiter iter)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
+        const CTransaction& tx = iter->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        // Size limits
+        unsigned int nTxSize = iter->GetTxSize();
+        if (!HasRoom(nTxSize))
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!view.HaveInputs(tx))
+            return false;
+
+        CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        // These are the flags the block is checked with, so the scripts
+        // are run once per transaction and tip, not again for every
+        // template or by TestBlockValidity.
+        CValidationState state;
+        if (!CheckInputs(tx, state, view, true, nScriptFlags, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+
+        // Added
+        pblocktemplate->block.vtx.push_back(tx);
+        pblocktemplate->vTxFees.push_back(nTxFees);
+        pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        inBlock.insert(iter);
+
+        if (fPrintPriority)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                iter->GetPriority(nHeight), CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
         }
+        return true;
     }
 };
 
@@ -140,183 +205,116 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblocktemplate->vTxFees.push_back(-1); // updated at end
         pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
+        CBlockAssembly assembly(pblocktemplate.get(), view, pindexPrev, nBlockMaxSize);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // First the high-priority transactions, up to nBlockPrioritySize, in
+        // order of the priority cached in the mempool. A transaction waits
+        // for its in-mempool parents to be added first.
+        if (nBlockPrioritySize > 0)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
+            vector<TxCoinAgePriority> vecPriority;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+                 mi != mempool.mapTx.end(); ++mi)
+            {
+                double dPriority = mi->GetPriority(nHeight);
+                CAmount dummy = 0;
+                mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+                vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+            }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> mapWaitPriority;
+            TxCoinAgePriorityCompare comparer;
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+            while (!vecPriority.empty())
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().first;
+                CTxMemPool::txiter iter = vecPriority.front().second;
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+
+                // Past the priority size, or out of high-priority transactions
+                if (assembly.nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+                    break;
+
+                bool fWaiting = false;
+                BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
                 {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
+                    if (!assembly.inBlock.count(parent)) {
+                        fWaiting = true;
                         break;
                     }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                }
+                if (fWaiting) {
+                    mapWaitPriority.insert(std::make_pair(iter, dPriority));
                     continue;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+                if (!assembly.AddTx(iter))
+                    continue;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                // Children waiting only on this one can go now
+                BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+                {
+                    map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wit = mapWaitPriority.find(child);
+                    if (wit != mapWaitPriority.end()) {
+                        vecPriority.push_back(TxCoinAgePriority(wit->second, child));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                        mapWaitPriority.erase(wit);
+                    }
+                }
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by fee rate: walk the mempool in order of the fee rate of each
+        // transaction with its ancestors, adding it together with those of its
+        // ancestors not in the block yet. Ancestors already in the block make a
+        // package smaller than its place in the order suggests, so only the
+        // remaining part is checked against the limits.
+        const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+        for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            // Stop when the block is about full
+            if (!assembly.HasRoom(100))
+                break;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+            if (assembly.inBlock.count(iter))
                 continue;
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+            CTxMemPool::setEntries setAncestors;
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            vector<CTxMemPool::txiter> vPackage(1, iter);
+            uint64_t nPackageSize = iter->GetTxSize();
+            CAmount nPackageFees = iter->GetModifiedFee();
+            BOOST_FOREACH(CTxMemPool::txiter ancestorIt, setAncestors)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                if (assembly.inBlock.count(ancestorIt))
+                    continue;
+                vPackage.push_back(ancestorIt);
+                nPackageSize += ancestorIt->GetTxSize();
+                nPackageFees += ancestorIt->GetModifiedFee();
             }
 
-            if (!view.HaveInputs(tx))
+            if (!assembly.HasRoom(nPackageSize))
                 continue;
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            // Skip free transactions if we're past the minimum block size:
+            if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && assembly.nBlockSize + nPackageSize >= nBlockMinSize)
                 continue;
 
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+            // Descendants of a transaction that is left out fail on their inputs
+            BOOST_FOREACH(CTxMemPool::txiter packageIt, vPackage)
+                assembly.AddTx(packageIt);
         }
+        nFees = assembly.nFees;
+        uint64_t nBlockTx = assembly.nBlockTx;
+        uint64_t nBlockSize = assembly.nBlockSize;
 
         // MasterX and general evolution payments
         FillBlockPayee(txNew, nFees);
@@ -369,6 +367,29 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+boost::shared_ptr<CBlockTemplate> CBlockTemplateCache::Get(const CScript& scriptPubKeyIn, int64_t nMaxAge)
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindexPrev = chainActive.Tip();
+    unsigned int nTransactionsUpdatedNow = mempool.GetTransactionsUpdated();
+    if (ptemplate && scriptPubKey == scriptPubKeyIn && hashPrevBlock == pindexPrev->GetBlockHash() &&
+        (nTransactionsUpdated == nTransactionsUpdatedNow || GetTime() - nTimeCreated <= nMaxAge))
+        return ptemplate;
+
+    // Drop the old one first, so a failure below does not leave it to be served
+    ptemplate.reset();
+    boost::shared_ptr<CBlockTemplate> pnew(CreateNewBlock(scriptPubKeyIn));
+    if (!pnew)
+        return ptemplate;
+
+    ptemplate = pnew;
+    scriptPubKey = scriptPubKeyIn;
+    hashPrevBlock = pindexPrev->GetBlockHash();
+    nTransactionsUpdated = nTransactionsUpdatedNow;
+    nTimeCreated = GetTime();
+    return ptemplate;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -377,41 +398,39 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
-// ***TODO*** ScanHash is not yet used in Redux
-//
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// The nonce is usually preserved between calls, but periodically or if the
-// nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
-// zero.
-//
-//bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
-//{
-//    // Write the first 76 bytes of the block header to a double-SHA256 state.
-//    CHash256 hasher;
-//    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-//    ss << *pblock;
-//    assert(ss.size() == 80);
-//    hasher.Write((unsigned char*)&ss[0], 76);
-
-//    while (true) {
-//        nNonce++;
-
-//        // Write the last 4 bytes of the block header (the nonce) to a copy of
-//        // the double-SHA256 state, and compute the result.
-//        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
-
-//        // Return the nonce if the hash has at least some zero bits,
-//        // caller will check if it has enough to reach the target
-//        if (((uint16_t*)phash)[15] == 0)
-//            return true;
-
-//        // If nothing found after trying for a while, return -1
-//        if ((nNonce & 0xffff) == 0)
-//            return false;
-//        if ((nNonce & 0xfff) == 0)
-//            boost::this_thread::interruption_point();
-//    }
-//}
+namespace {
+
+//! Hashes per second of each miner thread, as last metered; guarded by cs_hashmeter
+CCriticalSection cs_hashmeter;
+std::vector<double> vThreadHashesPerSec;
+
+//! Record the rate thread nThread measured; dHashesPerSec is the total
+void UpdateHashMeter(int nThread, double dThreadHashesPerSec)
+{
+    LOCK(cs_hashmeter);
+    if ((size_t)nThread >= vThreadHashesPerSec.size())
+        vThreadHashesPerSec.resize(nThread + 1, 0.0);
+    vThreadHashesPerSec[nThread] = dThreadHashesPerSec;
+    dHashesPerSec = 0.0;
+    BOOST_FOREACH(double d, vThreadHashesPerSec)
+        dHashesPerSec += d;
+    nHPSTimerStart = GetTimeMillis();
+
+    static int64_t nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+    }
+}
+
+}
+
+std::vector<double> GetMinerThreadHashRates()
+{
+    LOCK(cs_hashmeter);
+    return vThreadHashesPerSec;
+}
 
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 {
@@ -452,16 +471,114 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-// ***TODO*** that part changed in bitcoin, we are using a mix with old one here for now
-void static BitcoinMiner(CWallet *pwallet)
+namespace {
+
+/**
+ * The block all miner threads work on. Each generation of it (template,
+ * extra nonce and time) has its nonce space split into one range per
+ * thread, so the threads share a template instead of each building its
+ * own. A thread that is through its range, or finds the block out of
+ * date, moves everyone on to the next generation.
+ */
+class CMinerWork
+{
+private:
+    CCriticalSection cs;
+    CWallet& wallet;
+    CReserveKey reservekey;
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nExtraNonce;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nTemplateTime;
+    int64_t nGenerationTime;
+    unsigned int nGeneration;
+
+    //! Whether the current generation should no longer be worked on; requires cs
+    bool IsOutdated() const
+    {
+        return !pblocktemplate || pindexPrev != chainActive.Tip() ||
+            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nTemplateTime > 60) ||
+            GetTime() - nGenerationTime >= 5;
+    }
+
+public:
+    const int nThreads;
+
+    CMinerWork(CWallet* pwallet, int nThreadsIn) : wallet(*pwallet), reservekey(pwallet), pindexPrev(NULL),
+        nExtraNonce(0), nTransactionsUpdatedLast(0), nTemplateTime(0), nGenerationTime(0), nGeneration(0),
+        nThreads(nThreadsIn) {}
+
+    /**
+     * Get the header to search. nGenerationInOut is the generation the
+     * caller worked on last; if that is still the current one the caller is
+     * done with it, and the next one is made. Returns false if no block
+     * template can be made.
+     */
+    bool GetWork(CBlockHeader& header, unsigned int& nGenerationInOut)
+    {
+        LOCK(cs);
+        if (!pblocktemplate || nGenerationInOut == nGeneration) {
+            if (!pblocktemplate || pindexPrev != chainActive.Tip() ||
+                (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nTemplateTime > 60)) {
+                nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+                pindexPrev = chainActive.Tip();
+                pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
+                if (!pblocktemplate)
+                    return false;
+                nTemplateTime = GetTime();
+                LogPrintf("Running ReduxMiner with %u transactions in block (%u bytes)\n", pblocktemplate->block.vtx.size(),
+                    ::GetSerializeSize(pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+            }
+            CBlock* pblock = &pblocktemplate->block;
+            UpdateTime(pblock, pindexPrev);
+            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            nGenerationTime = GetTime();
+            nGeneration++;
+        }
+        header = pblocktemplate->block.GetBlockHeader();
+        nGenerationInOut = nGeneration;
+        return true;
+    }
+
+    //! Whether the caller should stop searching generation nGenerationIn and ask for new work
+    bool IsStale(unsigned int nGenerationIn)
+    {
+        LOCK(cs);
+        return nGenerationIn != nGeneration || IsOutdated();
+    }
+
+    //! Submit the block of generation nGenerationIn with nonce nNonce
+    bool Found(unsigned int nGenerationIn, uint32_t nNonce)
+    {
+        LOCK(cs);
+        if (nGenerationIn != nGeneration || !pblocktemplate)
+            return false;
+        CBlock* pblock = &pblocktemplate->block;
+        pblock->nNonce = nNonce;
+        bool fAccepted = ProcessBlockFound(pblock, wallet, reservekey);
+        // Everyone moves on to a new template
+        pblocktemplate.reset();
+        nGeneration++;
+        return fAccepted;
+    }
+};
+
+}
+
+void static BitcoinMiner(boost::shared_ptr<CMinerWork> work, int nThread)
 {
-    LogPrintf("ReduxMiner started\n");
+    LogPrintf("ReduxMiner thread %d started\n", nThread);
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("redux-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    // This thread's share of the nonces of every generation
+    const uint64_t nNonceBegin = ((uint64_t)nThread << 32) / work->nThreads;
+    const uint64_t nNonceEnd = ((uint64_t)(nThread + 1) << 32) / work->nThreads;
+    unsigned int nGeneration = 0;
+    uint256 hashes[X11_BATCH_LANES];
+    int64_t nMeterStart = GetTimeMillis();
+    uint64_t nHashesMetered = 0;
 
     try {
         while (true) {
@@ -480,108 +597,69 @@ void static BitcoinMiner(CWallet *pwallet)
                 } while (true);
             }
 
-            //
-            // Create new block
-            //
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-            if(!pindexPrev) break;
-
-            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-            if (!pblocktemplate.get())
+            CBlockHeader header;
+            if (!work->GetWork(header, nGeneration))
             {
                 LogPrintf("Error in ReduxMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-            LogPrintf("Running ReduxMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
             //
             // Search
             //
-            int64_t nStart = GetTime();
-            uint256 hashTarget = uint256().SetCompact(pblock->nBits);
-            while (true)
+            uint256 hashTarget = uint256().SetCompact(header.nBits);
+            CX11HeaderHasher hasher((const unsigned char*)BEGIN(header.nVersion));
+            uint64_t nNonce = nNonceBegin;
+            bool fFound = false;
+            while (nNonce < nNonceEnd && !fFound)
             {
-                unsigned int nHashesDone = 0;
-
-                uint256 hash;
-                while (true)
-                {
-                    hash = pblock->GetHash();
-                    if (hash <= hashTarget)
-                    {
-                        // Found a solution
-                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                        LogPrintf("BitcoinMiner:\n");
-                        LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, *pwallet, reservekey);
-                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
-
-                        // In regression test mode, stop mining after a block is found. This
-                        // allows developers to controllably generate a block on demand.
-                        if (Params().MineBlocksOnDemand())
-                            throw boost::thread_interrupted();
-
-                        break;
-                    }
-                    pblock->nNonce += 1;
-                    nHashesDone += 1;
-                    if ((pblock->nNonce & 0xFF) == 0)
-                        break;
-                }
-
-                // Meter hashes/sec
-                static int64_t nHashCounter;
-                if (nHPSTimerStart == 0)
+                // Hash a few thousand nonces between checks for new work
+                const uint64_t nChunkEnd = std::min(nNonceEnd, nNonce + 0x1000);
+                while (nNonce < nChunkEnd && !fFound)
                 {
-                    nHPSTimerStart = GetTimeMillis();
-                    nHashCounter = 0;
-                }
-                else
-                    nHashCounter += nHashesDone;
-                if (GetTimeMillis() - nHPSTimerStart > 4000)
-                {
-                    static CCriticalSection cs;
+                    const size_t nCount = std::min((uint64_t)X11_BATCH_LANES, nChunkEnd - nNonce);
+                    hasher.Hash((uint32_t)nNonce, nCount, hashes);
+                    nHashesMetered += nCount;
+                    for (size_t i = 0; i < nCount; i++)
                     {
-                        LOCK(cs);
-                        if (GetTimeMillis() - nHPSTimerStart > 4000)
+                        if (hashes[i] <= hashTarget)
                         {
-                            dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                            nHPSTimerStart = GetTimeMillis();
-                            nHashCounter = 0;
-                            static int64_t nLogTime;
-                            if (GetTime() - nLogTime > 30 * 60)
-                            {
-                                nLogTime = GetTime();
-                                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                            }
+                            // Found a solution
+                            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                            LogPrintf("ReduxMiner:\n");
+                            LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hashes[i].GetHex(), hashTarget.GetHex());
+                            work->Found(nGeneration, (uint32_t)(nNonce + i));
+                            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+                            // In regression test mode, stop mining after a block is found. This
+                            // allows developers to controllably generate a block on demand.
+                            if (Params().MineBlocksOnDemand())
+                                throw boost::thread_interrupted();
+
+                            fFound = true;
+                            break;
                         }
                     }
+                    nNonce += nCount;
                 }
 
                 // Check for stop or if block needs to be rebuilt
                 boost::this_thread::interruption_point();
+
+                // Meter hashes/sec
+                int64_t nNow = GetTimeMillis();
+                if (nNow - nMeterStart > 4000)
+                {
+                    UpdateHashMeter(nThread, 1000.0 * nHashesMetered / (nNow - nMeterStart));
+                    nMeterStart = nNow;
+                    nHashesMetered = 0;
+                }
+
                 // Regtest mode doesn't require peers
                 if (vNodes.empty() && Params().MiningRequiresPeers())
                     break;
-                if (pblock->nNonce >= 0xffff0000)
+                if (work->IsStale(nGeneration))
                     break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (pindexPrev != chainActive.Tip())
-                    break;
-
-                // Update nTime every few seconds
-                UpdateTime(pblock, pindexPrev);
-                if (Params().AllowMinDifficultyBlocks())
-                {
-                    // Changing pblock->nTime can change work required on testnet:
-                    hashTarget.SetCompact(pblock->nBits);
-                }
             }
         }
     }
@@ -592,7 +670,7 @@ void static BitcoinMiner(CWallet *pwallet)
     }
     catch (const std::runtime_error &e)
     {
-        LogPrintf("BitcoinMiner runtime error: %s\n", e.what());
+        LogPrintf("ReduxMiner runtime error: %s\n", e.what());
         return;
     }
 }
@@ -616,12 +694,20 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         minerThreads = NULL;
     }
 
+    {
+        LOCK(cs_hashmeter);
+        vThreadHashesPerSec.assign(fGenerate ? std::max(nThreads, 0) : 0, 0.0);
+        dHashesPerSec = 0.0;
+    }
+
     if (nThreads == 0 || !fGenerate)
         return;
 
+    // Shared by the threads, and freed when the last one exits
+    boost::shared_ptr<CMinerWork> work(new CMinerWork(pwallet, nThreads));
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, work, i));
 }
 
 #endif // ENABLE_WALLET
@@ -6,13 +6,18 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "script/script.h"
+#include "uint256.h"
+
 #include <stdint.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
 
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
 class CReserveKey;
-class CScript;
 class CWallet;
 
 struct CBlockTemplate;
@@ -27,7 +32,40 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 /** Check mined block */
 void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
 
+/**
+ * The last block template made for getblocktemplate, keyed by the chain tip
+ * and the mempool sequence (CTxMemPool::GetTransactionsUpdated()) it was
+ * made from. Callers polling faster than either changes are served the same
+ * template instead of a rebuild under cs_main.
+ */
+class CBlockTemplateCache
+{
+private:
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CScript scriptPubKey;
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeCreated;
+
+public:
+    CBlockTemplateCache() : nTransactionsUpdated(0), nTimeCreated(0) {}
+
+    /**
+     * Return a template paying to scriptPubKeyIn on top of the current tip.
+     * A new one is made when the tip has changed, or when the mempool has
+     * changed and the cached template is more than nMaxAge seconds old.
+     * Requires cs_main; returns an empty pointer if no template can be made.
+     */
+    boost::shared_ptr<CBlockTemplate> Get(const CScript& scriptPubKeyIn, int64_t nMaxAge);
+
+    //! The mempool sequence the current template was made from
+    unsigned int GetTransactionsUpdated() const { return nTransactionsUpdated; }
+};
+
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
 
+/** Hashes per second of each internal miner thread, as last measured */
+std::vector<double> GetMinerThreadHashRates();
+
 #endif // BITCOIN_MINER_H
@@ -14,6 +14,7 @@
 #include "chainparams.h"
 #include "clientversion.h"
 #include "primitives/transaction.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 #include "stealthx.h"
 #include "wallet.h"
@@ -32,6 +33,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -79,8 +81,11 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+//! Readiness of the listening and peer sockets, for ThreadSocketHandler
+static CSocketEvents* psocketEvents = NULL;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = 1;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
@@ -102,8 +107,25 @@ CCriticalSection cs_vAddedNodes;
 NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
+CCriticalSection cs_serialMessages;
+
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+/** What a message handler thread sleeps on; guarded by csMessageHandlerWake */
+struct CMessageHandlerWake
+{
+    boost::condition_variable cond;
+    //! A message arrived for one of its nodes, or a lock they wait for was released
+    bool fWake;
+    //! One of its nodes waits for a message lock
+    bool fLockWait;
+
+    CMessageHandlerWake() : fWake(false), fLockWait(false) {}
+};
+static boost::mutex csMessageHandlerWake;
+static CMessageHandlerWake vMessageHandlerWake[MAX_MSGHANDLER_THREADS];
+// Times a message lock was released, to catch releases while a thread wasn't asleep yet
+static uint64_t nMessageLockReleases = 0;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -388,6 +410,13 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+/** Have the socket handler look after pnode's socket from now on */
+static void WatchNodeSocket(CNode* pnode)
+{
+    if (psocketEvents && !psocketEvents->Add(pnode->hSocket, pnode))
+        pnode->CloseSocketDisconnect();
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool spySendMaster)
 {
     if (pszDest == NULL) {
@@ -418,12 +447,6 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool spySendMaster
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
-            LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
-            CloseSocket(hSocket);
-            return NULL;
-        }
-
         addrman.Attempt(addrConnect);
 
         // Add node
@@ -434,6 +457,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool spySendMaster
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WatchNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         if(spySendMaster) pnode->fStealthXMaster = true;
@@ -454,13 +478,17 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        if (psocketEvents)
+            psocketEvents->Remove(hSocket);
         CloseSocket(hSocket);
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
-    if (lockRecv)
+    if (lockRecv) {
         vRecvMsg.clear();
+        nRecvQueue = 0;
+    }
 }
 
 void CNode::PushVersion()
@@ -571,9 +599,37 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    stats.nMsgHandler = id % nMessageHandlerThreads;
+    {
+        // Callers hold cs_vNodes, which message handlers take under cs_vRecvMsg
+        TRY_LOCK(cs_vRecvMsg, lockRecv);
+        stats.fRecvStats = lockRecv;
+        stats.nRecvQueue = lockRecv ? nRecvQueue : 0;
+        stats.nRecvBufAllocated = lockRecv ? recvPool.nAllocated : 0;
+        stats.nRecvBufReused = lockRecv ? recvPool.nReused : 0;
+    }
+    {
+        LOCK(cs_commandLatency);
+        X(mapCommandLatency);
+    }
 }
 #undef X
 
+void CNode::RecordCommandLatency(const std::string& strCommand, int64_t nMicros)
+{
+    LOCK(cs_commandLatency);
+    // Commands are whatever the peer sends, so don't let it grow the map without bound
+    map<string, CCommandLatency>::iterator it = mapCommandLatency.find(strCommand);
+    if (it == mapCommandLatency.end()) {
+        if (mapCommandLatency.size() >= MAX_COMMAND_LATENCY_ENTRIES)
+            it = mapCommandLatency.insert(make_pair(string("other"), CCommandLatency())).first;
+        else
+            it = mapCommandLatency.insert(make_pair(strCommand, CCommandLatency())).first;
+    }
+    it->second.Add(nMicros);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -588,10 +644,16 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         // absorb network data
         int handled;
-        if (!msg.in_data)
+        if (!msg.in_data) {
             handled = msg.readHeader(pch, nBytes);
-        else
+            if (msg.in_data && msg.hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH)
+                recvPool.Take(msg.vRecv, msg.hdr.nMessageSize);
+        } else {
+            size_t nCapacity = msg.vRecv.capacity();
             handled = msg.readData(pch, nBytes);
+            if (msg.vRecv.capacity() != nCapacity)
+                recvPool.nAllocated++;
+        }
 
         if (handled < 0)
                 return false;
@@ -604,31 +666,105 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            RecvMsgComplete(msg);
     }
 
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvBuffer(unsigned int nMinSize, unsigned int& nSize)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data)
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < nMinSize)
+        return NULL;
+
+    size_t nCapacity = msg.vRecv.capacity();
+    char* pch = msg.GetDataBuffer(nMinSize, nSize);
+    if (msg.vRecv.capacity() != nCapacity)
+        recvPool.nAllocated++;
+    return pch;
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedMsgData(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    assert(msg.in_data && msg.nDataPos + nBytes <= msg.hdr.nMessageSize);
+    msg.nDataPos += nBytes;
+    msg.vRecv.resize(msg.nDataPos);
+    if (msg.complete())
+        RecvMsgComplete(msg);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecvMsgComplete(CNetMessage& msg)
+{
+    msg.nTime = GetTimeMicros();
+    nRecvQueue++;
+    // Only the thread handling this node can take the message
+    WakeMessageHandler(id);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::PopRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; it++) {
+        recvPool.Give(it->vRecv);
+        nRecvQueue--;
+    }
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+}
+
+void CRecvBufferPool::Take(CDataStream& stream, unsigned int nSize)
+{
+    if (nSize == 0)
+        return;
+    std::vector<CSerializeData>::iterator itBest = vFree.end();
+    for (std::vector<CSerializeData>::iterator it = vFree.begin(); it != vFree.end(); it++)
+        if (it->capacity() >= nSize && (itBest == vFree.end() || it->capacity() < itBest->capacity()))
+            itBest = it;
+    if (itBest == vFree.end())
+        return;
+
+    nFreeSize -= itBest->capacity();
+    stream.swap(*itBest);
+    vFree.erase(itBest);
+    nReused++;
+}
+
+void CRecvBufferPool::Give(CDataStream& stream)
+{
+    size_t nCapacity = stream.capacity();
+    if (nCapacity == 0 || vFree.size() >= MAX_RECV_POOL_BUFFERS || nFreeSize + nCapacity > MAX_RECV_POOL_SIZE)
+        return;
+
+    vFree.push_back(CSerializeData());
+    stream.swap(vFree.back());
+    // Kept at its capacity, but not its contents: it grows again as data arrives
+    vFree.back().clear();
+    nFreeSize += nCapacity;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = sizeof(pchHdrBuf) - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdrBuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < sizeof(pchHdrBuf))
         return nCopy;
 
-    // deserialize to CMessageHeader
+    // deserialize to CMessageHeader, straight from the fixed buffer
     try {
-        hdrbuf >> hdr;
+        CMemoryReader(pchHdrBuf, pchHdrBuf + sizeof(pchHdrBuf), vRecv.nType, vRecv.nVersion) >> hdr;
     }
     catch (const std::exception &) {
         return -1;
@@ -644,22 +780,43 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+void CNetMessage::Reserve(unsigned int nBytes)
+{
+    unsigned int nNeeded = nDataPos + nBytes;
+    if (vRecv.capacity() >= nNeeded)
+        return;
+
+    // Reserve room for the whole message at once, unless it's only a
+    // little: then only once RECV_PREALLOC_SIZE of it has arrived, so a
+    // peer cannot make us allocate much by sending headers alone.
+    unsigned int nSize = hdr.nMessageSize;
+    if (nNeeded <= RECV_PREALLOC_SIZE)
+        nSize = std::min(nSize, RECV_PREALLOC_SIZE);
+    vRecv.reserve(nSize);
+}
+
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
-
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Drop any room GetDataBuffer left that nothing was received into
+    vRecv.resize(nDataPos);
+    Reserve(nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int nBytes, unsigned int& nSize)
+{
+    nSize = std::min(hdr.nMessageSize - nDataPos, nBytes);
+    Reserve(nSize);
+    vRecv.resize(nDataPos + nSize);
+    return &vRecv[nDataPos];
+}
+
 
 
 
@@ -708,15 +865,228 @@ void SocketSendData(CNode *pnode)
     if (it == pnode->vSendMsg.end()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
+    } else if (psocketEvents && pnode->hSocket != INVALID_SOCKET) {
+        // the socket handler sends the rest once the socket drains
+        psocketEvents->Rearm(pnode->hSocket, CSocketEvents::EVENT_SEND);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+/** Accept the connections waiting on a listening socket, until there are no more */
+static void AcceptConnections(const ListenSocket& hListenSocket)
+{
+    while (true)
+    {
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+        CAddress addr;
+        int nInbound = 0;
+
+        if (hSocket == INVALID_SOCKET)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEINTR)
+                continue;
+            if (nErr != WSAEWOULDBLOCK)
+                LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+            psocketEvents->Rearm(hListenSocket.socket, CSocketEvents::EVENT_RECV);
+            return;
+        }
+
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+        bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->fInbound)
+                    nInbound++;
+        }
+
+        if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+        {
+            LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+            CloseSocket(hSocket);
+        }
+        else if (CNode::IsBanned(addr) && !whitelisted)
+        {
+            LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+            CloseSocket(hSocket);
+        }
+        else
+        {
+            CNode* pnode = new CNode(hSocket, addr, "", true);
+            pnode->AddRef();
+            pnode->fWhitelisted = whitelisted;
+
+            {
+                LOCK(cs_vNodes);
+                vNodes.push_back(pnode);
+            }
+            WatchNodeSocket(pnode);
+        }
+    }
+}
+
+/**
+ * Send and receive on pnode's socket as far as its reported readiness goes.
+ * Returns whether readiness is left over for a later round. fRetry is set if
+ * that round can come straight away, because a lock was busy or the node had
+ * its fair share of this one, rather than having to wait for the message
+ * handler to make room or for the socket to drain.
+ */
+static bool ServiceNodeSocket(CNode* pnode, bool& fRetry)
+{
+    // Reads of up to 64 KiB each per node and round
+    static const int MAX_RECV_PER_ROUND = 8;
+
+    if (pnode->hSocket != INVALID_SOCKET)
+    {
+        //
+        // Send
+        //
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            fRetry |= pnode->fSendReady;
+        else
+        {
+            if (pnode->fSendReady)
+            {
+                // SocketSendData asks to hear about the socket again if it cannot send everything
+                pnode->fSendReady = false;
+                if (!pnode->vSendMsg.empty())
+                    SocketSendData(pnode);
+            }
+            // While there is data waiting to be sent, drain the write buffer
+            // before receiving more. This avoids needlessly queueing received
+            // data if the remote peer is not themselves receiving data, and
+            // leaves the rest to TCP flow control.
+            if (!pnode->vSendMsg.empty())
+                return pnode->fRecvReady && pnode->hSocket != INVALID_SOCKET;
+        }
+    }
+
+    //
+    // Receive
+    //
+    if (pnode->hSocket != INVALID_SOCKET && pnode->fRecvReady)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+        {
+            fRetry = true;
+            return true;
+        }
+        for (int nRecv = 0; pnode->hSocket != INVALID_SOCKET; nRecv++)
+        {
+            // With a complete message waiting and the receive buffer full,
+            // leave the rest in the socket until the message handler has
+            // caught up. The message handler thread can always make progress.
+            if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                pnode->GetTotalRecvSize() > ReceiveFloodSize())
+                return true;
+            if (nRecv == MAX_RECV_PER_ROUND)
+            {
+                fRetry = true;
+                return true;
+            }
+
+            // typical socket buffer is 8K-64K
+            char pchBuf[0x10000];
+            // The rest of a message too big to share pchBuf with the next
+            // one is received straight into its own buffer
+            unsigned int nRoom = 0;
+            char* pchRoom = pnode->GetRecvBuffer(sizeof(pchBuf), nRoom);
+            int nBytes = pchRoom ? recv(pnode->hSocket, pchRoom, nRoom, MSG_DONTWAIT)
+                                 : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes > 0)
+            {
+                if (pchRoom)
+                    pnode->ReceivedMsgData(nBytes);
+                else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                    pnode->CloseSocketDisconnect();
+                pnode->nLastRecv = GetTime();
+                pnode->nRecvBytes += nBytes;
+                pnode->RecordBytesRecv(nBytes);
+            }
+            else if (nBytes == 0)
+            {
+                // socket closed gracefully
+                if (!pnode->fDisconnect)
+                    LogPrint("net", "socket closed\n");
+                pnode->CloseSocketDisconnect();
+            }
+            else
+            {
+                int nErr = WSAGetLastError();
+                if (nErr == WSAEINTR)
+                    continue;
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+                {
+                    // error
+                    if (!pnode->fDisconnect)
+                        LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                    pnode->CloseSocketDisconnect();
+                }
+                else
+                {
+                    // nothing left to read until we are told otherwise
+                    pnode->fRecvReady = false;
+                    psocketEvents->Rearm(pnode->hSocket, CSocketEvents::EVENT_RECV);
+                    return pnode->fSendReady;
+                }
+            }
+        }
+    }
+
+    if (pnode->hSocket == INVALID_SOCKET)
+    {
+        pnode->fRecvReady = false;
+        pnode->fSendReady = false;
+    }
+    return pnode->fRecvReady || pnode->fSendReady;
+}
+
+/** Disconnect pnode if it has gone quiet for too long */
+static void InactivityCheck(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    // Nodes with readiness left over from an earlier round
+    set<CNode*> setPending;
+    vector<CSocketEvents::Event> vEvents;
+    bool fRetry = false;
+    int64_t nLastInactivityCheck = 0;
     while (true)
     {
         //
@@ -772,6 +1142,7 @@ void ThreadSocketHandler()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        setPending.erase(pnode);
                         delete pnode;
                     }
                 }
@@ -783,249 +1154,62 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready. Readiness left over because a
+        // lock was busy is picked up again after a short wait; otherwise only
+        // new readiness, or the odd check on nodes whose receive buffer is
+        // full, wakes us.
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        if (!psocketEvents->Wait(fRetry ? 1 : 50, vEvents))
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            LogPrintf("socket wait error %s\n", NetworkErrorString(WSAGetLastError()));
+            MilliSleep(50);
         }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        BOOST_FOREACH(const CSocketEvents::Event& event, vEvents)
         {
-            if (have_fds)
+            if (event.pdata == NULL)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                //
+                // Accept new connections
+                //
+                BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                    if (hListenSocket.socket == event.hSocket)
+                        AcceptConnections(hListenSocket);
+                continue;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            CNode* pnode = (CNode*)event.pdata;
+            if (event.nEvents & CSocketEvents::EVENT_RECV)
+                pnode->fRecvReady = true;
+            if (event.nEvents & CSocketEvents::EVENT_SEND)
+                pnode->fSendReady = true;
+            setPending.insert(pnode);
         }
 
         //
-        // Accept new connections
+        // Service each socket that is ready
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        fRetry = false;
+        for (set<CNode*>::iterator it = setPending.begin(); it != setPending.end(); )
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (!IsSelectableSocket(hSocket))
-                {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            boost::this_thread::interruption_point();
+            if (ServiceNodeSocket(*it, fRetry))
+                it++;
+            else
+                setPending.erase(it++);
         }
 
         //
-        // Service each socket
+        // Inactivity checking
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
-
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck)
         {
+            nLastInactivityCheck = nTime;
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    InactivityCheck(pnode, nTime);
         }
     }
 }
@@ -1440,20 +1624,55 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void WakeMessageHandler(NodeId id)
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandlerWake);
+    CMessageHandlerWake& wake = vMessageHandlerWake[id % nMessageHandlerThreads];
+    wake.fWake = true;
+    wake.cond.notify_one();
+}
+
+void WakeMessageHandlers()
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandlerWake);
+    nMessageLockReleases++;
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        CMessageHandlerWake& wake = vMessageHandlerWake[i];
+        if (wake.fLockWait) {
+            wake.fLockWait = false;
+            wake.fWake = true;
+            wake.cond.notify_one();
+        }
+    }
+}
+
+/**
+ * One of nWorkers message handler threads. Each takes the nodes whose id is
+ * nWorker modulo nWorkers, so that a node's messages are handled in order,
+ * by one thread, while a slow message holds up only the nodes sharing it.
+ */
+void ThreadMessageHandler(int nWorker, int nWorkers)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-    
+    CMessageHandlerWake& wake = vMessageHandlerWake[nWorker];
+
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
+        uint64_t nLockReleasesStart;
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageHandlerWake);
+            wake.fWake = false;
+            nLockReleasesStart = nMessageLockReleases;
+        }
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nWorkers != nWorker)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1463,6 +1682,7 @@ void ThreadMessageHandler()
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
+        bool fLockWait = false;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
@@ -1477,7 +1697,10 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                    // Nodes waiting for a message lock are woken when it is released
+                    if (pnode->fSerialWait)
+                        fLockWait = true;
+                    else if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1505,7 +1728,16 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageHandlerWake);
+            // Don't sleep if a lock our nodes wait for was released during the pass
+            if (!fLockWait || nMessageLockReleases == nLockReleasesStart) {
+                wake.fLockWait = fLockWait;
+                boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(100);
+                while (!wake.fWake && wake.cond.timed_wait(lock, timeout)) {}
+                wake.fLockWait = false;
+            }
+        }
     }
 }
 
@@ -1536,13 +1768,6 @@ bool BindListenPort(const CService &addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
-    {
-        strError = "Error: Couldn't create a listenable socket for incoming connections";
-        LogPrintf("%s\n", strError);
-        return false;
-    }
-
 
 #ifndef WIN32
 #ifdef SO_NOSIGPIPE
@@ -1683,6 +1908,15 @@ void StartNode(boost::thread_group& threadGroup)
 
     Discover(threadGroup);
 
+    if (psocketEvents == NULL) {
+        CSocketEvents::Backend backend = CSocketEvents::GetDefaultBackend();
+        CSocketEvents::ParseBackend(GetArg("-socketevents", ""), backend);
+        psocketEvents = new CSocketEvents(backend);
+        LogPrintf("Using %s to wait on sockets\n", psocketEvents->GetBackendName());
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            psocketEvents->Add(hListenSocket.socket, NULL);
+    }
+
     //
     // Start threads
     //
@@ -1705,7 +1939,10 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+            boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1753,6 +1990,8 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+        delete psocketEvents;
+        psocketEvents = NULL;
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2029,6 +2268,10 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nPingUsecTime = 0;
     fPingQueued = false;
     fStealthXMaster = false;
+    fRecvReady = false;
+    fSendReady = false;
+    nRecvQueue = 0;
+    fSerialWait = false;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2049,6 +2292,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 
 CNode::~CNode()
 {
+    if (psocketEvents && hSocket != INVALID_SOCKET)
+        psocketEvents->Remove(hSocket);
     CloseSocket(hSocket);
 
     if (pfilter)
@@ -20,6 +20,7 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -48,6 +49,12 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** A message's receive buffer grows to its full size only once this much of it has arrived */
+static const unsigned int RECV_PREALLOC_SIZE = 256 * 1024;
+/** Total size of the receive buffers a peer keeps for reuse: a full block and then some */
+static const size_t MAX_RECV_POOL_SIZE = 1280 * 1024;
+/** The maximum number of receive buffers a peer keeps for reuse */
+static const size_t MAX_RECV_POOL_BUFFERS = 8;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -58,6 +65,12 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -msghandlerthreads default */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** The maximum number of distinct commands whose latency is kept per peer; the rest count as "other" */
+static const size_t MAX_COMMAND_LATENCY_ENTRIES = 32;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -79,6 +92,11 @@ void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/** Wake the message handler thread of node id, e.g. when a message for it arrives */
+void WakeMessageHandler(NodeId id);
+/** Wake the message handler threads whose nodes wait for a message lock, once one is released */
+void WakeMessageHandlers();
+
 // Signals for message handling
 struct CNodeSignals
 {
@@ -126,6 +144,7 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -140,6 +159,14 @@ extern CCriticalSection cs_vAddedNodes;
 extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
+/**
+ * Held by a message handler thread while it handles a message that reads or
+ * writes state not guarded by a lock of its own, so that only one such
+ * message is handled at a time. Messages of each peer are handled by one
+ * thread, in order; see ProcessMessages for those that may skip this lock.
+ */
+extern CCriticalSection cs_serialMessages;
+
 struct LocalServiceInfo {
     int nScore;
     int nPort;
@@ -148,6 +175,23 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Time spent handling one kind of message from a peer */
+struct CCommandLatency
+{
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CCommandLatency() : nCount(0), nTotalMicros(0), nMaxMicros(0) {}
+
+    void Add(int64_t nMicros)
+    {
+        nCount++;
+        nTotalMicros += nMicros;
+        nMaxMicros = std::max(nMaxMicros, nMicros);
+    }
+};
+
 class CNodeStats
 {
 public:
@@ -167,16 +211,49 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    int nMsgHandler;
+    bool fRecvStats; // whether the receive queue and buffer stats below were copied
+    int nRecvQueue;
+    uint64_t nRecvBufAllocated;
+    uint64_t nRecvBufReused;
+    std::map<std::string, CCommandLatency> mapCommandLatency;
 };
 
 
 
 
+/**
+ * Receive buffers of one peer, kept once their messages have been handled so
+ * that later messages are received into them instead of allocating their
+ * own. Guarded by the node's cs_vRecvMsg.
+ */
+class CRecvBufferPool
+{
+private:
+    std::vector<CSerializeData> vFree;
+    size_t nFreeSize; // total capacity of vFree
+
+public:
+    // Receive buffers allocated or grown, and those taken from the pool instead
+    uint64_t nAllocated;
+    uint64_t nReused;
+
+    CRecvBufferPool() : nFreeSize(0), nAllocated(0), nReused(0) {}
+
+    /** Capacity of the buffers kept for reuse */
+    size_t GetFreeSize() const { return nFreeSize; }
+
+    /** Give an empty stream the smallest kept buffer that holds nSize bytes, if any */
+    void Take(CDataStream& stream, unsigned int nSize);
+    /** Keep stream's buffer for reuse if there is room, leaving stream empty */
+    void Give(CDataStream& stream);
+};
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdrBuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -185,8 +262,7 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -202,12 +278,23 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /**
+     * Room in vRecv for the next nBytes of data (or the rest of the message,
+     * if less), to receive into directly. Sets nSize to its length. vRecv
+     * only covers data received otherwise: trim it once nDataPos is
+     * advanced. Requires in_data.
+     */
+    char* GetDataBuffer(unsigned int nBytes, unsigned int& nSize);
+
+private:
+    /** Reserve capacity for the next nBytes of data, without zero filling it */
+    void Reserve(unsigned int nBytes);
 };
 
 
@@ -231,8 +318,15 @@ public:
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    CRecvBufferPool recvPool;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // Complete messages in vRecvMsg; written under cs_vRecvMsg
+    int nRecvQueue;
+    // The head message waits for a message lock (cs_serialMessages or a
+    // concurrent command's) another thread holds; only touched by this
+    // node's message handler thread.
+    bool fSerialWait;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -264,6 +358,10 @@ public:
     // (even if it's relative to mixing e.g. for blinding) should NOT set this to 'true'.
     // For such cases node should be released manually (preferably right after corresponding code).
     bool fStealthXMaster;
+    // Readiness reported for the socket that the socket handler has not yet
+    // acted on; only touched by the socket handler thread.
+    bool fRecvReady;
+    bool fSendReady;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -293,6 +391,8 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    // Guards vAddrToSend and setAddrKnown, which other nodes' threads relay to
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -312,6 +412,10 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Time spent handling each command received from this peer
+    std::map<std::string, CCommandLatency> mapCommandLatency;
+    CCriticalSection cs_commandLatency;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false);
     ~CNode();
 
@@ -325,6 +429,9 @@ private:
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    // requires LOCK(cs_vRecvMsg)
+    void RecvMsgComplete(CNetMessage& msg);
+
 public:
 
     NodeId GetId() const {
@@ -338,17 +445,34 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
+    /** Memory held for received messages: their buffers' capacity, and the pool's */
     unsigned int GetTotalRecvSize()
     {
-        unsigned int total = 0;
+        unsigned int total = recvPool.GetFreeSize();
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
-            total += msg.vRecv.size() + 24;
+            total += msg.vRecv.capacity() + 24;
         return total;
     }
 
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    /**
+     * Where the message being received has at least nMinSize bytes of data
+     * still to come, return room in its buffer to receive them into
+     * directly, and set nSize to its length. NULL otherwise.
+     */
+    char* GetRecvBuffer(unsigned int nMinSize, unsigned int& nSize);
+
+    // requires LOCK(cs_vRecvMsg)
+    /** Account for nBytes received into the room returned by GetRecvBuffer */
+    void ReceivedMsgData(unsigned int nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    /** Drop the handled messages before itEnd, keeping their buffers for reuse */
+    void PopRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -372,6 +496,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -380,6 +505,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -435,6 +561,22 @@ public:
         }
     }
 
+    //! Send a message whose payload is already serialized
+    void PushMessageRaw(const char* pszCommand, const char* pbegin, const char* pend)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend.write(pbegin, pend - pbegin);
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -677,6 +819,7 @@ public:
     static bool IsBanned(CNetAddr ip);
     static bool Ban(const CNetAddr &ip);
     void copyStats(CNodeStats &stats);
+    void RecordCommandLatency(const std::string& strCommand, int64_t nMicros);
 
     static bool IsWhitelistedRange(const CNetAddr &ip);
     static void AddWhitelistedRange(const CSubNet &subnet);
@@ -31,7 +31,8 @@ static const char* ppszTypeName[] =
     "gm quorum",
     "gm announce",
     "gm ping",
-    "dstx"
+    "dstx",
+    "compact block"
 };
 
 CMessageHeader::CMessageHeader()
@@ -159,7 +159,17 @@ enum {
     MSG_MASTERX_QUORUM,
     MSG_MASTERX_ANNOUNCE,
     MSG_MASTERX_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Only for getdata, from COMPACT_BLOCKS_VERSION on: the block as a "cmpctblock"
+    MSG_CMPCT_BLOCK
+};
+
+/** What the signature of a masterx ping, InstantX vote or evolution vote covers */
+enum {
+    //! concatenated ToString() output of the signed fields
+    MESSAGE_VERSION_STRING = 0,
+    //! CHashWriter serialization of the signed fields, see BINARY_SIGNED_MESSAGE_VERSION
+    MESSAGE_VERSION_BINARY = 1
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -2,29 +2,80 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/redux-config.h"
+#endif
+
 #include "pubkey.h"
 
 #include "eccryptoverify.h"
+#include "ecwrapper.h"
 
 #ifdef USE_SECP256K1
 #include <secp256k1.h>
-#else
-#include "ecwrapper.h"
+#endif
+
+#ifdef USE_SECP256K1
+//! anonymous namespace
+namespace {
+
+/**
+ * Build libsecp256k1's verification tables once at startup. They stay alive
+ * for the whole process, so Verify and RecoverCompact never pay for setup.
+ */
+class CSecp256k1VerifyInit {
+public:
+    CSecp256k1VerifyInit() {
+        secp256k1_start(SECP256K1_START_VERIFY);
+    }
+    ~CSecp256k1VerifyInit() {
+        secp256k1_stop();
+    }
+};
+static CSecp256k1VerifyInit instance_of_csecp256k1verify;
+
+/**
+ * libsecp256k1 only parses strict DER. Anything else (still valid in blocks
+ * before BIP66) is left to OpenSSL's lax parser so that verification results
+ * do not depend on the build.
+ */
+bool IsStrictDERSignature(const std::vector<unsigned char>& vchSig) {
+    // Format: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S]
+    if (vchSig.size() < 8 || vchSig.size() > 72) return false;
+    if (vchSig[0] != 0x30) return false;
+    if (vchSig[1] != vchSig.size() - 2) return false;
+    unsigned int lenR = vchSig[3];
+    if (5 + lenR >= vchSig.size()) return false;
+    unsigned int lenS = vchSig[5 + lenR];
+    if (lenR + lenS + 6 != vchSig.size()) return false;
+
+    // R and S must be positive integers without superfluous padding.
+    if (vchSig[2] != 0x02) return false;
+    if (lenR == 0) return false;
+    if (vchSig[4] & 0x80) return false;
+    if (lenR > 1 && (vchSig[4] == 0x00) && !(vchSig[5] & 0x80)) return false;
+    if (vchSig[lenR + 4] != 0x02) return false;
+    if (lenS == 0) return false;
+    if (vchSig[lenR + 6] & 0x80) return false;
+    if (lenS > 1 && (vchSig[lenR + 6] == 0x00) && !(vchSig[lenR + 7] & 0x80)) return false;
+    return true;
+}
+
+} // anon namespace
 #endif
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
 #ifdef USE_SECP256K1
-    if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSig[0], vchSig.size(), begin(), size()) != 1)
-        return false;
-#else
+    if (IsStrictDERSignature(vchSig))
+        return secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSig[0], vchSig.size(), begin(), size()) == 1;
+#endif
     CECKey key;
     if (!key.SetPubKey(begin(), size()))
         return false;
     if (!key.Verify(hash, vchSig))
         return false;
-#endif
     return true;
 }
 
@@ -53,7 +104,7 @@ bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
 #ifdef USE_SECP256K1
-    if (!secp256k1_ecdsa_pubkey_verify(begin(), size()))
+    if (!secp256k1_ec_pubkey_verify(begin(), size()))
         return false;
 #else
     CECKey key;
@@ -68,8 +119,8 @@ bool CPubKey::Decompress() {
         return false;
 #ifdef USE_SECP256K1
     int clen = size();
-    int ret = secp256k1_ecdsa_pubkey_decompress((unsigned char*)begin(), &clen);
-    assert(ret);
+    if (!secp256k1_ec_pubkey_decompress((unsigned char*)begin(), &clen))
+        return false;
     assert(clen == (int)size());
 #else
     CECKey key;
@@ -91,7 +142,7 @@ bool CPubKey::Derive(CPubKey& pubkeyChild, unsigned char ccChild[32], unsigned i
     memcpy(ccChild, out+32, 32);
 #ifdef USE_SECP256K1
     pubkeyChild = *this;
-    bool ret = secp256k1_ecdsa_pubkey_tweak_add((unsigned char*)pubkeyChild.begin(), pubkeyChild.size(), out);
+    bool ret = secp256k1_ec_pubkey_tweak_add((unsigned char*)pubkeyChild.begin(), pubkeyChild.size(), out);
 #else
     CECKey key;
     bool ret = key.SetPubKey(begin(), size());
@@ -62,6 +62,7 @@ Value getinfo(const Array& params, bool fHelp)
             "  \"connections\": xxxxx,       (numeric) the number of connections\n"
             "  \"proxy\": \"host:port\",     (string, optional) the proxy used by the server\n"
             "  \"difficulty\": xxxxxx,       (numeric) the current difficulty\n"
+            "  \"coincachesize\": xxxxxx,    (numeric) the memory used by the in-memory coins cache, in bytes\n"
             "  \"testnet\": true|false,      (boolean) if the server is using testnet or not\n"
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
@@ -94,6 +95,10 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.IsValid() ? proxy.ToStringIPPort() : string())));
     obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    {
+        LOCK(cs_main);
+        obj.push_back(Pair("coincachesize", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    }
     obj.push_back(Pair("testnet",       Params().TestnetToBeDeprecatedFieldRPC()));
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
@@ -145,6 +150,7 @@ Value gmsync(const Array& params, bool fHelp)
 
     if(strMode == "reset")
     {
+        LOCK(masterxSync.cs);
         masterxSync.Reset();
         return "success";
     }
@@ -104,7 +104,18 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"msghandler\": n,           (numeric) The message handler thread serving this peer\n"
+            "    \"recvqueue\": n,            (numeric) Received messages waiting to be handled\n"
+            "    \"recvbufallocs\": n,        (numeric) Receive buffers allocated or grown for this peer's messages\n"
+            "    \"recvbufreuses\": n,        (numeric) Messages received into a buffer kept from an earlier one instead\n"
+            "    \"cmdlatency\": {            (json object) Time spent handling each command from this peer\n"
+            "       \"command\": {\n"
+            "         \"count\": n,            (numeric) Number of messages handled\n"
+            "         \"avgtime\": n,          (numeric) Average time to handle one, in seconds\n"
+            "         \"maxtime\": n           (numeric) Longest time to handle one, in seconds\n"
+            "       }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -153,6 +164,23 @@ Value getpeerinfo(const Array& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("msghandler", stats.nMsgHandler));
+        if (stats.fRecvStats) {
+            obj.push_back(Pair("recvqueue", stats.nRecvQueue));
+            obj.push_back(Pair("recvbufallocs", stats.nRecvBufAllocated));
+            obj.push_back(Pair("recvbufreuses", stats.nRecvBufReused));
+        }
+        Object latency;
+        for (map<string, CCommandLatency>::const_iterator it = stats.mapCommandLatency.begin(); it != stats.mapCommandLatency.end(); it++) {
+            const CCommandLatency& cmd = it->second;
+            Object cmdobj;
+            cmdobj.push_back(Pair("count", cmd.nCount));
+            cmdobj.push_back(Pair("avgtime", cmd.nCount ? ((double)cmd.nTotalMicros / cmd.nCount) / 1e6 : 0.0));
+            cmdobj.push_back(Pair("maxtime", ((double)cmd.nMaxMicros) / 1e6));
+            // Commands come from the peer; sanitize them like subver
+            latency.push_back(Pair(SanitizeString(it->first), cmdobj));
+        }
+        obj.push_back(Pair("cmdlatency", latency));
 
         ret.push_back(obj);
     }
@@ -352,6 +380,46 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "\nReturns, per P2P command, the messages received from all peers, their size and the CPU time spent handling them.\n"
+            "Only commands received at least once are listed; unregistered ones are counted as \"unknown\".\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {\n"
+            "    \"category\": \"xxx\",    (string) What handles the command: core, stealthx, masterx, evolution, instantx or spork\n"
+            "    \"count\": n,           (numeric) Messages handled\n"
+            "    \"bytes\": n,           (numeric) Total payload bytes\n"
+            "    \"cputime\": n,         (numeric) Total handler CPU time, in seconds\n"
+            "    \"avgcputime\": n       (numeric) Average handler CPU time per message, in seconds\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagestats", "")
+            + HelpExampleRpc("getmessagestats", "")
+       );
+
+    map<string, CMessageStats> mapStats = tableP2P.GetStats();
+    Object obj;
+    for (map<string, CMessageStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); it++) {
+        const CMessageStats& stats = it->second;
+        if (stats.nCount == 0)
+            continue;
+        const CMessageHandler* pcmd = tableP2P[it->first];
+        Object cmdobj;
+        cmdobj.push_back(Pair("category", pcmd ? pcmd->category : "unknown"));
+        cmdobj.push_back(Pair("count", stats.nCount));
+        cmdobj.push_back(Pair("bytes", stats.nBytes));
+        cmdobj.push_back(Pair("cputime", ((double)stats.nCPUMicros) / 1e6));
+        cmdobj.push_back(Pair("avgcputime", ((double)stats.nCPUMicros / stats.nCount) / 1e6));
+        obj.push_back(Pair(it->first, cmdobj));
+    }
+    return obj;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
@@ -5,86 +5,130 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "primitives/transaction.h"
 #include "pubkey.h"
 #include "random.h"
-#include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
 
 namespace {
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+CSignatureCache signatureCache;
+CSignatureCache scriptExecutionCache;
+
+}
+
+CSignatureCache::CSignatureCache() : nKick(0)
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+}
+
+size_t CSignatureCache::GetSlot(const uint256& entry, int nWay) const
+{
+    // map one 32 bit word of the (salted) entry onto the table
+    return ((uint64_t)ReadLE32(entry.begin() + 4 * nWay) * vTable.size()) >> 32;
+}
+
+void CSignatureCache::Resize(size_t nBytes)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    // salted here rather than in the constructor, which runs before the RNG is set up
+    GetRandBytes(nonce.begin(), 32);
+    std::vector<uint256>(nBytes / sizeof(uint256)).swap(vTable);
+}
+
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256 hasher;
+    hasher.Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size());
+    if (!vchSig.empty())
+        hasher.Write(&vchSig[0], vchSig.size());
+    hasher.Finalize(entry.begin());
+}
+
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256& txid, unsigned int flags) const
+{
+    unsigned char vchFlags[4];
+    WriteLE32(vchFlags, flags);
+    CSHA256().Write(nonce.begin(), 32).Write(txid.begin(), 32).Write(vchFlags, 4).Finalize(entry.begin());
+}
+
+bool CSignatureCache::Get(const uint256& entry) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    if (vTable.empty())
         return false;
+
+    for (int i = 0; i < WAYS; i++) {
+        if (vTable[GetSlot(entry, i)] == entry)
+            return true;
     }
+    return false;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+void CSignatureCache::Set(const uint256& entry)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    if (vTable.empty())
+        return;
+
+    uint256 item = entry;
+    for (int nKicks = 0; nKicks <= MAX_KICKS; nKicks++) {
+        for (int i = 0; i < WAYS; i++) {
+            uint256& slot = vTable[GetSlot(item, i)];
+            if (slot == item)
+                return;
+            if (!slot) {
+                slot = item;
+                return;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // All slots taken: swap with one of the occupants and find that one
+        // a new home. Rotating the way breaks up cycles between two entries.
+        std::swap(item, vTable[GetSlot(item, nKick++ % WAYS)]);
     }
-};
+    // item is dropped
+}
 
+void InitSignatureCache()
+{
+    int64_t nMaxCacheSize = std::max((int64_t)0, std::min(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), MAX_MAX_SIG_CACHE_SIZE));
+    signatureCache.Resize(nMaxCacheSize << 20);
+    LogPrintf("Using %d MiB for the signature cache (%u entries)\n", nMaxCacheSize, signatureCache.GetCapacity());
+
+    nMaxCacheSize = std::max((int64_t)0, std::min(GetArg("-maxscriptcachesize", DEFAULT_MAX_SCRIPT_CACHE_SIZE), MAX_MAX_SIG_CACHE_SIZE));
+    scriptExecutionCache.Resize(nMaxCacheSize << 20);
+    LogPrintf("Using %d MiB for the script execution cache (%u entries)\n", nMaxCacheSize, scriptExecutionCache.GetCapacity());
+}
+
+bool GetScriptExecutionCache(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    scriptExecutionCache.ComputeEntry(entry, tx.GetHash(), flags);
+    return scriptExecutionCache.Get(entry);
+}
+
+void SetScriptExecutionCache(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    scriptExecutionCache.ComputeEntry(entry, tx.GetHash(), flags);
+    scriptExecutionCache.Set(entry);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    if (signatureCache.Get(entry))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
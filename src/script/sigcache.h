@@ -7,10 +7,82 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
 class CPubKey;
+class CTransaction;
+
+//! Default for -maxsigcachesize, in MiB
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+//! Upper bound for -maxsigcachesize, in MiB
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+//! Default for -maxscriptcachesize, in MiB
+static const int64_t DEFAULT_MAX_SCRIPT_CACHE_SIZE = 8;
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ *
+ * Entries are salted SHA256 hashes of (signature hash, public key, signature)
+ * kept in a table of fixed size. Each entry may live in one of WAYS slots
+ * picked by its own bytes; an insert into a full set of slots moves the
+ * occupant to one of its other slots, cuckoo-style, and drops whatever is
+ * left after MAX_KICKS moves. The salt keeps slot positions unpredictable to
+ * anyone trying to flush specific entries.
+ *
+ * Lookups share the lock, so they run concurrently with each other but
+ * never with an insert, which moves whole slots around.
+ */
+class CSignatureCache
+{
+public:
+    //! Candidate slots per entry
+    static const int WAYS = 8;
+    //! Displacements before an insert gives up and drops an entry
+    static const int MAX_KICKS = 32;
+
+private:
+    uint256 nonce;
+    std::vector<uint256> vTable;
+    //! shared by lookups, exclusive for inserts and Resize
+    mutable boost::shared_mutex cs_sigcache;
+    unsigned int nKick;
+
+    size_t GetSlot(const uint256& entry, int nWay) const;
+
+public:
+    CSignatureCache();
+
+    //! Drop all entries, pick a new salt and use nBytes of memory; must not run concurrently with ComputeEntry
+    void Resize(size_t nBytes);
+    //! Number of slots in the table
+    size_t GetCapacity() const { return vTable.size(); }
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+    //! Entry for a transaction whose input scripts were all checked under flags
+    void ComputeEntry(uint256& entry, const uint256& txid, unsigned int flags) const;
+    bool Get(const uint256& entry) const;
+    void Set(const uint256& entry);
+};
+
+/** Size the signature and script execution caches according to -maxsigcachesize and -maxscriptcachesize */
+void InitSignatureCache();
+
+/**
+ * Script execution cache: transactions all of whose input scripts were found
+ * valid under a given set of verification flags. A txid commits to the outputs
+ * it spends, so such a transaction need not have its scripts run again under
+ * the same flags, e.g. when a block template that holds it is rebuilt or
+ * checked, or when it is mined.
+ */
+bool GetScriptExecutionCache(const CTransaction& tx, unsigned int flags);
+void SetScriptExecutionCache(const CTransaction& tx, unsigned int flags);
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
@@ -0,0 +1,268 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/redux-config.h"
+#endif
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifndef WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+//! Most events taken from the kernel per epoll_wait; the rest wait for the next call
+static const int MAX_EPOLL_EVENTS = 256;
+
+CSocketEvents::CSocketEvents(Backend backendIn) : backend(BACKEND_POLL), hEpoll(-1)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (backendIn == BACKEND_EPOLL) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll >= 0)
+            backend = BACKEND_EPOLL;
+        else
+            LogPrintf("CSocketEvents: epoll_create1 failed: %s, using poll\n", NetworkErrorString(errno));
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll >= 0)
+        close(hEpoll);
+#endif
+    for (map<SOCKET, Watch*>::iterator it = mapWatch.begin(); it != mapWatch.end(); it++)
+        delete it->second;
+    BOOST_FOREACH(Watch* pwatch, vRemoved)
+        delete pwatch;
+}
+
+CSocketEvents::Backend CSocketEvents::GetDefaultBackend()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return BACKEND_EPOLL;
+#else
+    return BACKEND_POLL;
+#endif
+}
+
+bool CSocketEvents::ParseBackend(const std::string& strName, Backend& backendOut)
+{
+    if (strName == "epoll")
+        backendOut = BACKEND_EPOLL;
+    else if (strName == "poll")
+        backendOut = BACKEND_POLL;
+    else
+        return false;
+    return true;
+}
+
+std::string CSocketEvents::GetBackendName() const
+{
+    return backend == BACKEND_EPOLL ? "epoll" : "poll";
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* pdata)
+{
+    Watch* pwatch = new Watch();
+    pwatch->hSocket = hSocket;
+    pwatch->pdata = pdata;
+    pwatch->nArmed = EVENT_RECV | EVENT_SEND;
+    pwatch->fRemoved = false;
+
+    boost::mutex::scoped_lock lock(cs);
+    // A socket closed without Remove leaves its number behind for the next one
+    map<SOCKET, Watch*>::iterator it = mapWatch.find(hSocket);
+    if (it != mapWatch.end()) {
+        it->second->fRemoved = true;
+        vRemoved.push_back(it->second);
+        mapWatch.erase(it);
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (backend == BACKEND_EPOLL) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = pwatch;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0 &&
+            (errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &event) != 0)) {
+            LogPrintf("CSocketEvents: epoll_ctl failed: %s\n", NetworkErrorString(errno));
+            delete pwatch;
+            return false;
+        }
+    }
+#endif
+    mapWatch.insert(make_pair(hSocket, pwatch));
+    return true;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+    boost::mutex::scoped_lock lock(cs);
+    map<SOCKET, Watch*>::iterator it = mapWatch.find(hSocket);
+    if (it == mapWatch.end())
+        return;
+#ifdef HAVE_SYS_EPOLL_H
+    if (backend == BACKEND_EPOLL) {
+        struct epoll_event event; // ignored, but must not be NULL on old kernels
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+    }
+#endif
+    it->second->fRemoved = true;
+    vRemoved.push_back(it->second);
+    mapWatch.erase(it);
+}
+
+void CSocketEvents::Rearm(SOCKET hSocket, int nEvents)
+{
+    // The kernel re-arms epoll by itself once the socket has run dry
+    if (backend == BACKEND_EPOLL)
+        return;
+    boost::mutex::scoped_lock lock(cs);
+    map<SOCKET, Watch*>::iterator it = mapWatch.find(hSocket);
+    if (it != mapWatch.end())
+        it->second->nArmed |= nEvents;
+}
+
+size_t CSocketEvents::size()
+{
+    boost::mutex::scoped_lock lock(cs);
+    return mapWatch.size();
+}
+
+bool CSocketEvents::Wait(int64_t nTimeout, std::vector<Event>& vEvents)
+{
+    vEvents.clear();
+    {
+        // Nothing returned by the wait below can refer to these any more
+        boost::mutex::scoped_lock lock(cs);
+        BOOST_FOREACH(Watch* pwatch, vRemoved)
+            delete pwatch;
+        vRemoved.clear();
+    }
+    if (backend == BACKEND_EPOLL)
+        return WaitEpoll(nTimeout, vEvents);
+    return WaitPoll(nTimeout, vEvents);
+}
+
+bool CSocketEvents::WaitEpoll(int64_t nTimeout, std::vector<Event>& vEvents)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nReady = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+    if (nReady < 0)
+        return errno == EINTR;
+
+    boost::mutex::scoped_lock lock(cs);
+    for (int i = 0; i < nReady; i++) {
+        const Watch* pwatch = (const Watch*)events[i].data.ptr;
+        if (pwatch->fRemoved)
+            continue;
+        Event event;
+        event.hSocket = pwatch->hSocket;
+        event.pdata = pwatch->pdata;
+        event.nEvents = 0;
+        // Errors and hang-ups show up as a failing or empty recv
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            event.nEvents |= EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            event.nEvents |= EVENT_SEND;
+        vEvents.push_back(event);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::WaitPoll(int64_t nTimeout, std::vector<Event>& vEvents)
+{
+    // Snapshot the armed sockets, so Add, Remove and Rearm need not wait for us
+    vector<Watch*> vWatch;
+    {
+        boost::mutex::scoped_lock lock(cs);
+        vWatch.reserve(mapWatch.size());
+        for (map<SOCKET, Watch*>::const_iterator it = mapWatch.begin(); it != mapWatch.end(); it++)
+            if (it->second->nArmed)
+                vWatch.push_back(it->second);
+    }
+
+#ifdef WIN32
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    BOOST_FOREACH(const Watch* pwatch, vWatch) {
+        if (pwatch->nArmed & EVENT_RECV)
+            FD_SET(pwatch->hSocket, &fdsetRecv);
+        if (pwatch->nArmed & EVENT_SEND)
+            FD_SET(pwatch->hSocket, &fdsetSend);
+        FD_SET(pwatch->hSocket, &fdsetError);
+    }
+    struct timeval timeout;
+    timeout.tv_sec = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+    if (vWatch.empty()) {
+        // select() with no sockets fails straight away on Windows
+        MilliSleep(nTimeout);
+        return true;
+    }
+    if (select(0, &fdsetRecv, &fdsetSend, &fdsetError, &timeout) == SOCKET_ERROR)
+        return false;
+#else
+    vector<struct pollfd> vpollfd(vWatch.size());
+    for (size_t i = 0; i < vWatch.size(); i++) {
+        vpollfd[i].fd = vWatch[i]->hSocket;
+        vpollfd[i].events = ((vWatch[i]->nArmed & EVENT_RECV) ? POLLIN : 0) |
+                            ((vWatch[i]->nArmed & EVENT_SEND) ? POLLOUT : 0);
+        vpollfd[i].revents = 0;
+    }
+    if (poll(vpollfd.empty() ? NULL : &vpollfd[0], vpollfd.size(), nTimeout) < 0)
+        return errno == EINTR;
+#endif
+
+    boost::mutex::scoped_lock lock(cs);
+    for (size_t i = 0; i < vWatch.size(); i++) {
+        Watch* pwatch = vWatch[i];
+#ifdef WIN32
+        bool fRecv = FD_ISSET(pwatch->hSocket, &fdsetRecv);
+        bool fSend = FD_ISSET(pwatch->hSocket, &fdsetSend);
+        bool fError = FD_ISSET(pwatch->hSocket, &fdsetError);
+#else
+        bool fRecv = vpollfd[i].revents & POLLIN;
+        bool fSend = vpollfd[i].revents & POLLOUT;
+        bool fError = vpollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL);
+#endif
+        if (pwatch->fRemoved || !(fRecv || fSend || fError))
+            continue;
+        Event event;
+        event.hSocket = pwatch->hSocket;
+        event.pdata = pwatch->pdata;
+        event.nEvents = 0;
+        if (fRecv || fError)
+            event.nEvents |= EVENT_RECV;
+        if (fSend)
+            event.nEvents |= EVENT_SEND;
+        // An error is reported whatever we wait for, so wait for nothing until recv has seen it
+        pwatch->nArmed &= fError ? 0 : ~event.nEvents;
+        vEvents.push_back(event);
+    }
+    return true;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Tells the socket handler which of many sockets have become ready, without
+ * handing it the whole set on every wakeup.
+ *
+ * Notification is edge-triggered: a socket is reported when it becomes
+ * readable (or closed, or in error) or writable, and need not be reported for
+ * that direction again until the caller has run it dry - recv, send or accept
+ * failed with WSAEWOULDBLOCK - and called Rearm. Callers remember readiness
+ * they could not act on yet, and must cope with being told twice.
+ *
+ * The epoll backend costs each Wait only the sockets that are ready. Where
+ * epoll is not available the poll backend gives the same behaviour with
+ * poll(), or select() on Windows, at a cost linear in the sockets watched.
+ *
+ * Add, Remove and Rearm may be called from any thread; Wait from one thread
+ * only.
+ */
+class CSocketEvents : private boost::noncopyable
+{
+public:
+    enum Backend {
+        BACKEND_EPOLL,
+        BACKEND_POLL,
+    };
+
+    enum {
+        EVENT_RECV = (1U << 0),
+        EVENT_SEND = (1U << 1),
+    };
+
+    struct Event {
+        SOCKET hSocket;
+        //! As passed to Add
+        void* pdata;
+        int nEvents;
+    };
+
+private:
+    struct Watch {
+        SOCKET hSocket;
+        void* pdata;
+        //! Directions not reported since the last Rearm (poll backend)
+        int nArmed;
+        bool fRemoved;
+    };
+
+    Backend backend;
+    int hEpoll;
+    boost::mutex cs;
+    std::map<SOCKET, Watch*> mapWatch;
+    //! Removed while Wait may still be returning them; freed on the next Wait
+    std::vector<Watch*> vRemoved;
+
+    bool WaitEpoll(int64_t nTimeout, std::vector<Event>& vEvents);
+    bool WaitPoll(int64_t nTimeout, std::vector<Event>& vEvents);
+
+public:
+    /** Use backendIn if this platform supports it, otherwise poll */
+    explicit CSocketEvents(Backend backendIn = GetDefaultBackend());
+    ~CSocketEvents();
+
+    static Backend GetDefaultBackend();
+    static bool ParseBackend(const std::string& strName, Backend& backendOut);
+    Backend GetBackend() const { return backend; }
+    std::string GetBackendName() const;
+
+    //! Watch hSocket (non-blocking) in both directions; pdata comes back with its events
+    bool Add(SOCKET hSocket, void* pdata);
+    //! Stop watching hSocket; must happen before it is closed
+    void Remove(SOCKET hSocket);
+    //! Report nEvents on hSocket again, after the caller has run it dry
+    void Rearm(SOCKET hSocket, int nEvents);
+    //! Number of sockets watched
+    size_t size();
+
+    /**
+     * Wait up to nTimeout milliseconds for watched sockets to become ready and
+     * put them in vEvents (which may be empty on return). False on error.
+     */
+    bool Wait(int64_t nTimeout, std::vector<Event>& vEvents);
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
@@ -92,6 +92,7 @@ bool IsSporkActive(int nSporkID)
         if(nSporkID == SPORK_11_RESET_EVOLUTION) r = SPORK_11_RESET_EVOLUTION_DEFAULT;
         if(nSporkID == SPORK_12_RECONSIDER_BLOCKS) r = SPORK_12_RECONSIDER_BLOCKS_DEFAULT;
         if(nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) r = SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
+        if(nSporkID == SPORK_14_BINARY_SIGNED_MESSAGES) r = SPORK_14_BINARY_SIGNED_MESSAGES_DEFAULT;
 
         if(r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
     }
@@ -118,6 +119,7 @@ int64_t GetSporkValue(int nSporkID)
         if(nSporkID == SPORK_11_RESET_EVOLUTION) r = SPORK_11_RESET_EVOLUTION_DEFAULT;
         if(nSporkID == SPORK_12_RECONSIDER_BLOCKS) r = SPORK_12_RECONSIDER_BLOCKS_DEFAULT;
         if(nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) r = SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
+        if(nSporkID == SPORK_14_BINARY_SIGNED_MESSAGES) r = SPORK_14_BINARY_SIGNED_MESSAGES_DEFAULT;
 
         if(r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
     }
@@ -141,27 +143,27 @@ void ExecuteSpork(int nSporkID, int nValue)
 
 void ReprocessBlocks(int nBlocks) 
 {   
-    std::map<uint256, int64_t>::iterator it = mapRejectedBlocks.begin();
-    while(it != mapRejectedBlocks.end()){
-        //use a window twice as large as is usual for the nBlocks we want to reset
-        if((*it).second  > GetTime() - (nBlocks*60*5)) {   
-            BlockMap::iterator mi = mapBlockIndex.find((*it).first);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                LOCK(cs_main);
-                
-                CBlockIndex* pindex = (*mi).second;
-                LogPrintf("ReprocessBlocks - %s\n", (*it).first.ToString());
-
-                CValidationState state;
-                ReconsiderBlock(state, pindex);
-            }
-        }
-        ++it;
-    }
-
     CValidationState state;
     {
+        // mapRejectedBlocks is written under cs_main, and txlvote gets here without it
         LOCK(cs_main);
+
+        std::map<uint256, int64_t>::iterator it = mapRejectedBlocks.begin();
+        while(it != mapRejectedBlocks.end()){
+            //use a window twice as large as is usual for the nBlocks we want to reset
+            if((*it).second  > GetTime() - (nBlocks*60*5)) {   
+                BlockMap::iterator mi = mapBlockIndex.find((*it).first);
+                if (mi != mapBlockIndex.end() && (*mi).second) {
+                    CBlockIndex* pindex = (*mi).second;
+                    LogPrintf("ReprocessBlocks - %s\n", (*it).first.ToString());
+
+                    CValidationState state;
+                    ReconsiderBlock(state, pindex);
+                }
+            }
+            ++it;
+        }
+
         DisconnectBlocksAndReprocess(nBlocks);
     }
 
@@ -265,6 +267,7 @@ int CSporkManager::GetSporkIDByName(std::string strName)
     if(strName == "SPORK_11_RESET_EVOLUTION") return SPORK_11_RESET_EVOLUTION;
     if(strName == "SPORK_12_RECONSIDER_BLOCKS") return SPORK_12_RECONSIDER_BLOCKS;
     if(strName == "SPORK_13_ENABLE_SUPERBLOCKS") return SPORK_13_ENABLE_SUPERBLOCKS;
+    if(strName == "SPORK_14_BINARY_SIGNED_MESSAGES") return SPORK_14_BINARY_SIGNED_MESSAGES;
 
     return -1;
 }
@@ -281,6 +284,7 @@ std::string CSporkManager::GetSporkNameByID(int id)
     if(id == SPORK_11_RESET_EVOLUTION) return "SPORK_11_RESET_EVOLUTION";
     if(id == SPORK_12_RECONSIDER_BLOCKS) return "SPORK_12_RECONSIDER_BLOCKS";
     if(id == SPORK_13_ENABLE_SUPERBLOCKS) return "SPORK_13_ENABLE_SUPERBLOCKS";
+    if(id == SPORK_14_BINARY_SIGNED_MESSAGES) return "SPORK_14_BINARY_SIGNED_MESSAGES";
 
     return "Unknown";
 }
@@ -24,7 +24,7 @@ using namespace boost;
     - This would result in old clients getting confused about which spork is for what
 */
 #define SPORK_START                                           10001
-#define SPORK_END                                             10012
+#define SPORK_END                                             10013
 
 #define SPORK_2_INSTANTX                                      10001
 #define SPORK_3_INSTANTX_BLOCK_FILTERING                      10002
@@ -36,6 +36,7 @@ using namespace boost;
 #define SPORK_11_RESET_EVOLUTION                                 10010
 #define SPORK_12_RECONSIDER_BLOCKS                            10011
 #define SPORK_13_ENABLE_SUPERBLOCKS                           10012
+#define SPORK_14_BINARY_SIGNED_MESSAGES                       10013
 
 #define SPORK_2_INSTANTX_DEFAULT                              978307200   //2001-1-1
 #define SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT              1424217600  //2015-2-18
@@ -47,6 +48,7 @@ using namespace boost;
 #define SPORK_11_RESET_EVOLUTION_DEFAULT                         0
 #define SPORK_12_RECONSIDER_BLOCKS_DEFAULT                    0
 #define SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT                   4070908800   //OFF
+#define SPORK_14_BINARY_SIGNED_MESSAGES_DEFAULT               4070908800   //OFF
     
 class CSporkMessage;
 class CSporkManager;
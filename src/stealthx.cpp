@@ -9,6 +9,7 @@
 #include "masterxman.h"
 #include "script/sign.h"
 #include "instantx.h"
+#include "spork.h"
 #include "ui_interface.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -227,12 +228,9 @@ void CStealthXPool::ProcessMessageStealthX(CNode* pfrom, std::string& strCommand
 
                 LogPrint("stealthx", "dsi -- tx in %s\n", i.ToString());
 
-                CTransaction tx2;
-                uint256 hash;
-                if(GetTransaction(i.prevout.hash, tx2, hash, true)){
-                    if(tx2.vout.size() > i.prevout.n) {
-                        nValueIn += tx2.vout[i.prevout.n].nValue;
-                    }
+                CTxOut txout;
+                if(GetUnspentOutput(i.prevout, txout)){
+                    nValueIn += txout.nValue;
                 } else{
                     missingTx = true;
                 }
@@ -952,12 +950,9 @@ bool CStealthXPool::IsCollateralValid(const CTransaction& txCollateral){
     }
 
     BOOST_FOREACH(const CTxIn i, txCollateral.vin){
-        CTransaction tx2;
-        uint256 hash;
-        if(GetTransaction(i.prevout.hash, tx2, hash, true)){
-            if(tx2.vout.size() > i.prevout.n) {
-                nValueIn += tx2.vout[i.prevout.n].nValue;
-            }
+        CTxOut txout;
+        if(GetUnspentOutput(i.prevout, txout)){
+            nValueIn += txout.nValue;
         } else{
             missingTx = true;
         }
@@ -2056,13 +2051,11 @@ bool CStealthXSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey){
     CScript payee2;
     payee2 = GetScriptForDestination(pubkey.GetID());
 
-    CTransaction txVin;
-    uint256 hash;
-    if(GetTransaction(vin.prevout.hash, txVin, hash, true)){
-        BOOST_FOREACH(CTxOut out, txVin.vout){
-            if(out.nValue == 1000*COIN){
-                if(out.scriptPubKey == payee2) return true;
-            }
+    // The collateral comes from the UTXO set, as its block may have been pruned
+    CTxOut out;
+    if(GetUnspentOutput(vin.prevout, out)){
+        if(out.nValue == 1000*COIN){
+            if(out.scriptPubKey == payee2) return true;
         }
     }
 
@@ -2120,6 +2113,45 @@ bool CStealthXSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSi
     return true;
 }
 
+bool CStealthXSigner::SignHash(const uint256& hash, std::string& errorMessage, vector<unsigned char>& vchSig, CKey key)
+{
+    if (!key.SignCompact(hash, vchSig)) {
+        errorMessage = _("Signing failed.");
+        return false;
+    }
+
+    return true;
+}
+
+bool CStealthXSigner::VerifyHash(CPubKey pubkey, const vector<unsigned char>& vchSig, const uint256& hash, std::string& errorMessage)
+{
+    CPubKey pubkey2;
+    if (!pubkey2.RecoverCompact(hash, vchSig)) {
+        errorMessage = _("Error recovering public key.");
+        return false;
+    }
+
+    if (pubkey2.GetID() != pubkey.GetID()) {
+        errorMessage = strprintf("keys don't match - input: %s, recovered: %s, hash: %s, sig: %s\n",
+                    pubkey.GetID().ToString(), pubkey2.GetID().ToString(), hash.ToString(),
+                    EncodeBase64(&vchSig[0], vchSig.size()));
+        return false;
+    }
+
+    return true;
+}
+
+int GetSignedMessageVersion()
+{
+    // old peers can't verify binary signatures, so only switch once they are gone
+    return IsSporkActive(SPORK_14_BINARY_SIGNED_MESSAGES) ? MESSAGE_VERSION_BINARY : MESSAGE_VERSION_STRING;
+}
+
+int GetSignedMessageProtoVersion(int nMessageVersion)
+{
+    return nMessageVersion == MESSAGE_VERSION_BINARY ? BINARY_SIGNED_MESSAGE_VERSION : MIN_PEER_PROTO_VERSION;
+}
+
 bool CStealthXQueue::Sign()
 {
     if(!fMasterX) return false;
@@ -2256,6 +2288,9 @@ void ThreadCheckStealthXPool()
                 gmineman.ProcessMasterXConnections();
                 masterxPayments.CleanPaymentList();
                 CleanTransactionLocksList();
+            } else if(c % MASTERX_CHECK_SECONDS == 0) {
+                // keep collateral states fresh so masterx checks on the message thread never need cs_main
+                gmineman.CheckCollaterals();
             }
 
             //if(c % MASTERXS_DUMP_SECONDS == 0) DumpMasterXs();
@@ -253,6 +253,10 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Sign the hash of a message's binary fields, returns true if successful
+    bool SignHash(const uint256& hash, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
+    /// Verify the signature over the hash of a message's binary fields, returns true if successful
+    bool VerifyHash(CPubKey pubkey, const std::vector<unsigned char>& vchSig, const uint256& hash, std::string& errorMessage);
 };
 
 /** Used to keep track of current status of StealthX pool
@@ -506,4 +510,9 @@ public:
 
 void ThreadCheckStealthXPool();
 
+/// Message version to sign new masterx pings, InstantX votes and evolution votes with
+int GetSignedMessageVersion();
+/// Lowest peer protocol version able to verify a message signed with nMessageVersion
+int GetSignedMessageProtoVersion(int nMessageVersion);
+
 #endif
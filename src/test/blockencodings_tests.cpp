@@ -0,0 +1,133 @@
+// Copyright (c) 2016 The Redux developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        if (i > 0)
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 42 + i;
+        block.vtx.push_back(tx);
+    }
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs SendReceive(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs received;
+    stream >> received;
+    BOOST_CHECK(stream.empty());
+    return received;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_from_mempool)
+{
+    CBlock block = BuildBlock(5);
+    CTxMemPool pool(CFeeRate(0));
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 2)
+            pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = SendReceive(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    // All but the coinbase and the transaction the pool lacks come from the pool
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(partialBlock.nFromMempool, 3U);
+    CBlockTransactionsRequest req = partialBlock.GetMissing();
+    BOOST_REQUIRE_EQUAL(req.indexes.size(), 1U);
+    BOOST_CHECK_EQUAL(req.indexes[0], 2);
+
+    // The missing transaction completes it; anything else doesn't
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>()), READ_STATUS_INVALID);
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>(1, block.vtx[3])), READ_STATUS_FAILED);
+    CBlockTransactions resp(block, req);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << resp;
+    stream >> resp;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, resp.txn), READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_malformed)
+{
+    CBlock block = BuildBlock(3);
+    CTxMemPool pool(CFeeRate(0));
+    CPartiallyDownloadedBlock partialBlock;
+
+    // A prefilled transaction outside the block, or in a place taken already
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.prefilledtxn[0].index = 3;
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_STATUS_INVALID);
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.prefilledtxn.push_back(cmpctblock.prefilledtxn[0]);
+    cmpctblock.shorttxids.pop_back();
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_STATUS_INVALID);
+
+    // More transactions than a uint16_t index can tell apart
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.shorttxids.resize(65535);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_STATUS_INVALID);
+
+    // Two transactions with one short ID can't be told apart: ask for the block in full
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.shorttxids[1] = cmpctblock.shorttxids[0];
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_CASE(getblocktxn_serialization)
+{
+    // Indexes go as differences, so an index past 65535 can't be expressed
+    CBlockTransactionsRequest req;
+    req.blockhash = GetRandHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(300);
+    req.indexes.push_back(65535);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BOOST_CHECK_EQUAL(stream.size(), 32U + 1 + 1 + 1 + 3 + 3);
+    CBlockTransactionsRequest received;
+    stream >> received;
+    BOOST_CHECK(received.blockhash == req.blockhash);
+    BOOST_CHECK(received.indexes == req.indexes);
+
+    stream.clear();
+    stream << req.blockhash;
+    WriteCompactSize(stream, 2);
+    WriteCompactSize(stream, 65535);
+    WriteCompactSize(stream, 0);
+    BOOST_CHECK_THROW(stream >> received, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
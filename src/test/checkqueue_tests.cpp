@@ -0,0 +1,134 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+static boost::mutex csCounter;
+static unsigned int nCounter = 0;
+
+/** Check that counts how often it ran and fails if asked to */
+class CCountingCheck
+{
+private:
+    bool fResult;
+    unsigned int nSpin;
+
+public:
+    CCountingCheck(bool fResultIn = true, unsigned int nSpinIn = 0) : fResult(fResultIn), nSpin(nSpinIn) {}
+
+    bool operator()()
+    {
+        // a bit of work so that batches overlap
+        volatile unsigned int n = 0;
+        for (unsigned int i = 0; i < nSpin; i++)
+            n += i;
+        boost::unique_lock<boost::mutex> lock(csCounter);
+        nCounter++;
+        return fResult;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(fResult, check.fResult);
+        std::swap(nSpin, check.nSpin);
+    }
+};
+
+static void StartWorkers(CCheckQueue<CCountingCheck>& queue, boost::thread_group& threads, int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+}
+
+static void StopWorkers(boost::thread_group& threads)
+{
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 3);
+
+    for (int nRound = 0; nRound < 10; nRound++) {
+        nCounter = 0;
+        unsigned int nTotal = 0;
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            // mix of single checks and large batches, like transactions in a block
+            for (unsigned int nTx = 0; nTx < 200; nTx++) {
+                std::vector<CCountingCheck> vChecks(nTx % 7 == 0 ? 50 : 1, CCountingCheck(true, 100));
+                nTotal += vChecks.size();
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nCounter, nTotal);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    StopWorkers(threads);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 3);
+
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(1000, CCountingCheck(true, 100));
+        vChecks[500] = CCountingCheck(false);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+
+    // the queue is usable again after a failure
+    BOOST_CHECK(queue.IsIdle());
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    StopWorkers(threads);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_small_batches)
+{
+    int nThreads = std::max(2, (int)boost::thread::hardware_concurrency());
+    CCheckQueue<CCountingCheck> queue(128, nThreads);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, nThreads - 1);
+
+    // one or two checks at a time, the way ConnectBlock adds them per transaction
+    nCounter = 0;
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (unsigned int nTx = 0; nTx < 2000; nTx++) {
+            std::vector<CCountingCheck> vChecks(1 + nTx % 2, CCountingCheck(true, 100));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_CHECK_EQUAL(nCounter, 3000U);
+    BOOST_CHECK(queue.IsIdle());
+
+    StopWorkers(threads);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
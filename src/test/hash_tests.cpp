@@ -3,6 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "hashx11.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "random.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +50,74 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vector for a 32-byte message from the SipHash paper's key and message pattern
+    uint256 x("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x), 0x7127512f72f27cceULL);
+
+    // Different keys give unrelated results
+    BOOST_CHECK(SipHashUint256(1, 0, x) != SipHashUint256(0, 1, x));
+}
+
+BOOST_AUTO_TEST_CASE(x11_batch)
+{
+    // The genesis header must hash to the chain's genesis hash through the batch path too
+    const CBlockHeader genesis = Params(CBaseChainParams::MAIN).GenesisBlock().GetBlockHeader();
+    const unsigned char* pgenesis = (const unsigned char*)BEGIN(genesis.nVersion);
+    uint256 hashGenesis;
+    HashX11Batch(&pgenesis, END(genesis.nNonce) - BEGIN(genesis.nVersion), 1, &hashGenesis);
+    BOOST_CHECK(hashGenesis == Params(CBaseChainParams::MAIN).HashGenesisBlock());
+
+    // Batches that are empty, partial, exactly full and spilling over must all
+    // match the scalar chain message by message
+    const size_t nCounts[] = {0, 1, 3, X11_BATCH_LANES - 1, X11_BATCH_LANES, X11_BATCH_LANES + 1, 3 * X11_BATCH_LANES + 5};
+    for (unsigned int n = 0; n < sizeof(nCounts) / sizeof(nCounts[0]); n++) {
+        const size_t nCount = nCounts[n];
+        std::vector<std::vector<unsigned char> > vMessages(nCount, std::vector<unsigned char>(80));
+        std::vector<const unsigned char*> vInputs;
+        for (size_t i = 0; i < nCount; i++) {
+            for (size_t j = 0; j < vMessages[i].size(); j++)
+                vMessages[i][j] = insecure_rand() & 0xff;
+            vInputs.push_back(&vMessages[i][0]);
+        }
+
+        std::vector<uint256> vHashes(nCount);
+        if (nCount > 0)
+            HashX11Batch(&vInputs[0], 80, nCount, &vHashes[0]);
+        for (size_t i = 0; i < nCount; i++)
+            BOOST_CHECK(vHashes[i] == HashX11(vMessages[i].begin(), vMessages[i].end()));
+    }
+
+    // Messages that are not header sized go through the same rounds
+    std::vector<unsigned char> vLong(200, 0x5a);
+    const unsigned char* plong = &vLong[0];
+    uint256 hashLong;
+    HashX11Batch(&plong, vLong.size(), 1, &hashLong);
+    BOOST_CHECK(hashLong == HashX11(vLong.begin(), vLong.end()));
+}
+
+BOOST_AUTO_TEST_CASE(x11_header_hasher)
+{
+    // Starting from the genesis nonce finds the genesis hash
+    CBlockHeader header = Params(CBaseChainParams::MAIN).GenesisBlock().GetBlockHeader();
+    CX11HeaderHasher genesisHasher((const unsigned char*)BEGIN(header.nVersion));
+    uint256 hashGenesis;
+    genesisHasher.Hash(header.nNonce, 1, &hashGenesis);
+    BOOST_CHECK(hashGenesis == Params(CBaseChainParams::MAIN).HashGenesisBlock());
+
+    // Every nonce of a run, including ones that wrap around, matches GetHash()
+    header.nTime = insecure_rand();
+    header.hashMerkleRoot = GetRandHash();
+    CX11HeaderHasher hasher((const unsigned char*)BEGIN(header.nVersion));
+    const uint32_t nNonceBegin = 0xffffffff - 5;
+    const size_t nCount = 2 * X11_BATCH_LANES + 3;
+    std::vector<uint256> vHashes(nCount);
+    hasher.Hash(nNonceBegin, nCount, &vHashes[0]);
+    for (size_t i = 0; i < nCount; i++) {
+        header.nNonce = nNonceBegin + i;
+        BOOST_CHECK(vHashes[i] == header.GetHash());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,10 +5,13 @@
 #include "key.h"
 
 #include "base58.h"
+#include "ecwrapper.h"
+#include "random.h"
 #include "script/script.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <string>
 #include <vector>
@@ -187,4 +190,80 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_paths)
+{
+    // CPubKey must agree with the OpenSSL wrapper on every signature; the
+    // timings show what the default verification path saves.
+    static const int nKeys = 50;
+    std::vector<CPubKey> vPubKeys;
+    std::vector<uint256> vHashes;
+    std::vector<std::vector<unsigned char> > vSigs, vCompactSigs;
+    for (int i = 0; i < nKeys; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig, vchCompactSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(key.SignCompact(hash, vchCompactSig));
+        // corrupt every fifth signature
+        if (i % 5 == 4)
+            vchSig[vchSig.size() - 1] ^= 1;
+        vPubKeys.push_back(key.GetPubKey());
+        vHashes.push_back(hash);
+        vSigs.push_back(vchSig);
+        vCompactSigs.push_back(vchCompactSig);
+    }
+
+    // R padded with a superfluous zero byte is not strict DER
+    std::vector<unsigned char> vchPadded = vSigs[0];
+    vchPadded.insert(vchPadded.begin() + 4, 0x00);
+    vchPadded[1]++;
+    vchPadded[3]++;
+    CECKey eckey;
+    BOOST_CHECK(eckey.SetPubKey(vPubKeys[0].begin(), vPubKeys[0].size()));
+    BOOST_CHECK(vPubKeys[0].Verify(vHashes[0], vchPadded) == eckey.Verify(vHashes[0], vchPadded));
+
+    int64_t nTimeStart = GetTimeMicros();
+    std::vector<bool> vDefault;
+    for (int i = 0; i < nKeys; i++)
+        vDefault.push_back(vPubKeys[i].Verify(vHashes[i], vSigs[i]));
+    int64_t nTimeDefault = GetTimeMicros() - nTimeStart;
+
+    nTimeStart = GetTimeMicros();
+    std::vector<bool> vOpenSSL;
+    for (int i = 0; i < nKeys; i++) {
+        CECKey key;
+        vOpenSSL.push_back(key.SetPubKey(vPubKeys[i].begin(), vPubKeys[i].size()) && key.Verify(vHashes[i], vSigs[i]));
+    }
+    int64_t nTimeOpenSSL = GetTimeMicros() - nTimeStart;
+
+    BOOST_CHECK(vDefault == vOpenSSL);
+    for (int i = 0; i < nKeys; i++)
+        BOOST_CHECK(vDefault[i] == (i % 5 != 4));
+    BOOST_TEST_MESSAGE(strprintf("Verify: %.2fus/sig, OpenSSL: %.2fus/sig",
+        (double)nTimeDefault / nKeys, (double)nTimeOpenSSL / nKeys));
+
+    nTimeStart = GetTimeMicros();
+    std::vector<CPubKey> vRecovered(nKeys);
+    for (int i = 0; i < nKeys; i++)
+        BOOST_CHECK(vRecovered[i].RecoverCompact(vHashes[i], vCompactSigs[i]));
+    nTimeDefault = GetTimeMicros() - nTimeStart;
+
+    nTimeStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++) {
+        CECKey key;
+        int recid = (vCompactSigs[i][0] - 27) & 3;
+        bool fComp = ((vCompactSigs[i][0] - 27) & 4) != 0;
+        BOOST_CHECK(key.Recover(vHashes[i], &vCompactSigs[i][1], recid));
+        std::vector<unsigned char> vchPubKey;
+        key.GetPubKey(vchPubKey, fComp);
+        BOOST_CHECK(CPubKey(vchPubKey) == vRecovered[i]);
+        BOOST_CHECK(vRecovered[i] == vPubKeys[i]);
+    }
+    nTimeOpenSSL = GetTimeMicros() - nTimeStart;
+
+    BOOST_TEST_MESSAGE(strprintf("RecoverCompact: %.2fus/sig, OpenSSL: %.2fus/sig",
+        (double)nTimeDefault / nKeys, (double)nTimeOpenSSL / nKeys));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
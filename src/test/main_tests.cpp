@@ -23,4 +23,50 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 1350824726649000ULL);
 }
 
+static CBlockFileInfo MakeFileInfo(unsigned int nSize, unsigned int nHeightFirst, unsigned int nHeightLast)
+{
+    CBlockFileInfo info;
+    info.nBlocks = nHeightLast - nHeightFirst + 1;
+    info.nSize = nSize;
+    info.nUndoSize = nSize / 8;
+    info.nHeightFirst = nHeightFirst;
+    info.nHeightLast = nHeightLast;
+    return info;
+}
+
+BOOST_AUTO_TEST_CASE(prune_target_test)
+{
+    // Five full files of 100 blocks each and the one being written to: 5 * 144 MiB + 9 MiB
+    std::vector<CBlockFileInfo> vinfo;
+    for (unsigned int i = 0; i < 5; i++)
+        vinfo.push_back(MakeFileInfo(MAX_BLOCKFILE_SIZE, i * 100, i * 100 + 99));
+    vinfo.push_back(MakeFileInfo(8 * 1024 * 1024, 500, 520));
+    int nLastFile = vinfo.size() - 1;
+
+    // Under the target, with room for another allocation: nothing to do
+    BOOST_CHECK(SelectBlockFilesToPrune(vinfo, nLastFile, 400, 1024 * 1024 * 1024).empty());
+
+    // Over it: the oldest files go, just enough to get under the target with room to spare
+    uint64_t nTarget = MIN_DISK_SPACE_FOR_BLOCK_FILES;
+    std::set<int> setPruned = SelectBlockFilesToPrune(vinfo, nLastFile, 400, nTarget);
+    BOOST_CHECK_EQUAL(setPruned.size(), 2U);
+    BOOST_CHECK(setPruned.count(0) && setPruned.count(1));
+    uint64_t nUsage = 0;
+    for (unsigned int i = 0; i < vinfo.size(); i++)
+        if (!setPruned.count(i))
+            nUsage += vinfo[i].nSize + vinfo[i].nUndoSize;
+    BOOST_CHECK(nUsage + BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE < nTarget);
+
+    // Files with blocks too close to the tip stay, even if that leaves usage over the target
+    setPruned = SelectBlockFilesToPrune(vinfo, nLastFile, 150, nTarget);
+    BOOST_CHECK_EQUAL(setPruned.size(), 1U);
+    BOOST_CHECK(setPruned.count(0));
+
+    // Files pruned already are skipped, and the file being written to is never pruned
+    vinfo[0].SetNull();
+    setPruned = SelectBlockFilesToPrune(vinfo, nLastFile, 1000, 0);
+    BOOST_CHECK_EQUAL(setPruned.size(), 4U);
+    BOOST_CHECK(!setPruned.count(0) && !setPruned.count(nLastFile));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
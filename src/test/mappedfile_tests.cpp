@@ -0,0 +1,202 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mappedfile_tests)
+
+static void AppendToFile(const boost::filesystem::path& path, const string& strData)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(strData.data(), 1, strData.size(), file), strData.size());
+    fclose(file);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+    boost::filesystem::path dir = GetDataDir() / "mappedfile_tests";
+    boost::filesystem::create_directories(dir);
+    AppendToFile(dir / "a", string(1000, 'a'));
+    AppendToFile(dir / "b", string(1000, 'b'));
+    AppendToFile(dir / "c", string(1000, 'c'));
+
+    CMappedFileCache cache(2);
+    CMappedFileRef fileA = cache.Get(dir / "a", 10);
+    BOOST_REQUIRE(fileA);
+    BOOST_CHECK_EQUAL(fileA->size(), 1000U);
+    BOOST_CHECK(string(fileA->begin(), fileA->end()) == string(1000, 'a'));
+    BOOST_CHECK(cache.Get(dir / "a", 10) == fileA);
+
+    // Asking for more than the file holds fails until the file grows, then it is remapped
+    BOOST_CHECK(!cache.Get(dir / "a", 2000));
+    AppendToFile(dir / "a", string(1000, 'A'));
+    CMappedFileRef fileA2 = cache.Get(dir / "a", 2000);
+    BOOST_REQUIRE(fileA2);
+    BOOST_CHECK_EQUAL(fileA2->size(), 2000U);
+    BOOST_CHECK_EQUAL(fileA2->begin()[1999], 'A');
+
+    // Least recently used files are dropped, but stay readable while referenced
+    BOOST_CHECK(cache.Get(dir / "b", 0));
+    BOOST_CHECK(cache.Get(dir / "c", 0));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2U);
+    BOOST_CHECK_EQUAL(fileA2->begin()[0], 'a');
+
+    cache.Invalidate(dir / "c");
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+    BOOST_CHECK(!cache.Get(dir / "missing", 0));
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0U);
+
+    boost::filesystem::remove_all(dir);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(mappedfile_memory_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    vector<unsigned char> vch(100, 0x42);
+    ss << vch << (uint32_t)7;
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    vector<unsigned char> vchRead;
+    uint32_t n;
+    reader >> vchRead >> n;
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK_EQUAL(n, 7U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_read_block)
+{
+    // The genesis block written by InitBlockIndex reads back the same, mapped or not
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, chainActive.Genesis()));
+    BOOST_CHECK(block.GetHash() == Params().HashGenesisBlock());
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(mappedfile_read_records)
+{
+    // Lay out records the way WriteBlockToDisk does; each reads back the same from the
+    // file and from its mapping
+    boost::filesystem::path path = GetDataDir() / "mappedfile_records.dat";
+    const CBlock& genesis = Params().GenesisBlock();
+    vector<unsigned int> vPos;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        for (int i = 0; i < 20; i++) {
+            fileout << FLATDATA(Params().MessageStart()) << fileout.GetSerializeSize(genesis);
+            vPos.push_back(ftell(fileout.Get()));
+            fileout << genesis;
+        }
+    }
+
+    CMappedFileCache cache(1);
+    for (unsigned int i = 0; i < vPos.size(); i++) {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        fseek(filein.Get(), vPos[i], SEEK_SET);
+        CBlock blockFile;
+        filein >> blockFile;
+        BOOST_CHECK(blockFile.GetHash() == genesis.GetHash());
+
+        CMappedFileRef file = cache.Get(path, vPos[i]);
+        BOOST_REQUIRE(file);
+        CBlock blockMapped;
+        CMemoryReader(file->begin() + vPos[i], file->end(), SER_DISK, CLIENT_VERSION) >> blockMapped;
+        BOOST_CHECK(blockMapped.GetHash() == genesis.GetHash());
+        BOOST_CHECK(blockMapped.hashMerkleRoot == blockFile.hashMerkleRoot);
+    }
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_raw_block_serving)
+{
+    // A block with many transactions, stored in a block file of its own
+    CBlock block = Params().GenesisBlock();
+    for (int i = 0; i < 500; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(4);
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            tx.vin[j].scriptSig = CScript() << vector<unsigned char>(72, i) << vector<unsigned char>(33, j);
+        }
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].nValue = i * COIN + j;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CDiskBlockPos pos(9999, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+    uint256 hash = block.GetHash();
+    CBlockIndex index(block);
+    index.phashBlock = &hash;
+    index.nFile = pos.nFile;
+    index.nDataPos = pos.nPos;
+    index.nStatus = BLOCK_HAVE_DATA;
+
+    // Serving the stored bytes gives the same message payload as reserializing the block
+    const int nServes = 200;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    int64_t nTimeStart = GetTimeMicros();
+    for (int i = 0; i < nServes; i++) {
+        CBlock blockRead;
+        BOOST_REQUIRE(ReadBlockFromDisk(blockRead, &index));
+        ssBlock.clear();
+        ssBlock << blockRead;
+    }
+    int64_t nTimeBlock = GetTimeMicros() - nTimeStart;
+
+    CDataStream ssRaw(SER_NETWORK, PROTOCOL_VERSION);
+    nTimeStart = GetTimeMicros();
+    for (int i = 0; i < nServes; i++) {
+        CMappedFileRef file;
+        const char *pbegin, *pend;
+        BOOST_REQUIRE(ReadRawBlockFromDisk(file, pbegin, pend, &index));
+        ssRaw.clear();
+        ssRaw.write(pbegin, pend - pbegin);
+    }
+    int64_t nTimeRaw = GetTimeMicros() - nTimeStart;
+    BOOST_CHECK(ssRaw.str() == ssBlock.str());
+    BOOST_TEST_MESSAGE(strprintf("Block serving, %u bytes: %.2fus/serve reserialized, %.2fus/serve raw",
+        ssBlock.size(), (double)nTimeBlock / nServes, (double)nTimeRaw / nServes));
+
+    // A block index that doesn't match the stored block is refused
+    uint256 hashOther = ~hash;
+    index.phashBlock = &hashOther;
+    CMappedFileRef file;
+    const char *pbegin, *pend;
+    BOOST_CHECK(!ReadRawBlockFromDisk(file, pbegin, pend, &index));
+
+    file.reset();
+    boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -99,4 +99,163 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+// A transaction spending the first output of each of vPrev (or an unknown coin)
+static CMutableTransaction SpendingTx(const std::vector<CTransaction>& vPrev, int nTag)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrev.empty() ? 1 : vPrev.size());
+    for (unsigned int i = 0; i < vPrev.size(); i++)
+        tx.vin[i].prevout = COutPoint(vPrev[i].GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << nTag;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10000LL;
+    return tx;
+}
+
+static CTxMemPool::txiter Find(CTxMemPool& pool, const CTransaction& tx)
+{
+    CTxMemPool::txiter it = pool.mapTx.find(tx.GetHash());
+    BOOST_REQUIRE(it != pool.mapTx.end());
+    return it;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    // parent <- child <- grandchild, which also spends other
+    std::vector<CTransaction> vNone;
+    CTransaction txParent = SpendingTx(vNone, 1);
+    CTransaction txOther = SpendingTx(vNone, 2);
+    CTransaction txChild = SpendingTx(std::vector<CTransaction>(1, txParent), 3);
+    std::vector<CTransaction> vGrandParents;
+    vGrandParents.push_back(txChild);
+    vGrandParents.push_back(txOther);
+    CTransaction txGrandChild = SpendingTx(vGrandParents, 4);
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 2000, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 3000, 0, 0.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 4000, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = Find(pool, txParent);
+    CTxMemPool::txiter itChild = Find(pool, txChild);
+    CTxMemPool::txiter itGrandChild = Find(pool, txGrandChild);
+    uint64_t nChainSize = itParent->GetTxSize() + itChild->GetTxSize() + itGrandChild->GetTxSize();
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nChainSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 8000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 10000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(itGrandChild).size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itParent).size(), 1U);
+
+    // Prioritising the child counts for its ancestors and descendants
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(itChild->GetModifiedFee(), 3500);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 8500);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 10500);
+
+    // Mining the parent leaves its descendants with one ancestor fewer
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(1, txParent), 2, conflicts);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 9500);
+
+    // Putting it back from a disconnected block links it up again
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    pool.UpdateTransactionsFromBlock(std::vector<uint256>(1, txParent.GetHash()));
+    itParent = Find(pool, txParent);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 8500);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 10500);
+
+    // Removing the child takes the grandchild with it
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 1U);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    // A low fee parent with a high fee child goes before a medium fee
+    // transaction, through the child
+    std::vector<CTransaction> vNone;
+    CTransaction txMedium = SpendingTx(vNone, 1);
+    CTransaction txLow = SpendingTx(vNone, 2);
+    CTransaction txHigh = SpendingTx(std::vector<CTransaction>(1, txLow), 3);
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(txMedium.GetHash(), CTxMemPoolEntry(txMedium, 10000, 0, 0.0, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 100, 0, 0.0, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 50000, 0, 0.0, 1));
+
+    std::vector<uint256> vOrder;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = pool.mapTx.get<ancestor_score>().begin();
+    for (; it != pool.mapTx.get<ancestor_score>().end(); ++it)
+        vOrder.push_back(it->GetTx().GetHash());
+    BOOST_REQUIRE_EQUAL(vOrder.size(), 3U);
+    BOOST_CHECK(vOrder[0] == txHigh.GetHash());
+    BOOST_CHECK(vOrder[1] == txMedium.GetHash());
+    BOOST_CHECK(vOrder[2] == txLow.GetHash());
+
+    // Eviction goes the other way, by the package of a transaction with its descendants
+    BOOST_CHECK(pool.mapTx.get<descendant_score>().begin()->GetTx().GetHash() == txMedium.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    SetMockTime(42);
+    std::vector<CTransaction> vNone;
+    CTransaction tx1 = SpendingTx(vNone, 1);
+    CTransaction tx2 = SpendingTx(vNone, 2);
+    CTransaction tx3 = SpendingTx(vNone, 3);
+    CTransaction tx4 = SpendingTx(std::vector<CTransaction>(1, tx3), 4);
+
+    CTxMemPool pool(CFeeRate(1000));
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, GetTime(), 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000, GetTime(), 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 1000, GetTime(), 0.0, 1));
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 2000, GetTime(), 0.0, 1));
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // Going one byte over evicts the lowest fee rate package, tx3 with its child
+    size_t nUsage = pool.DynamicMemoryUsage();
+    CFeeRate feeRemoved(3000, Find(pool, tx3)->GetSizeWithDescendants());
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK(!pool.exists(tx4.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // Getting in now takes more than what was evicted
+    CAmount nMinFee = feeRemoved.GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage).GetFeePerK(), nMinFee);
+
+    // The minimum only decays once a block has come in, by half per half-life
+    // (quartered while the pool is under a quarter full)
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage * 100).GetFeePerK(), nMinFee);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vNone, 2, conflicts);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE + CTxMemPool::ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage * 100).GetFeePerK(), std::max((CAmount)(nMinFee / 2), (CAmount)1000));
+    SetMockTime(42 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(nUsage * 100) == CFeeRate(0));
+
+    // Expiry removes transactions that entered before the given time, with their descendants
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 1000, GetTime(), 0.0, 1));
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 2000, GetTime() + 10, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(GetTime() + 1), 4);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "random.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -263,4 +264,44 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     Checkpoints::fEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(CreateNewBlock_template_cache)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CBlockTemplateCache cache;
+
+    LOCK(cs_main);
+    Checkpoints::fEnabled = false;
+    SetMockTime(GetTime());
+
+    // Polling again without changes serves the same template
+    boost::shared_ptr<CBlockTemplate> ptemplate = cache.Get(scriptPubKey, 5);
+    BOOST_REQUIRE(ptemplate);
+    BOOST_CHECK(cache.Get(scriptPubKey, 5) == ptemplate);
+    BOOST_CHECK_EQUAL(cache.GetTransactionsUpdated(), mempool.GetTransactionsUpdated());
+
+    // A mempool change is picked up once the template is older than the given age
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, GetTime(), 0.0, chainActive.Height()));
+    BOOST_CHECK(cache.Get(scriptPubKey, 5) == ptemplate);
+    SetMockTime(GetTime() + 6);
+    boost::shared_ptr<CBlockTemplate> pnew = cache.Get(scriptPubKey, 5);
+    BOOST_REQUIRE(pnew);
+    BOOST_CHECK(pnew != ptemplate);
+    BOOST_CHECK_EQUAL(cache.GetTransactionsUpdated(), mempool.GetTransactionsUpdated());
+
+    // So is a different payee, right away
+    ptemplate = cache.Get(CScript() << OP_2, 5);
+    BOOST_REQUIRE(ptemplate);
+    BOOST_CHECK(ptemplate != pnew);
+    BOOST_CHECK(ptemplate->block.vtx[0].vout[0].scriptPubKey == CScript() << OP_2);
+
+    SetMockTime(0);
+    mempool.clear();
+    Checkpoints::fEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,145 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for assembling received bytes into messages
+//
+
+#include "net.h"
+#include "serialize.h"
+#include "streams.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+/** A message as it comes off the wire: header, then nSize bytes of payload */
+static vector<char> MakeMessage(const char* pszCommand, unsigned int nSize)
+{
+    CMessageHeader hdr(pszCommand, nSize);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vector<char> vMsg(ss.begin(), ss.end());
+    for (unsigned int i = 0; i < nSize; i++)
+        vMsg.push_back((char)(i * 7));
+    return vMsg;
+}
+
+/** Feed vMsg to pnode the way the socket handler does, recv()ing nChunk bytes at a time */
+static bool ReceiveMessage(CNode* pnode, const vector<char>& vMsg, unsigned int nChunk)
+{
+    unsigned int nPos = 0;
+    while (nPos < vMsg.size()) {
+        unsigned int nRoom = 0;
+        char* pchRoom = pnode->GetRecvBuffer(0x10000, nRoom);
+        unsigned int nBytes = std::min(nChunk, (unsigned int)vMsg.size() - nPos);
+        if (pchRoom) {
+            nBytes = std::min(nBytes, nRoom);
+            memcpy(pchRoom, &vMsg[nPos], nBytes);
+            pnode->ReceivedMsgData(nBytes);
+        } else if (!pnode->ReceiveMsgBytes(&vMsg[nPos], nBytes)) {
+            return false;
+        }
+        nPos += nBytes;
+    }
+    return true;
+}
+
+static bool PayloadMatches(const CNetMessage& msg, const vector<char>& vMsg)
+{
+    return msg.vRecv.size() + CMessageHeader::HEADER_SIZE == vMsg.size() &&
+           equal(msg.vRecv.begin(), msg.vRecv.end(), vMsg.begin() + CMessageHeader::HEADER_SIZE);
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(net_recv_messages)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Small messages back to back, split at every possible place
+    vector<char> vPing = MakeMessage("ping", 8);
+    vector<char> vVerack = MakeMessage("verack", 0);
+    vector<char> vBoth(vPing);
+    vBoth.insert(vBoth.end(), vVerack.begin(), vVerack.end());
+    for (unsigned int nChunk = 1; nChunk <= vBoth.size(); nChunk++) {
+        BOOST_REQUIRE(ReceiveMessage(&node, vBoth, nChunk));
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+        BOOST_CHECK(node.vRecvMsg[0].complete() && node.vRecvMsg[1].complete());
+        BOOST_CHECK_EQUAL(node.vRecvMsg[0].hdr.GetCommand(), "ping");
+        BOOST_CHECK(PayloadMatches(node.vRecvMsg[0], vPing));
+        BOOST_CHECK_EQUAL(node.vRecvMsg[1].hdr.GetCommand(), "verack");
+        BOOST_CHECK_EQUAL(node.nRecvQueue, 2);
+        node.PopRecvMsgs(node.vRecvMsg.end());
+        BOOST_CHECK_EQUAL(node.nRecvQueue, 0);
+    }
+
+    // A block-sized message, most of it received straight into its buffer
+    vector<char> vBlock = MakeMessage("block", 900 * 1000);
+    BOOST_REQUIRE(ReceiveMessage(&node, vBlock, 0x10000));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg[0].complete());
+    BOOST_CHECK(PayloadMatches(node.vRecvMsg[0], vBlock));
+
+    // Oversized messages are refused
+    vector<char> vHuge = MakeMessage("block", MAX_PROTOCOL_MESSAGE_LENGTH + 1);
+    BOOST_CHECK(!node.ReceiveMsgBytes(&vHuge[0], CMessageHeader::HEADER_SIZE + 1));
+}
+
+BOOST_AUTO_TEST_CASE(net_recv_buffer_pool)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // A header alone doesn't get a big buffer allocated
+    vector<char> vBlock = MakeMessage("block", 900 * 1000);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&vBlock[0], CMessageHeader::HEADER_SIZE + 1000));
+    BOOST_CHECK(node.vRecvMsg.back().vRecv.capacity() <= RECV_PREALLOC_SIZE);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.back().vRecv.size(), 1000U);
+    node.vRecvMsg.clear();
+    node.nRecvQueue = 0;
+
+    // The first block allocates; later ones, and smaller messages, reuse its buffer
+    BOOST_REQUIRE(ReceiveMessage(&node, vBlock, 0x10000));
+    node.PopRecvMsgs(node.vRecvMsg.end());
+    uint64_t nAllocated = node.recvPool.nAllocated;
+    BOOST_CHECK(nAllocated > 0);
+    for (int i = 0; i < 10; i++) {
+        BOOST_REQUIRE(ReceiveMessage(&node, vBlock, 0x10000));
+        BOOST_CHECK(PayloadMatches(node.vRecvMsg[0], vBlock));
+        node.PopRecvMsgs(node.vRecvMsg.end());
+    }
+    BOOST_CHECK_EQUAL(node.recvPool.nAllocated, nAllocated);
+    BOOST_CHECK_EQUAL(node.recvPool.nReused, 10U);
+
+    vector<char> vTx = MakeMessage("tx", 250);
+    BOOST_REQUIRE(ReceiveMessage(&node, vTx, 0x10000));
+    BOOST_CHECK(PayloadMatches(node.vRecvMsg[0], vTx));
+    BOOST_CHECK_EQUAL(node.recvPool.nReused, 11U);
+    node.PopRecvMsgs(node.vRecvMsg.end());
+
+    // Buffers bigger than MAX_RECV_POOL_SIZE are freed rather than kept
+    vector<char> vBig = MakeMessage("block", MAX_RECV_POOL_SIZE + 1);
+    BOOST_REQUIRE(ReceiveMessage(&node, vBig, 0x10000));
+    BOOST_REQUIRE(ReceiveMessage(&node, vTx, 0x10000));
+    node.PopRecvMsgs(node.vRecvMsg.end());
+    nAllocated = node.recvPool.nAllocated;
+    BOOST_REQUIRE(ReceiveMessage(&node, vBig, 0x10000));
+    BOOST_CHECK(node.recvPool.nAllocated > nAllocated);
+    BOOST_CHECK(PayloadMatches(node.vRecvMsg[0], vBig));
+    node.PopRecvMsgs(node.vRecvMsg.end());
+
+    // A kept buffer only covers the data received into it so far
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&vBlock[0], CMessageHeader::HEADER_SIZE + 1000));
+    BOOST_CHECK(node.vRecvMsg.back().vRecv.capacity() >= 900 * 1000);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.back().vRecv.size(), 1000U);
+    // but counts against -maxreceivebuffer in full
+    BOOST_CHECK(node.GetTotalRecvSize() >= 900 * 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
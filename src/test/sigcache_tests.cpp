@@ -0,0 +1,177 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+
+#include "key.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+static void FillEntries(vector<uint256>& vEntries, size_t nCount)
+{
+    vEntries.resize(nCount);
+    for (size_t i = 0; i < nCount; i++)
+        vEntries[i] = GetRandHash();
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CSignatureCache cache;
+    cache.Resize(1 << 20);
+    BOOST_CHECK_EQUAL(cache.GetCapacity(), (1 << 20) / sizeof(uint256));
+
+    // At half load every entry finds a slot
+    vector<uint256> vEntries;
+    FillEntries(vEntries, cache.GetCapacity() / 2);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        cache.Set(vEntries[i]);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK(cache.Get(vEntries[i]));
+
+    // Inserting the same entry twice does not take a second slot
+    cache.Set(vEntries[0]);
+    BOOST_CHECK(cache.Get(vEntries[0]));
+
+    vector<uint256> vAbsent;
+    FillEntries(vAbsent, 1000);
+    for (size_t i = 0; i < vAbsent.size(); i++)
+        BOOST_CHECK(!cache.Get(vAbsent[i]));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_overfill)
+{
+    CSignatureCache cache;
+    cache.Resize(1 << 16);
+
+    // Twice as many entries as slots: old entries get dropped, memory stays fixed
+    vector<uint256> vEntries;
+    FillEntries(vEntries, cache.GetCapacity() * 2);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        cache.Set(vEntries[i]);
+    BOOST_CHECK_EQUAL(cache.GetCapacity(), (1 << 16) / sizeof(uint256));
+
+    size_t nFound = 0;
+    for (size_t i = 0; i < vEntries.size(); i++)
+        if (cache.Get(vEntries[i]))
+            nFound++;
+    BOOST_CHECK(nFound <= cache.GetCapacity());
+    BOOST_CHECK(nFound > cache.GetCapacity() * 9 / 10);
+
+    // A cache of size zero stores nothing
+    CSignatureCache empty;
+    empty.Resize(0);
+    empty.Set(vEntries[0]);
+    BOOST_CHECK(!empty.Get(vEntries[0]));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_compute_entry)
+{
+    CSignatureCache cache;
+    cache.Resize(1 << 16);
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    uint256 entry1, entry2, entry3;
+    cache.ComputeEntry(entry1, hash, vchSig, key.GetPubKey());
+    cache.ComputeEntry(entry2, hash, vchSig, key.GetPubKey());
+    BOOST_CHECK(entry1 == entry2);
+    vchSig.push_back(0);
+    cache.ComputeEntry(entry3, hash, vchSig, key.GetPubKey());
+    BOOST_CHECK(entry1 != entry3);
+
+    // A new salt gives a new entry
+    cache.Resize(1 << 16);
+    cache.ComputeEntry(entry2, hash, vector<unsigned char>(vchSig.begin(), vchSig.end() - 1), key.GetPubKey());
+    BOOST_CHECK(entry1 != entry2);
+}
+
+BOOST_AUTO_TEST_CASE(script_execution_cache)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+
+    BOOST_CHECK(!GetScriptExecutionCache(tx, SCRIPT_VERIFY_P2SH));
+    SetScriptExecutionCache(tx, SCRIPT_VERIFY_P2SH);
+    BOOST_CHECK(GetScriptExecutionCache(tx, SCRIPT_VERIFY_P2SH));
+
+    // Only under the flags it was checked with, and only for that transaction
+    BOOST_CHECK(!GetScriptExecutionCache(tx, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG));
+    BOOST_CHECK(!GetScriptExecutionCache(tx, SCRIPT_VERIFY_NONE));
+    tx.vin[0].prevout.n = 1;
+    BOOST_CHECK(!GetScriptExecutionCache(tx, SCRIPT_VERIFY_P2SH));
+}
+
+static void SigCacheWorker(CSignatureCache* cache, const vector<uint256>* vEntries, size_t nBegin, size_t nEnd, bool fInsert, size_t* nFound)
+{
+    if (fInsert) {
+        for (size_t i = nBegin; i < nEnd; i++)
+            cache->Set((*vEntries)[i]);
+    } else {
+        size_t n = 0;
+        for (size_t i = nBegin; i < nEnd; i++)
+            if (cache->Get((*vEntries)[i]))
+                n++;
+        *nFound = n;
+    }
+}
+
+static int64_t RunWorkers(CSignatureCache& cache, const vector<uint256>& vEntries, int nThreads, bool fInsert, size_t& nFound)
+{
+    vector<size_t> vFound(nThreads, 0);
+    size_t nPerThread = vEntries.size() / nThreads;
+    int64_t nTimeStart = GetTimeMicros();
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&SigCacheWorker, &cache, &vEntries, i * nPerThread, (i + 1) * nPerThread, fInsert, &vFound[i]));
+    threads.join_all();
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+    nFound = 0;
+    for (int i = 0; i < nThreads; i++)
+        nFound += vFound[i];
+    return nTime;
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_concurrent_throughput)
+{
+    // Same thread count -par would pick by default
+    int nThreads = std::max(2, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+
+    CSignatureCache cache;
+    cache.Resize(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    vector<uint256> vEntries;
+    FillEntries(vEntries, cache.GetCapacity() / 2 / nThreads * nThreads);
+
+    size_t nFound;
+    int64_t nTimeInsert = RunWorkers(cache, vEntries, nThreads, true, nFound);
+    int64_t nTimeLookup = RunWorkers(cache, vEntries, nThreads, false, nFound);
+    BOOST_CHECK_EQUAL(nFound, vEntries.size());
+
+    BOOST_TEST_MESSAGE(strprintf("Signature cache, %d threads, %u entries: %.2fM inserts/s, %.2fM lookups/s",
+        nThreads, vEntries.size(),
+        (double)vEntries.size() / std::max(nTimeInsert, (int64_t)1),
+        (double)vEntries.size() / std::max(nTimeLookup, (int64_t)1)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,213 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <set>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+#ifndef WIN32
+
+/** Simulated peers: the local end of each pair is watched, the remote end plays the peer */
+struct PeerSimulator
+{
+    vector<SOCKET> vLocal;
+    vector<SOCKET> vRemote;
+
+    explicit PeerSimulator(size_t nPeers)
+    {
+        for (size_t i = 0; i < nPeers; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+            SOCKET hLocal = fds[0];
+            BOOST_REQUIRE(SetSocketNonBlocking(hLocal, true));
+            vLocal.push_back(hLocal);
+            vRemote.push_back(fds[1]);
+        }
+    }
+
+    ~PeerSimulator()
+    {
+        for (size_t i = 0; i < vLocal.size(); i++) {
+            CloseSocket(vLocal[i]);
+            CloseSocket(vRemote[i]);
+        }
+    }
+
+    void Send(size_t nPeer)
+    {
+        char ch = 0;
+        BOOST_REQUIRE_EQUAL(send(vRemote[nPeer], &ch, 1, 0), 1);
+    }
+
+    //! Read everything the peer sent; true if the socket then reported WSAEWOULDBLOCK
+    bool Drain(size_t nPeer)
+    {
+        char pchBuf[256];
+        while (recv(vLocal[nPeer], pchBuf, sizeof(pchBuf), MSG_DONTWAIT) > 0);
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    }
+};
+
+static vector<CSocketEvents::Backend> AvailableBackends()
+{
+    vector<CSocketEvents::Backend> vBackends;
+    vBackends.push_back(CSocketEvents::BACKEND_POLL);
+    CSocketEvents events(CSocketEvents::BACKEND_EPOLL);
+    if (events.GetBackend() == CSocketEvents::BACKEND_EPOLL)
+        vBackends.push_back(CSocketEvents::BACKEND_EPOLL);
+    return vBackends;
+}
+
+//! Indexes of the peers reported ready to receive
+static set<size_t> Readable(const vector<CSocketEvents::Event>& vEvents)
+{
+    set<size_t> setReady;
+    for (size_t i = 0; i < vEvents.size(); i++)
+        if (vEvents[i].nEvents & CSocketEvents::EVENT_RECV)
+            setReady.insert((size_t)vEvents[i].pdata);
+    return setReady;
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_edge_triggered)
+{
+    vector<CSocketEvents::Backend> vBackends = AvailableBackends();
+    for (size_t b = 0; b < vBackends.size(); b++) {
+        CSocketEvents events(vBackends[b]);
+        PeerSimulator peers(2);
+        BOOST_REQUIRE_EQUAL(peers.vLocal.size(), 2U);
+        BOOST_CHECK(events.Add(peers.vLocal[0], (void*)0));
+        BOOST_CHECK(events.Add(peers.vLocal[1], (void*)1));
+        BOOST_CHECK_EQUAL(events.size(), 2U);
+
+        // New sockets are writable, and said so once
+        vector<CSocketEvents::Event> vEvents;
+        BOOST_CHECK(events.Wait(1000, vEvents));
+        BOOST_CHECK_EQUAL(vEvents.size(), 2U);
+        for (size_t i = 0; i < vEvents.size(); i++)
+            BOOST_CHECK_EQUAL(vEvents[i].nEvents, (int)CSocketEvents::EVENT_SEND);
+        BOOST_CHECK(events.Wait(0, vEvents));
+        BOOST_CHECK(vEvents.empty());
+
+        // Incoming data is reported once, even while it is left unread
+        peers.Send(1);
+        BOOST_CHECK(events.Wait(1000, vEvents));
+        BOOST_CHECK_EQUAL(vEvents.size(), 1U);
+        BOOST_CHECK(Readable(vEvents).count(1));
+        BOOST_CHECK(vEvents[0].hSocket == peers.vLocal[1]);
+        BOOST_CHECK(events.Wait(0, vEvents));
+        BOOST_CHECK(vEvents.empty());
+
+        // Once drained and rearmed, only new data is reported
+        BOOST_CHECK(peers.Drain(1));
+        events.Rearm(peers.vLocal[1], CSocketEvents::EVENT_RECV);
+        BOOST_CHECK(events.Wait(0, vEvents));
+        BOOST_CHECK(vEvents.empty());
+        peers.Send(1);
+        BOOST_CHECK(events.Wait(1000, vEvents));
+        BOOST_CHECK_EQUAL(vEvents.size(), 1U);
+        BOOST_CHECK(Readable(vEvents).count(1));
+
+        // A peer hanging up shows as readable
+        BOOST_CHECK(peers.Drain(1));
+        events.Rearm(peers.vLocal[1], CSocketEvents::EVENT_RECV);
+        CloseSocket(peers.vRemote[0]);
+        BOOST_CHECK(events.Wait(1000, vEvents));
+        BOOST_CHECK(Readable(vEvents).count(0));
+
+        // Removed sockets are not reported
+        events.Remove(peers.vLocal[1]);
+        BOOST_CHECK_EQUAL(events.size(), 1U);
+        peers.Send(1);
+        BOOST_CHECK(events.Wait(0, vEvents));
+        BOOST_CHECK(!Readable(vEvents).count(1));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_scaling)
+{
+    // More peers than select() could take; each uses two descriptors here
+    size_t nPeers = 1200;
+    struct rlimit limitFD;
+    if (getrlimit(RLIMIT_NOFILE, &limitFD) == 0) {
+        if (limitFD.rlim_cur < 2 * nPeers + 64) {
+            limitFD.rlim_cur = std::min((rlim_t)(2 * nPeers + 64), limitFD.rlim_max);
+            setrlimit(RLIMIT_NOFILE, &limitFD);
+            getrlimit(RLIMIT_NOFILE, &limitFD);
+        }
+        if (limitFD.rlim_cur < 2 * nPeers + 64)
+            nPeers = (limitFD.rlim_cur - 64) / 2;
+    }
+
+    PeerSimulator peers(nPeers);
+    nPeers = peers.vLocal.size();
+    BOOST_REQUIRE(nPeers > 0);
+
+    vector<CSocketEvents::Backend> vBackends = AvailableBackends();
+    for (size_t b = 0; b < vBackends.size(); b++) {
+        CSocketEvents events(vBackends[b]);
+        for (size_t i = 0; i < nPeers; i++)
+            BOOST_REQUIRE(events.Add(peers.vLocal[i], (void*)i));
+        vector<CSocketEvents::Event> vEvents;
+        size_t nWritable = 0;
+        while (nWritable < nPeers) {
+            BOOST_REQUIRE(events.Wait(1000, vEvents));
+            BOOST_REQUIRE(!vEvents.empty());
+            nWritable += vEvents.size();
+        }
+
+        // Each round a few peers send something; exactly those are reported
+        static const int ROUNDS = 200;
+        static const size_t ACTIVE_PEERS = 8;
+        int64_t nTimeWait = 0;
+        for (int nRound = 0; nRound < ROUNDS; nRound++) {
+            set<size_t> setActive;
+            while (setActive.size() < std::min(ACTIVE_PEERS, nPeers))
+                setActive.insert(GetRand(nPeers));
+            for (set<size_t>::iterator it = setActive.begin(); it != setActive.end(); it++)
+                peers.Send(*it);
+
+            set<size_t> setReady;
+            int64_t nTimeStart = GetTimeMicros();
+            while (setReady.size() < setActive.size()) {
+                BOOST_REQUIRE(events.Wait(1000, vEvents));
+                BOOST_REQUIRE(!vEvents.empty());
+                set<size_t> setNew = Readable(vEvents);
+                setReady.insert(setNew.begin(), setNew.end());
+            }
+            nTimeWait += GetTimeMicros() - nTimeStart;
+            BOOST_CHECK(setReady == setActive);
+
+            for (set<size_t>::iterator it = setActive.begin(); it != setActive.end(); it++) {
+                BOOST_CHECK(peers.Drain(*it));
+                events.Rearm(peers.vLocal[*it], CSocketEvents::EVENT_RECV);
+            }
+        }
+
+        BOOST_TEST_MESSAGE(strprintf("Socket events (%s), %u peers, %u active: %.1fus per wakeup",
+            events.GetBackendName(), nPeers, ACTIVE_PEERS, (double)nTimeWait / ROUNDS));
+    }
+}
+
+#endif // WIN32
+
+BOOST_AUTO_TEST_SUITE_END()
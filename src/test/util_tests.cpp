@@ -5,6 +5,7 @@
 #include "util.h"
 
 #include "clientversion.h"
+#include "hash.h"
 #include "primitives/transaction.h"
 #include "random.h"
 #include "sync.h"
@@ -309,6 +310,20 @@ BOOST_AUTO_TEST_CASE(gettime)
     BOOST_CHECK((GetTime() & ~0xFFFFFFFFLL) == 0);
 }
 
+BOOST_AUTO_TEST_CASE(util_GetThreadCPUTimeMicros)
+{
+    // Never negative and never goes back, whichever clock backs it
+    int64_t nLast = GetThreadCPUTimeMicros();
+    BOOST_CHECK(nLast >= 0);
+    uint256 hash;
+    for (int i = 0; i < 1000; i++) {
+        hash = Hash(BEGIN(hash), END(hash));
+        int64_t nNow = GetThreadCPUTimeMicros();
+        BOOST_CHECK(nNow >= nLast);
+        nLast = nNow;
+    }
+}
+
 BOOST_AUTO_TEST_CASE(test_ParseInt32)
 {
     int32_t n;
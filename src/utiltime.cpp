@@ -9,6 +9,16 @@
 
 #include "utiltime.h"
 
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN 1
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 
@@ -40,6 +50,24 @@ int64_t GetTimeMicros()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
 }
 
+int64_t GetThreadCPUTimeMicros()
+{
+#if defined(WIN32)
+    FILETIME ftCreation, ftExit, ftKernel, ftUser;
+    if (GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser)) {
+        // In units of 100ns
+        uint64_t nKernel = ((uint64_t)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+        uint64_t nUser = ((uint64_t)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+        return (nKernel + nUser) / 10;
+    }
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    return GetTimeMicros();
+}
+
 void MilliSleep(int64_t n)
 {
 
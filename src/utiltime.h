@@ -12,6 +12,8 @@
 int64_t GetTime();
 int64_t GetTimeMillis();
 int64_t GetTimeMicros();
+/** CPU time used by the calling thread, or wall time where that cannot be had */
+int64_t GetThreadCPUTimeMicros();
 void SetMockTime(int64_t nMockTimeIn);
 void MilliSleep(int64_t n);
 
@@ -10,7 +10,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70103;
+static const int PROTOCOL_VERSION = 70105;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -30,6 +30,14 @@ static const int MIN_EVOLUTION_PEER_PROTO_VERSION = 70103;
 //! minimum peer version for masterx winner broadcasts
 static const int MIN_GMW_PEER_PROTO_VERSION = 70103;
 
+//! In this version, masterx pings, InstantX votes and evolution votes can be
+//! signed over a hash of their binary fields (MESSAGE_VERSION_BINARY)
+static const int BINARY_SIGNED_MESSAGE_VERSION = 70104;
+
+//! In this version, blocks can be relayed as compact blocks: MSG_CMPCT_BLOCK
+//! getdata requests, answered with "cmpctblock", and "getblocktxn"/"blocktxn"
+static const int COMPACT_BLOCKS_VERSION = 70105;
+
 //! minimum peer version that can receive masterx payments
 // V1 - Last protocol version before update
 // V2 - Newest protocol version